@@ -0,0 +1,76 @@
+/**
+ * ESP32-OTA-Client Example: Async Update
+ *
+ * This example runs the periodic check and download on a background
+ * FreeRTOS task, so loop() keeps running while the firmware streams in.
+ */
+
+#include "ESP32OTAClient.h"
+#include <WiFi.h>
+
+// WiFi credentials
+const char* WIFI_SSID = "YOUR_SSID";
+const char* WIFI_PASS = "YOUR_PASSWORD";
+
+// OTA configuration
+#define JSON_URL "http://your-server/api/update?device=esp32"
+#define VERSION "1.0.0"
+
+// Check interval (5 minutes)
+#define CHECK_INTERVAL_MS (5 * 60 * 1000)
+
+OTAClient ota(JSON_URL, VERSION);
+
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+
+    Serial.println("\n=== ESP32 OTA Async Update Example ===");
+    Serial.printf("Current version: %s\n", VERSION);
+
+    // Connect to WiFi
+    Serial.printf("Connecting to %s", WIFI_SSID);
+    WiFi.begin(WIFI_SSID, WIFI_PASS);
+    while (!WiFi.isConnected()) {
+        Serial.print(".");
+        delay(500);
+    }
+    Serial.printf("\nConnected! IP: %s\n\n", WiFi.localIP().toString().c_str());
+
+    // Run updates on core 0, leaving core 1 to the Arduino loop
+    ota.setAsyncTask(0, 1, 8192);
+    ota.setAsyncMode(true);
+
+    // Progress is queued by the update task and delivered from ota.loop(),
+    // at most every 250 ms, so slow display code never stalls the download
+    ota.setProgressQueue(true);
+    ota.setProgressThrottle(250);
+    ota.onProgress([](int percent, int current, int total) {
+        Serial.printf("Update progress: %d%%\n", percent);
+    });
+
+    // Called from the update task when an attempt finishes
+    ota.onComplete([](int result) {
+        Serial.printf("Update finished with result %d\n", result);
+    });
+
+    ota.setCheckInterval(CHECK_INTERVAL_MS);
+
+    // Initial check in the background
+    ota.beginUpdateAsync(true);
+}
+
+void loop() {
+    // Returns immediately; the check runs on the update task
+    ota.loop();
+
+    // Your application code keeps running during the download
+    static unsigned long lastPrint = 0;
+    if (millis() - lastPrint > 1000) {
+        lastPrint = millis();
+        Serial.printf("Running... state=%d updating=%s\n", ota.getState(),
+                      ota.isUpdating() ? "yes" : "no");
+    }
+
+    delay(10);
+}
@@ -0,0 +1,129 @@
+/**
+ * ESP32-OTA-Client Example: Benchmark
+ *
+ * Downloads a test image repeatedly into the OTA slot and prints throughput
+ * for each transfer configuration: HTTP vs HTTPS, direct vs pipelined,
+ * pipeline slot sizes and raw vs gzip.
+ *
+ * Runs in dry-run mode: images are written and verified but the boot
+ * partition is never changed, so the device keeps running this sketch.
+ *
+ * Serve the same firmware image over HTTP and HTTPS. For the gzip runs the
+ * server must honour "Accept-Encoding: gzip" (or point TEST_IMAGE_GZ_URL at
+ * a .bin.gz file).
+ */
+
+#include "ESP32OTAClient.h"
+#include <WiFi.h>
+
+// WiFi credentials
+const char* WIFI_SSID = "YOUR_SSID";
+const char* WIFI_PASS = "YOUR_PASSWORD";
+
+// Test images (any valid app image for this chip)
+#define TEST_IMAGE_HTTP_URL "http://192.168.1.250:3000/bench/firmware.bin"
+#define TEST_IMAGE_HTTPS_URL "https://192.168.1.250:3443/bench/firmware.bin"
+#define TEST_IMAGE_GZ_URL "http://192.168.1.250:3000/bench/firmware.bin.gz"
+
+// Runs per configuration; the median is reported
+#define RUNS 3
+
+// The manifest URL is not used: images are fetched with doUpdate()
+OTAClient ota("", "0.0.0");
+
+struct BenchConfig {
+    const char* name;
+    const char* url;
+    bool pipelined;
+    size_t slotSize;
+    bool gzip;
+};
+
+const BenchConfig CONFIGS[] = {
+    {"http  direct",          TEST_IMAGE_HTTP_URL,  false, 0,     false},
+    {"http  pipelined 1K",    TEST_IMAGE_HTTP_URL,  true,  1024,  false},
+    {"http  pipelined 4K",    TEST_IMAGE_HTTP_URL,  true,  4096,  false},
+    {"http  pipelined 8K",    TEST_IMAGE_HTTP_URL,  true,  8192,  false},
+    {"https direct",          TEST_IMAGE_HTTPS_URL, false, 0,     false},
+    {"https pipelined 4K",    TEST_IMAGE_HTTPS_URL, true,  4096,  false},
+    {"gzip  direct",          TEST_IMAGE_GZ_URL,    false, 0,     true},
+    {"gzip  pipelined 4K",    TEST_IMAGE_GZ_URL,    true,  4096,  true},
+};
+
+OTAMetrics runOnce(const BenchConfig& config, int& result) {
+    ota.setPipelined(config.pipelined, OTA_PIPE_SLOTS,
+                     config.pipelined ? config.slotSize : OTA_PIPE_SLOT_SIZE);
+    ota.setCompression(config.gzip);
+    result = ota.doUpdate(config.url);
+    return ota.getMetrics();
+}
+
+void runConfig(const BenchConfig& config) {
+    OTAMetrics runs[RUNS];
+    int failures = 0;
+
+    for (int i = 0; i < RUNS; i++) {
+        int result;
+        runs[i] = runOnce(config, result);
+        if (result != OTA_UPDATE_OK) {
+            failures++;
+        }
+    }
+
+    // Sort by throughput and report the median run
+    for (int i = 1; i < RUNS; i++) {
+        for (int j = i; j > 0 && runs[j].bytesPerSecond < runs[j - 1].bytesPerSecond; j--) {
+            OTAMetrics tmp = runs[j];
+            runs[j] = runs[j - 1];
+            runs[j - 1] = tmp;
+        }
+    }
+    const OTAMetrics& m = runs[RUNS / 2];
+
+    Serial.printf("%-20s %7u KB/s %6u ms  conn %4u ms  flash %5u ms  stall %4u ms  heap %6u B  %s\n",
+                  config.name,
+                  (unsigned)(m.bytesPerSecond / 1024),
+                  (unsigned)m.downloadMs,
+                  (unsigned)(m.connectMs + m.tlsMs),
+                  (unsigned)m.flashWriteMs,
+                  (unsigned)m.maxWriteStallMs,
+                  (unsigned)m.peakHeapUsed,
+                  failures ? "FAILED" : "ok");
+}
+
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+
+    Serial.println("\n=== ESP32 OTA Benchmark ===");
+    Serial.printf("Chip: %s, CPU %u MHz, PSRAM %u bytes\n",
+                  ESP.getChipModel(), (unsigned)ESP.getCpuFreqMHz(),
+                  (unsigned)ESP.getPsramSize());
+
+    // Connect to WiFi
+    Serial.printf("Connecting to %s", WIFI_SSID);
+    WiFi.begin(WIFI_SSID, WIFI_PASS);
+    while (!WiFi.isConnected()) {
+        Serial.print(".");
+        delay(500);
+    }
+    Serial.printf("\nConnected! IP: %s, RSSI %d dBm\n\n",
+                  WiFi.localIP().toString().c_str(), WiFi.RSSI());
+
+    // Write and verify only, never switch the boot partition
+    ota.setDryRun(true);
+    ota.setResumable(false);
+
+    // Silence the default progress printout
+    ota.onProgress([](int percent, int current, int total) {});
+
+    Serial.printf("Median of %d runs per configuration\n\n", RUNS);
+    for (const BenchConfig& config : CONFIGS) {
+        runConfig(config);
+    }
+    Serial.println("\nBenchmark done.");
+}
+
+void loop() {
+    delay(1000);
+}
@@ -62,7 +62,7 @@ void loop() {
             Serial.println("\nChecking for updates...");
             
             if (ota.hasUpdate()) {
-                UpdateInfo info = ota.getUpdateInfo();
+                const UpdateInfo &info = ota.getUpdateInfo();
                 Serial.println("=====================================");
                 Serial.printf("  Update available: v%s\n", info.version.c_str());
                 Serial.println("  Press BOOT again to install");
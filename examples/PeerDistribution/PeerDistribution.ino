@@ -0,0 +1,62 @@
+/**
+ * ESP32-OTA-Client Example: Peer Distribution
+ *
+ * Devices on the same LAN share firmware: the first one to update
+ * downloads the image from the server, the others fetch it from a peer
+ * that already runs it. The manifest must list the image's "sha256";
+ * peer downloads are verified against it before they are installed.
+ */
+
+#include "ESP32OTAClient.h"
+#include <ESPmDNS.h>
+#include <WiFi.h>
+
+// WiFi credentials
+const char* WIFI_SSID = "YOUR_SSID";
+const char* WIFI_PASS = "YOUR_PASSWORD";
+
+// OTA configuration
+#define JSON_URL "http://your-server/api/update?device=esp32"
+#define VERSION "1.0.0"
+
+// Check interval (15 minutes)
+#define CHECK_INTERVAL_MS (15 * 60 * 1000)
+
+OTAClient ota(JSON_URL, VERSION);
+
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+
+    Serial.println("\n=== ESP32 OTA Peer Distribution Example ===");
+    Serial.printf("Current version: %s\n", VERSION);
+
+    // Connect to WiFi
+    Serial.printf("Connecting to %s", WIFI_SSID);
+    WiFi.begin(WIFI_SSID, WIFI_PASS);
+    while (!WiFi.isConnected()) {
+        Serial.print(".");
+        delay(500);
+    }
+    Serial.printf("\nConnected! IP: %s\n\n", WiFi.localIP().toString().c_str());
+
+    // Each device needs a unique mDNS host name
+    String host = "ota-" + WiFi.macAddress();
+    host.replace(":", "");
+    MDNS.begin(host.c_str());
+
+    // The new image has booted fine: keep it and offer it to neighbours
+    ota.markAsValid();
+    if (ota.beginPeerServer()) {
+        Serial.printf("Sharing firmware %s\n", ota.getLastInstalledHash().c_str());
+    }
+
+    // Prefer peers over the server, falling back to the server
+    ota.setPeerDownloads(true);
+    ota.setCheckInterval(CHECK_INTERVAL_MS);
+}
+
+void loop() {
+    ota.loop();
+    delay(10);
+}
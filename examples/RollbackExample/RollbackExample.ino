@@ -11,10 +11,6 @@ const char *currentVersion = "1.0.0";
 
 OTAClient ota(otaUrl, currentVersion);
 
-// Self-test flag (set this after your app validates itself)
-bool appValidated = false;
-unsigned long bootTime = 0;
-
 void setup() {
   Serial.begin(115200);
   delay(1000);
@@ -27,10 +23,24 @@ void setup() {
   Serial.print("Next Update Partition: ");
   Serial.println(ota.getNextUpdatePartition());
 
-  bootTime = millis();
-
   // Connect to WiFi
   WiFi.begin(ssid, password);
+
+  // Self-test run on the first boot of a new firmware. If a check fails
+  // within 30 seconds the device rolls back to the previous firmware.
+  ota.addWiFiCheck();
+  ota.addServerCheck();
+  ota.addHealthCheck("memory", checkMemory);
+  ota.addHealthCheck("sensors", checkSensors);
+  ota.onBootValidated([](OTABootResult result, const char *failedCheck) {
+    if (result == OTA_BOOT_VALIDATED) {
+      Serial.println("Self-test PASSED - firmware marked as valid");
+    } else if (result == OTA_BOOT_ROLLED_BACK) {
+      Serial.printf("Self-test FAILED (%s) - rolled back\n", failedCheck);
+    }
+  });
+  ota.validateBoot(30000);
+
   Serial.print("Connecting to WiFi");
   while (WiFi.status() != WL_CONNECTED) {
     delay(500);
@@ -38,26 +48,16 @@ void setup() {
   }
   Serial.println("\nWiFi connected!");
 
-  // Perform self-test to verify firmware stability
+#ifndef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+  // Without bootloader rollback validateBoot() cannot tell a new firmware
+  // apart and never runs the checks, so test by hand and roll back
   performSelfTest();
-
-  // If self-test passed, mark firmware as valid
-  if (appValidated) {
-    Serial.println("Self-test PASSED - Marking firmware as valid");
-    if (ota.markAsValid()) {
-      Serial.println("Firmware validated successfully!");
-    }
-  } else {
-    Serial.println("Self-test FAILED - Will rollback in 10 seconds");
-    delay(10000);
-    Serial.println("Performing rollback...");
-    ota.rollback(); // Will reboot to previous firmware
-  }
+#endif
 
   // Check for updates
   Serial.println("\n--- Checking for updates ---");
   if (ota.hasUpdate()) {
-    UpdateInfo info = ota.getUpdateInfo();
+    const UpdateInfo &info = ota.getUpdateInfo();
     Serial.print("Update available! Version: ");
     Serial.println(info.version);
     Serial.print("Download URL: ");
@@ -128,52 +128,58 @@ void loop() {
 }
 
 /**
- * Perform self-test to verify firmware stability
- * This should test critical functionality of your application
+ * Fallback self-test for builds without bootloader rollback
+ * Runs the same checks once and rolls back if any of them fails
  */
 void performSelfTest() {
   Serial.println("\n--- Performing Self-Test ---");
 
   bool allTestsPassed = true;
 
-  // Test 1: Check WiFi connectivity
   Serial.print("Test 1: WiFi... ");
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("PASS");
-  } else {
-    Serial.println("FAIL");
-    allTestsPassed = false;
-  }
+  bool wifiOk = WiFi.status() == WL_CONNECTED;
+  Serial.println(wifiOk ? "PASS" : "FAIL");
+  allTestsPassed = allTestsPassed && wifiOk;
 
-  // Test 2: Check free heap memory
   Serial.print("Test 2: Memory... ");
-  uint32_t freeHeap = ESP.getFreeHeap();
-  Serial.printf("%d bytes free... ", freeHeap);
-  if (freeHeap > 50000) { // At least 50KB free
-    Serial.println("PASS");
-  } else {
-    Serial.println("FAIL");
-    allTestsPassed = false;
-  }
+  bool memoryOk = checkMemory();
+  Serial.println(memoryOk ? "PASS" : "FAIL");
+  allTestsPassed = allTestsPassed && memoryOk;
 
-  // Test 3: Simulate critical sensor check
   Serial.print("Test 3: Sensors... ");
-  // Add your sensor initialization/checks here
-  // For this example, we'll just pass it
-  Serial.println("PASS");
+  bool sensorsOk = checkSensors();
+  Serial.println(sensorsOk ? "PASS" : "FAIL");
+  allTestsPassed = allTestsPassed && sensorsOk;
 
-  // Test 4: Configuration validation
-  Serial.print("Test 4: Configuration... ");
-  // Check if critical configuration is valid
-  // For this example, we'll just pass it
-  Serial.println("PASS");
+  Serial.println("------------------------");
+  if (allTestsPassed) {
+    Serial.println("Self-test PASSED");
+    ota.markAsValid();
+  } else if (ota.canRollback()) {
+    Serial.println("Self-test FAILED - Will rollback in 10 seconds");
+    delay(10000);
+    ota.rollback(); // Will reboot to previous firmware
+  } else {
+    Serial.println("Self-test FAILED - no firmware to roll back to");
+  }
+}
 
-  // Set validation flag
-  appValidated = allTestsPassed;
+/**
+ * Health check: enough free heap for the application
+ */
+bool checkMemory() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  Serial.printf("%u bytes free\n", (unsigned)freeHeap);
+  return freeHeap > 50000; // At least 50KB free
+}
 
-  Serial.println("------------------------");
-  Serial.print("Overall Result: ");
-  Serial.println(allTestsPassed ? "PASS ✓" : "FAIL ✗");
+/**
+ * Health check: critical sensors respond
+ */
+bool checkSensors() {
+  // Add your sensor initialization/checks here
+  // For this example, we'll just pass it
+  return true;
 }
 
 /**
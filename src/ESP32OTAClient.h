@@ -16,8 +16,27 @@
  *   - Auto-update on check (checkUpdate)
  *   - Rollback to previous firmware version
  *   - Progress callback support
- *   - Periodic auto-check with setCheckInterval
- *   - EEPROM-based duplicate prevention for force updates
+ *   - Periodic auto-check with setCheckInterval, with jitter, backoff,
+ *     Retry-After and a server-provided poll interval
+ *   - Persisted duplicate prevention for force updates
+ *   - All persistent state in one versioned NVS record
+ *   - Background (FreeRTOS task) updates with beginUpdateAsync
+ *   - Pipelined download: network reader and flash writer on separate cores
+ *   - Sector-aligned flash writes with background look-ahead erase
+ *   - Optional skipping of sectors the target slot already holds
+ *   - Resumable downloads (HTTP Range) with NVS checkpoints
+ *   - Conditional manifest requests (ETag / 304 Not Modified)
+ *   - Streaming, filtered manifest parsing with bounded memory
+ *   - Numeric semantic version comparison (OTAVersion)
+ *   - Delta updates: bsdiff patches applied against the running firmware
+ *   - Gzip-compressed firmware, inflated on the fly
+ *   - Persistent HTTP/1.1 connection reused across manifest, redirects and
+ *     firmware requests to the same host
+ *   - TLS certificate validation (CA certificate / bundle) and public key
+ *     pinning
+ *   - SHA-256 (and optional signature) check of the image, hashed inline
+ *   - Replaceable transport, image writer and storage (OTACore.h) and
+ *     portable manifest handling (OTAManifest.h), with host tests in test/
  *
  * Server Response Format:
  *   {
@@ -26,7 +45,10 @@
  *         "device": "ESP32-S3",
  *         "version": "1.0.1",
  *         "force": false,
- *         "url": "http://example.com/firmware-v1.0.1-1766657621922.bin"
+ *         "url": "http://example.com/firmware-v1.0.1-1766657621922.bin",
+ *         "patches": {
+ *           "1.0.0": "http://example.com/firmware-v1.0.0-v1.0.1.patch"
+ *         }
  *       }
  *     ]
  *   }
@@ -37,459 +59,5004 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
-#include <EEPROM.h>
+#include <ESPmDNS.h>
 #include <HTTPClient.h>
 #include <Update.h>
+#include <Preferences.h>
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
+#include <atomic>
+#include <esp_attr.h>
 #include <esp_ota_ops.h>
+#include <esp_heap_caps.h>
+#include <esp_image_format.h>
 #include <esp_partition.h>
+#include <esp_task_wdt.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <functional>
+#include <mdns.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/x509_crt.h>
+#include <rom/miniz.h>
+#include <time.h>
 
-// EEPROM
+#include "OTACore.h"
+#include "OTAManifest.h"
+
+// Legacy EEPROM record (migrated to the NVS state blob on first boot)
 #define OTA_EEPROM_SIZE 128
 #define OTA_EEPROM_START_ADDR 0
 #define OTA_EEPROM_MAGIC 0xAA55
 
+// Persistent state (record keys and sizes are in OTACore.h)
+#define OTA_STATS_FLUSH_CHECKS 16 // Statistics are written every N checks
+
+// Background update task defaults
+#define OTA_TASK_STACK_SIZE 8192
+#define OTA_TASK_PRIORITY 1
+#define OTA_TASK_CORE 0
+
+// Transfer buffers
+#define OTA_BUFFER_SIZE 512
+#define OTA_PIPE_SLOTS 4
+#define OTA_PIPE_SLOT_SIZE 4096
+#define OTA_WRITER_STACK_SIZE 4096
+
+// Flash writer
+#define OTA_SECTOR_SIZE 4096
+#define OTA_ERASE_AHEAD_SECTORS 16
+#define OTA_ERASER_STACK_SIZE 3072
+#define OTA_COMPARE_CHUNK 256 // Read-back buffer for OTA_ERASE_CHANGED
+
+// Resume checkpoints (NVS)
+#define OTA_NVS_NAMESPACE "ota"
+#define OTA_RESUME_CHECKPOINT (64 * 1024)
+
+// Stalled downloads
+#define OTA_STALL_TIMEOUT 15000      // ms without data, 0 = never
+#define OTA_MIN_THROUGHPUT 0         // bytes/s, 0 = no minimum
+#define OTA_THROUGHPUT_WINDOW 10000  // ms the minimum is averaged over
+#define OTA_STALL_RETRIES 2          // Attempts after the first one
+
+// Boot validation
+#define OTA_MAX_HEALTH_CHECKS 4
+#define OTA_VALIDATE_BUDGET 30000 // ms for all health checks together
+#define OTA_VALIDATE_POLL 100     // ms between calls of a failing check
+#define OTA_BOOT_MAGIC 0x4F544142 // "OTAB"
+
+// Rollout gating
+#define OTA_MAX_COHORTS 4
+#define OTA_ROLLOUT_BUCKETS 10000 // Rollout resolution: 0.01 %
+
+// Delta updates
+#define OTA_DELTA_MAGIC "ENDSLEY/BSDIFF43"
+#define OTA_DELTA_HEADER_SIZE 24
+#define OTA_DELTA_CTRL_SIZE 24
+#define OTA_DELTA_BUFFER_SIZE 256
+
+// Progress events
+#define OTA_PROGRESS_QUEUE_SIZE 8 // Power of two
+
+// Compressed downloads
+#define OTA_GZIP_HEADER_SIZE 10
+
+// Manifest parsing
+#define OTA_MANIFEST_MAX_SIZE 8192
+
+// Periodic check scheduler
+#define OTA_BACKOFF_MAX (6UL * 60 * 60 * 1000) // Longest retry delay (ms)
+#define OTA_JITTER_DEFAULT -1                   // 10% of the interval
+
+// Connections and TLS
+#define OTA_TLS_MAX_PINS 4
+#define OTA_TLS_HANDSHAKE_TIMEOUT 30 // seconds
+#define OTA_CONNECT_TIMEOUT 5000     // ms
+#define OTA_TLS_KEY_DER_MAX 600      // Fits an RSA-4096 public key
+
+// Multi-image updates (OTA_MAX_IMAGES and the other UpdateInfo limits are
+// in OTAManifest.h)
+#define OTA_DATA_SUBTYPE_MIN 0x06 // Below: otadata, phy, nvs, coredump, keys
+
+// Push-triggered checks
+#define OTA_PUSH_STACK_SIZE 8192          // Enough for a TLS handshake
+#define OTA_PUSH_TIMEOUT 60000            // Wait before re-polling (ms)
+#define OTA_PUSH_RETRY_MIN 1000           // First reconnect delay (ms)
+#define OTA_PUSH_RETRY_MAX (5UL * 60 * 1000)
+#define OTA_PUSH_SPREAD 5000              // Default random check delay (ms)
+
+// LAN peer distribution
+#define OTA_PEER_PORT 8266
+#define OTA_PEER_SERVICE "esp-ota" // mDNS service, announced as _esp-ota._tcp
+#define OTA_PEER_STACK_SIZE 4096
+#define OTA_PEER_CHUNK 1024
+#define OTA_PEER_LINE_MAX 128
+
+// Result codes returned by update(), checkUpdate(), doUpdate() and rollback()
+#define OTA_UPDATE_OK 1
+#define OTA_UPDATE_STAGED 2 // Installed, waiting for activateStaged()
+#define OTA_NO_UPDATE 0
+#define OTA_ERR_NO_PARTITION -1
+#define OTA_ERR_SET_BOOT -2
+#define OTA_ERR_DOWNLOAD -3
+#define OTA_ERR_NO_SPACE -4
+#define OTA_ERR_UPDATE -5
+#define OTA_ERR_BUSY -6
+#define OTA_ERR_VERIFY -7
+#define OTA_ERR_STALLED -8
+
 // Progress callback: (percent, bytesWritten, totalBytes)
 typedef std::function<void(int, int, int)> OTAProgressCallback;
 
 /**
- * @brief Update information structure
+ * @brief Detailed transfer progress
  */
-struct UpdateInfo {
-  bool available = false;
-  bool force = false;
-  String version = "";
-  String url = "";
-  String filename = "";
+struct OTAProgress {
+  int percent = 0;
+  size_t downloaded = 0; // Bytes received (compressed size for gzip/patches)
+  size_t total = 0;      // Download size from Content-Length
+  size_t written = 0;    // Image bytes written to flash (uncompressed)
 };
 
+// Detailed progress callback, see OTAProgress
+typedef std::function<void(const OTAProgress &)> OTAProgressDetailCallback;
+
+// Completion callback: (result code, see OTA_UPDATE_OK / OTA_ERR_*)
+typedef std::function<void(int)> OTACompleteCallback;
+
+// Health check for validateBoot(): true once the check passes
+typedef std::function<bool()> OTAHealthCheck;
+
 /**
- * @brief ESP32 OTA Client class
- *
- * Example usage:
- * @code
- * #include "ESP32OTAClient.h"
+ * @brief Timing and throughput of the last check or update attempt
  *
- * OTAClient ota("http://server/api/update?device=esp32", "1.0.0");
+ * Connection phases are summed over every request of the attempt
+ * (manifest, redirects, firmware); a kept-alive connection costs nothing.
+ */
+struct OTAMetrics {
+  uint32_t dnsMs = 0;       // Host name resolution
+  uint32_t connectMs = 0;   // TCP connect (plain HTTP)
+  uint32_t tlsMs = 0;       // TCP connect + TLS handshake (HTTPS)
+  uint32_t ttfbMs = 0;      // Request sent until response headers arrived
+  uint32_t manifestMs = 0;  // Whole manifest check
+  uint32_t downloadMs = 0;  // Firmware body transfer
+  size_t downloaded = 0;    // Firmware body bytes received
+  uint32_t bytesPerSecond = 0;
+  uint32_t flashWriteMs = 0;     // Total time spent writing to flash
+  uint32_t maxWriteStallMs = 0;  // Longest single flash write
+  uint8_t redirects = 0;
+  uint8_t retries = 0;      // Reconnects, restarted resumes, delta fallback
+  uint32_t peakHeapUsed = 0; // Largest heap drop seen during the attempt
+};
+
+// Metrics callback, see OTAMetrics
+typedef std::function<void(const OTAMetrics &)> OTAMetricsCallback;
+
+/**
+ * @brief Power/performance settings applied while an image downloads
  *
- * void setup() {
- *     WiFi.begin("SSID", "PASSWORD");
- *     while (!WiFi.isConnected()) delay(100);
+ * The defaults favour speed: a transfer that finishes 3-4x sooner usually
+ * costs less energy overall than a slow one at low clock.
+ */
+struct OTATransferProfile {
+  uint32_t cpuMhz = 240;    // CPU frequency (80/160/240), 0 = unchanged
+  bool noModemSleep = true; // WiFi power save off (WIFI_PS_NONE)
+};
+
+/**
+ * @brief Applies an OTATransferProfile for its lifetime
  *
- *     // Check and update
- *     if (ota.hasUpdate()) {
- *         ota.update();
- *     }
- * }
- * @endcode
+ * Restores the previous CPU frequency and WiFi power save mode when it
+ * goes out of scope, so every exit path of a download puts them back.
  */
-class OTAClient {
+class OTAProfileScope {
+public:
+  /**
+   * @param profile Settings to apply, nullptr to change nothing
+   */
+  explicit OTAProfileScope(const OTATransferProfile *profile) {
+    if (profile == nullptr) {
+      return;
+    }
+    uint32_t current = getCpuFrequencyMhz();
+    if (profile->cpuMhz > 0 && profile->cpuMhz != current &&
+        setCpuFrequencyMhz(profile->cpuMhz)) {
+      _cpuMhz = current;
+    }
+    if (profile->noModemSleep && esp_wifi_get_ps(&_ps) == ESP_OK &&
+        _ps != WIFI_PS_NONE) {
+      _psChanged = esp_wifi_set_ps(WIFI_PS_NONE) == ESP_OK;
+    }
+  }
+
+  ~OTAProfileScope() {
+    if (_psChanged) {
+      esp_wifi_set_ps(_ps);
+    }
+    if (_cpuMhz > 0) {
+      setCpuFrequencyMhz(_cpuMhz);
+    }
+  }
+
+  OTAProfileScope(const OTAProfileScope &) = delete;
+  OTAProfileScope &operator=(const OTAProfileScope &) = delete;
+
 private:
-  String _jsonUrl;
-  String _currentVersion;
-  unsigned long _lastCheck = 0;
-  unsigned long _checkInterval = 0;
-  OTAProgressCallback _progressCallback = nullptr;
-  bool _eepromInitialized = false;
-  String _lastInstalledFilename = "";
-  UpdateInfo _updateInfo;
+  uint32_t _cpuMhz = 0; // Frequency to restore, 0 if unchanged
+  wifi_ps_type_t _ps = WIFI_PS_NONE;
+  bool _psChanged = false;
+};
 
-  void log(const char *msg) {
-    Serial.print("[OTA] ");
-    Serial.println(msg);
+/**
+ * @brief Client state, readable from any task via getState()
+ */
+enum OTAState {
+  OTA_STATE_IDLE = 0,
+  OTA_STATE_CHECKING,
+  OTA_STATE_DOWNLOADING,
+  OTA_STATE_REBOOTING,
+  OTA_STATE_UP_TO_DATE,
+  OTA_STATE_FAILED,
+  OTA_STATE_STAGED // A verified update waits in the inactive slot
+};
+
+/**
+ * @brief What happens once an update is written and verified
+ */
+enum OTAStageMode {
+  OTA_STAGE_OFF = 0,  // Boot the new image right away (reboots)
+  OTA_STAGE_MANUAL,   // Keep it staged until activateStaged() or the
+                      // activation window
+  OTA_STAGE_NEXT_BOOT // Make it bootable now, it runs after the next
+                      // reboot, whatever causes it
+};
+
+/**
+ * @brief OTAStorage in the "ota" NVS namespace
+ */
+class OTAPreferencesStorage : public OTAStorage {
+public:
+  bool begin(bool readOnly) override {
+    return _prefs.begin(OTA_NVS_NAMESPACE, readOnly);
   }
+  void end() override { _prefs.end(); }
 
-  void log(const char *msg, const char *param) {
-    Serial.print("[OTA] ");
-    Serial.print(msg);
-    Serial.println(param);
+  String getString(const char *key) override { return _prefs.getString(key); }
+  void putString(const char *key, const String &value) override {
+    _prefs.putString(key, value);
+  }
+  uint32_t getUInt(const char *key, uint32_t defaultValue) override {
+    return _prefs.getUInt(key, defaultValue);
+  }
+  void putUInt(const char *key, uint32_t value) override {
+    _prefs.putUInt(key, value);
+  }
+  size_t getBytes(const char *key, void *buf, size_t len) override {
+    return _prefs.getBytes(key, buf, len);
+  }
+  void putBytes(const char *key, const void *buf, size_t len) override {
+    _prefs.putBytes(key, buf, len);
+  }
+  void remove(const char *key) override { _prefs.remove(key); }
+
+private:
+  Preferences _prefs;
+};
+
+/**
+ * @brief Outcome of OTAClient::validateBoot()
+ */
+enum OTABootResult {
+  OTA_BOOT_NORMAL = 0,  // Not the first boot of an update
+  OTA_BOOT_VALIDATED,   // First boot of an update, every check passed
+  OTA_BOOT_ROLLED_BACK, // Reported by the old app: the update failed a check
+  OTA_BOOT_FAILED       // A check failed, but no other app could boot
+};
+
+// Boot validation callback: (result, name of the failed check or "")
+typedef std::function<void(OTABootResult, const char *)> OTABootCallback;
+
+/**
+ * @brief Last boot validation, kept in RTC memory across resets
+ *
+ * Lets validateBoot() recognise an app it already validated without
+ * reading otadata from flash. Not initialised at startup: after power-on
+ * the content is random, which the magic and checksum reject.
+ */
+struct OTABootRecord {
+  uint32_t magic;
+  uint32_t partition; // Address of the app the record is about
+  uint32_t version;   // Hash of that app's version string
+  uint32_t result;    // OTABootResult
+  char failed[OTA_CHECK_NAME_MAX];
+  char versionName[OTA_VERSION_MAX]; // Reported by the app rolled back to
+  uint32_t checksum;
+
+  uint32_t sum() const {
+    return magic ^ partition ^ (version * 31) ^ (result << 24) ^ 0x5A5A5A5A;
   }
+  bool valid() const {
+    return magic == OTA_BOOT_MAGIC && checksum == sum() &&
+           failed[sizeof(failed) - 1] == '\0' &&
+           versionName[sizeof(versionName) - 1] == '\0';
+  }
+
+  void set(uint32_t address, uint32_t versionHash, const char *name,
+           OTABootResult outcome, const char *check) {
+    magic = OTA_BOOT_MAGIC;
+    partition = address;
+    version = versionHash;
+    result = outcome;
+    memset(failed, 0, sizeof(failed));
+    memset(versionName, 0, sizeof(versionName));
+    strlcpy(failed, check, sizeof(failed));
+    strlcpy(versionName, name, sizeof(versionName));
+    checksum = sum();
+  }
+};
+
+/**
+ * @brief Sector-aligned writer for an OTA or data partition
+ *
+ * Incoming data of any size is coalesced into 4 KB blocks that are written
+ * on sector boundaries, so flash is only touched in whole sectors. Erasing
+ * runs on a separate task ahead of the write cursor (or over the whole image
+ * range) so the transfer loop rarely waits on a sector erase.
+ *
+ * App images are written straight to the partition and only become
+ * bootable through activate(), which runs the bootloader image check.
+ *
+ * This is the default OTAImageWriter; OTAClient::setFlashWriter() installs
+ * another one.
+ */
+class OTAFlashWriter : public OTAImageWriter {
+public:
+  ~OTAFlashWriter() override { abort(); }
 
   /**
-   * @brief Extract filename from URL
-   * @param url The firmware URL
-   * @return Filename extracted from URL
+   * @brief Prepare a partition for writing
+   * @param label Label of an app or data partition
+   * @param size Total image size in bytes, 0 if unknown (compressed streams)
+   * @param mode Erase strategy
+   * @param offset Resume offset; must be sector aligned and already written
+   * @return true on success, false if there is no such partition or the
+   * image does not fit
    */
-  String extractFilename(const String &url) {
-    int lastSlash = url.lastIndexOf('/');
-    if (lastSlash >= 0 && lastSlash < (int)url.length() - 1) {
-      String filename = url.substring(lastSlash + 1);
-      // Remove query parameters if any
-      int queryIndex = filename.indexOf('?');
-      if (queryIndex > 0) {
-        filename = filename.substring(0, queryIndex);
-      }
-      return filename;
+  bool begin(const char *label, size_t size,
+             OTAEraseMode mode = OTA_ERASE_LOOKAHEAD,
+             size_t offset = 0) override {
+    const esp_partition_t *partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (partition == nullptr) {
+      partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                           ESP_PARTITION_SUBTYPE_ANY, label);
     }
-    return "";
+    return begin(partition, size, mode, offset);
   }
 
   /**
-   * @brief Initialize EEPROM and load last installed filename
+   * @brief Prepare a partition for writing
+   * @param partition Target partition
+   * @see begin(const char *, size_t, OTAEraseMode, size_t)
    */
-  void initEEPROM() {
-    if (_eepromInitialized)
-      return;
+  bool begin(const esp_partition_t *partition, size_t size,
+             OTAEraseMode mode = OTA_ERASE_LOOKAHEAD, size_t offset = 0) {
+    abort();
+    _exact = size > 0;
+    if (size == 0 && partition != nullptr) {
+      size = partition->size;
+    }
+    if (partition == nullptr || size > partition->size || offset >= size ||
+        offset % OTA_SECTOR_SIZE != 0) {
+      return false;
+    }
+    // The other app slot is the rollback image until the running app is
+    // validated; esp_ota_begin() refuses it as well
+    if (partition->type == ESP_PARTITION_TYPE_APP && pendingVerify()) {
+      return false;
+    }
 
-    EEPROM.begin(OTA_EEPROM_SIZE);
+    _buffer = (uint8_t *)heap_caps_malloc(OTA_SECTOR_SIZE,
+                                          MALLOC_CAP_INTERNAL |
+                                              MALLOC_CAP_8BIT);
+    if (_buffer == nullptr) {
+      return false;
+    }
 
-    // Check magic number
-    uint16_t magic;
-    EEPROM.get(OTA_EEPROM_START_ADDR, magic);
+    _partition = partition;
+    _size = size;
+    _eraseEnd = (size + OTA_SECTOR_SIZE - 1) & ~(OTA_SECTOR_SIZE - 1);
+    _offset = offset;
+    _fill = 0;
+    _erased = offset;
+    _mode = mode;
+    _error = false;
+    _eraseFailed = false;
+    _stopEraser = false;
+    _hashed = false;
+    _skipped = 0;
 
-    if (magic == OTA_EEPROM_MAGIC) {
-      // Read stored filename length
-      uint8_t len = EEPROM.read(OTA_EEPROM_START_ADDR + 2);
-      if (len > 0 && len < OTA_EEPROM_SIZE - 3) {
-        char buffer[len + 1];
-        for (int i = 0; i < len; i++) {
-          buffer[i] = EEPROM.read(OTA_EEPROM_START_ADDR + 3 + i);
+    // Comparing needs the old content, so nothing may be erased ahead
+    if (_mode != OTA_ERASE_LAZY && _mode != OTA_ERASE_CHANGED) {
+      _eraserDone = xSemaphoreCreateBinary();
+      if (_eraserDone == nullptr ||
+          xTaskCreatePinnedToCore(eraserTaskEntry, "ota_eraser",
+                                  OTA_ERASER_STACK_SIZE, this, 1, NULL,
+                                  tskNO_AFFINITY) != pdPASS) {
+        if (_eraserDone != nullptr) {
+          vSemaphoreDelete(_eraserDone);
+          _eraserDone = nullptr;
         }
-        buffer[len] = '\0';
-        _lastInstalledFilename = String(buffer);
-        log("Last installed firmware: ", _lastInstalledFilename.c_str());
+        _mode = OTA_ERASE_LAZY;
       }
-    } else {
-      log("EEPROM not initialized, no previous firmware record");
     }
-
-    _eepromInitialized = true;
+    return true;
   }
 
   /**
-   * @brief Save firmware filename to EEPROM
-   * @param filename The firmware filename to save
-   * @return true on success, false on error
+   * @brief Append image data
+   * @param data Image bytes
+   * @param len Number of bytes
+   * @return true on success, false on flash error or image overflow
    */
-  bool saveFilenameToEEPROM(const String &filename) {
-    if (!_eepromInitialized) {
-      initEEPROM();
+  bool write(const uint8_t *data, size_t len) override {
+    if (_error || _buffer == nullptr || written() + len > _size) {
+      _error = true;
+      return false;
     }
 
-    if (filename.length() >= OTA_EEPROM_SIZE - 3) {
-      log("Filename too long to save");
+    // Reject anything that is not an app image before touching flash
+    if (written() == 0 && len > 0 && isApp() &&
+        data[0] != ESP_IMAGE_HEADER_MAGIC) {
+      _error = true;
       return false;
     }
 
-    // Write magic number
-    EEPROM.put(OTA_EEPROM_START_ADDR, (uint16_t)OTA_EEPROM_MAGIC);
+    while (len > 0) {
+      size_t n = min(len, (size_t)OTA_SECTOR_SIZE - _fill);
+      memcpy(_buffer + _fill, data, n);
+      _fill += n;
+      data += n;
+      len -= n;
 
-    // Write filename length
-    EEPROM.write(OTA_EEPROM_START_ADDR + 2, (uint8_t)filename.length());
+      if (_fill == OTA_SECTOR_SIZE && !flush()) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-    // Write filename
-    for (int i = 0; i < (int)filename.length(); i++) {
-      EEPROM.write(OTA_EEPROM_START_ADDR + 3 + i, filename.charAt(i));
+  /**
+   * @brief SHA-256 the image as it is flushed, call right after begin()
+   *
+   * Uses the mbedTLS SHA-256 implementation, which is hardware accelerated
+   * on ESP32. Hashing happens in flush(), so it runs on whichever task
+   * writes to flash.
+   * @param state Context saved by hashState() at the resume offset, or
+   * nullptr when writing from byte 0
+   * @param size Bytes in state
+   * @return false if state is not an mbedTLS context of this build
+   */
+  bool beginHash(const uint8_t *state = nullptr, size_t size = 0) override {
+    endHash();
+    mbedtls_sha256_context resume;
+    if (state != nullptr && size != sizeof(resume)) {
+      return false;
+    }
+    mbedtls_sha256_init(&_sha);
+    if (state != nullptr) {
+      memcpy(&resume, state, sizeof(resume));
+      mbedtls_sha256_clone(&_sha, &resume);
+    } else {
+      mbedtls_sha256_starts(&_sha, 0);
     }
+    _hashing = true;
+    return true;
+  }
 
-    if (EEPROM.commit()) {
-      _lastInstalledFilename = filename;
-      log("Saved firmware filename: ", filename.c_str());
-      return true;
+  /**
+   * @brief Snapshot the hash context covering exactly flushed() bytes
+   *
+   * The copy is a software context (see mbedtls_sha256_clone()), so it
+   * holds no reference to the hardware unit and can be stored as bytes.
+   * @return sizeof(mbedtls_sha256_context), 0 if not hashing
+   */
+  size_t hashState(uint8_t *state, size_t capacity) override {
+    mbedtls_sha256_context copy;
+    if (!_hashing || capacity < sizeof(copy)) {
+      return 0;
     }
+    mbedtls_sha256_init(&copy);
+    mbedtls_sha256_clone(&copy, &_sha);
+    memcpy(state, &copy, sizeof(copy));
+    return sizeof(copy);
+  }
 
-    log("Failed to save filename to EEPROM");
-    return false;
+  const uint8_t *digest() const override {
+    return _hashed ? _digest : nullptr;
   }
 
   /**
-   * @brief Follow HTTP redirects and return final response code
-   * @param http HTTPClient instance
-   * @param url Initial URL to request
-   * @param maxRedirects Maximum number of redirects to follow (default 5)
-   * @return Final HTTP response code
+   * @brief Flush the last partial sector
+   *
+   * The image format is checked by activate() (esp_ota_set_boot_partition
+   * verifies the image), so this does not read the partition back.
+   * @return true if the full image was written
    */
-  int followRedirects(HTTPClient &http, const String &url,
-                      int maxRedirects = 5) {
-    String currentUrl = url;
-    int redirectCount = 0;
+  bool end() override {
+    bool ok = !_error && _buffer != nullptr;
+    if (ok && _fill > 0) {
+      ok = flush();
+    }
+    stopEraser();
+    ok = ok && written() > 0 && (!_exact || written() == _size);
+    release();
 
-    while (redirectCount < maxRedirects) {
-      // Determine if URL is HTTPS
-      bool isHttps = currentUrl.startsWith("https://");
+    if (ok && _hashing) {
+      mbedtls_sha256_finish(&_sha, _digest);
+      _hashed = true;
+    }
+    endHash();
+    return ok;
+  }
 
-      if (isHttps) {
-        WiFiClientSecure *client = new WiFiClientSecure();
-        client->setInsecure(); // Skip certificate validation
-        http.begin(*client, currentUrl);
-      } else {
-        http.begin(currentUrl);
-      }
+  /**
+   * @brief Make the written app image the boot partition
+   *
+   * Fails if the image does not pass ESP-IDF's image verification.
+   * @return true on success, false on error
+   */
+  bool activate() override {
+    return _partition != nullptr && isApp() &&
+           esp_ota_set_boot_partition(_partition) == ESP_OK;
+  }
 
-      http.setTimeout(30000);
-      http.setFollowRedirects(HTTPC_DISABLE_FOLLOW_REDIRECTS);
+  /**
+   * @brief Run ESP-IDF's image verification on the written app image
+   *
+   * activate() does this implicitly; images that stay in the slot for
+   * later activation are checked with this instead.
+   * @return true if the image is a valid app image
+   */
+  bool verify() override {
+    if (_partition == nullptr || !isApp()) {
+      return false;
+    }
+    esp_partition_pos_t pos = {_partition->address, _partition->size};
+    esp_image_metadata_t meta;
+    return esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &pos, &meta) == ESP_OK;
+  }
 
-      int httpCode = http.GET();
+  /**
+   * @brief Stop writing and release buffers; partition content is undefined
+   */
+  void abort() override {
+    stopEraser();
+    release();
+    endHash();
+  }
 
-      // Check if response is a redirect
-      if (httpCode == 301 || httpCode == 302 || httpCode == 307 ||
-          httpCode == 308) {
-        String newUrl = http.getLocation();
-        http.end();
+  size_t written() const override { return _offset + _fill; }
+  size_t skipped() const override { return _skipped; }
+  size_t flushed() const override { return _offset; }
+  const char *label() const override {
+    return _partition != nullptr ? _partition->label : "";
+  }
+  size_t size() const { return _size; }
+  const esp_partition_t *partition() const { return _partition; }
 
-        if (newUrl.isEmpty()) {
-          log("Redirect without Location header");
-          return httpCode;
+  /**
+   * @brief Check whether the running app still awaits validation
+   * @return true while it is ESP_OTA_IMG_PENDING_VERIFY
+   */
+  static bool pendingVerify() {
+    esp_ota_img_states_t state;
+    return esp_ota_get_state_partition(esp_ota_get_running_partition(),
+                                       &state) == ESP_OK &&
+           state == ESP_OTA_IMG_PENDING_VERIFY;
+  }
+
+private:
+  const esp_partition_t *_partition = nullptr;
+  uint8_t *_buffer = nullptr;
+  size_t _size = 0;
+  bool _exact = true; // false: _size is only the partition capacity
+  size_t _eraseEnd = 0;
+  size_t _offset = 0; // Start of the sector in _buffer
+  size_t _fill = 0;   // Bytes buffered for that sector
+  OTAEraseMode _mode = OTA_ERASE_LOOKAHEAD;
+  bool _error = false;
+  volatile size_t _erased = 0; // Everything below this offset is erased
+  volatile bool _eraseFailed = false;
+  volatile bool _stopEraser = false;
+  SemaphoreHandle_t _eraserDone = nullptr;
+  mbedtls_sha256_context _sha;
+  bool _hashing = false;
+  bool _hashed = false;
+  uint8_t _digest[32];
+  size_t _skipped = 0;
+
+  static_assert(sizeof(mbedtls_sha256_context) <= OTA_HASH_STATE_MAX,
+                "OTA_HASH_STATE_MAX cannot hold a SHA-256 context");
+
+  bool isApp() const {
+    return _partition != nullptr && _partition->type == ESP_PARTITION_TYPE_APP;
+  }
+
+  /**
+   * @brief Write the buffered sector, erasing it first if needed
+   */
+  bool flush() {
+    // Pad the tail to the 16-byte flash encryption block
+    size_t len = (_fill + 15) & ~(size_t)15;
+    memset(_buffer + _fill, 0xFF, len - _fill);
+
+    if (_mode == OTA_ERASE_CHANGED && sectorUnchanged()) {
+      _skipped++;
+    } else if (_mode == OTA_ERASE_LAZY || _mode == OTA_ERASE_CHANGED) {
+      if (esp_partition_erase_range(_partition, _offset, OTA_SECTOR_SIZE) !=
+              ESP_OK ||
+          esp_partition_write(_partition, _offset, _buffer, len) != ESP_OK) {
+        _error = true;
+        return false;
+      }
+    } else {
+      while (_erased <= _offset) {
+        if (_eraseFailed) {
+          _error = true;
+          return false;
         }
+        vTaskDelay(1);
+      }
+      if (esp_partition_write(_partition, _offset, _buffer, len) != ESP_OK) {
+        _error = true;
+        return false;
+      }
+    }
 
-        log("Following redirect to: ", newUrl.c_str());
-        currentUrl = newUrl;
-        redirectCount++;
-      } else {
-        // Not a redirect, return the response code
-        return httpCode;
+    if (_hashing) {
+      mbedtls_sha256_update(&_sha, _buffer, _fill);
+    }
+    _offset += _fill;
+    _fill = 0;
+    return true;
+  }
+
+  /**
+   * @brief Compare the buffered sector with what the partition holds
+   *
+   * Reads go through the flash cache (and decryption, if enabled), which is
+   * far cheaper than an erase plus write.
+   */
+  bool sectorUnchanged() {
+    uint8_t old[OTA_COMPARE_CHUNK];
+    for (size_t pos = 0; pos < _fill; pos += sizeof(old)) {
+      size_t n = min(sizeof(old), _fill - pos);
+      if (esp_partition_read(_partition, _offset + pos, old, n) != ESP_OK ||
+          memcmp(old, _buffer + pos, n) != 0) {
+        return false;
       }
     }
+    return true;
+  }
 
-    log("Too many redirects");
-    return -1; // Too many redirects
+  void stopEraser() {
+    if (_eraserDone != nullptr) {
+      _stopEraser = true;
+      xSemaphoreTake(_eraserDone, portMAX_DELAY);
+      vSemaphoreDelete(_eraserDone);
+      _eraserDone = nullptr;
+    }
+  }
+
+  void release() {
+    if (_buffer != nullptr) {
+      heap_caps_free(_buffer);
+      _buffer = nullptr;
+    }
+  }
+
+  void endHash() {
+    if (_hashing) {
+      mbedtls_sha256_free(&_sha);
+      _hashing = false;
+    }
+  }
+
+  /**
+   * @brief FreeRTOS entry point for the background eraser
+   * @param arg Owning OTAFlashWriter instance
+   */
+  static void eraserTaskEntry(void *arg) {
+    OTAFlashWriter *self = static_cast<OTAFlashWriter *>(arg);
+    const size_t ahead = OTA_ERASE_AHEAD_SECTORS * OTA_SECTOR_SIZE;
+
+    while (!self->_stopEraser && self->_erased < self->_eraseEnd) {
+      if (self->_mode == OTA_ERASE_LOOKAHEAD &&
+          self->_erased >= self->_offset + ahead) {
+        vTaskDelay(1);
+        continue;
+      }
+      if (esp_partition_erase_range(self->_partition, self->_erased,
+                                    OTA_SECTOR_SIZE) != ESP_OK) {
+        self->_eraseFailed = true;
+        break;
+      }
+      self->_erased += OTA_SECTOR_SIZE;
+    }
+
+    xSemaphoreGive(self->_eraserDone);
+    vTaskDelete(NULL);
+  }
+};
+
+/**
+ * @brief Fixed ring of transfer slots shared by the pipelined reader/writer
+ *
+ * Slots circulate between two FreeRTOS queues: the reader takes an empty
+ * slot, fills it from the network and queues it as full; the writer drains
+ * full slots into flash and hands them back. Storage comes from PSRAM when
+ * available so the pipeline does not eat into internal RAM.
+ */
+class OTAChunkRing {
+public:
+  struct Chunk {
+    uint32_t slot;
+    size_t len; // 0 marks end of stream
+  };
+
+  QueueHandle_t freeSlots = nullptr;
+  QueueHandle_t fullSlots = nullptr;
+
+  ~OTAChunkRing() { end(); }
+
+  /**
+   * @brief Allocate slots and queues
+   * @param slots Number of slots (at least 2)
+   * @param slotSize Bytes per slot
+   * @return true on success, false if memory could not be allocated
+   */
+  bool begin(uint8_t slots, size_t slotSize) {
+    end();
+    if (slots < 2) {
+      slots = 2;
+    }
+
+    size_t total = (size_t)slots * slotSize;
+    if (psramFound()) {
+      _storage = (uint8_t *)heap_caps_malloc(total, MALLOC_CAP_SPIRAM |
+                                                        MALLOC_CAP_8BIT);
+    }
+    if (_storage == nullptr) {
+      _storage = (uint8_t *)heap_caps_malloc(total, MALLOC_CAP_8BIT);
+    }
+
+    freeSlots = xQueueCreate(slots, sizeof(Chunk));
+    fullSlots = xQueueCreate(slots + 1, sizeof(Chunk));
+    if (_storage == nullptr || freeSlots == nullptr || fullSlots == nullptr) {
+      end();
+      return false;
+    }
+
+    _slots = slots;
+    _slotSize = slotSize;
+    for (uint32_t i = 0; i < slots; i++) {
+      Chunk chunk = {i, 0};
+      xQueueSend(freeSlots, &chunk, 0);
+    }
+    return true;
   }
 
-public:
   /**
-   * @brief Construct OTA Client
-   * @param jsonUrl URL to JSON API endpoint
-   * @param version Current firmware version (e.g., "1.0.0")
+   * @brief Release slots and queues
+   */
+  void end() {
+    if (_storage != nullptr) {
+      heap_caps_free(_storage);
+      _storage = nullptr;
+    }
+    if (freeSlots != nullptr) {
+      vQueueDelete(freeSlots);
+      freeSlots = nullptr;
+    }
+    if (fullSlots != nullptr) {
+      vQueueDelete(fullSlots);
+      fullSlots = nullptr;
+    }
+    _slots = 0;
+  }
+
+  uint8_t *data(uint32_t slot) { return _storage + slot * _slotSize; }
+  size_t slotSize() const { return _slotSize; }
+
+private:
+  uint8_t *_storage = nullptr;
+  uint8_t _slots = 0;
+  size_t _slotSize = 0;
+};
+
+/**
+ * @brief Single-producer/single-consumer queue of progress events
+ *
+ * The transfer path pushes, the application pops from its own task. Head
+ * and tail are only ever written by one side each, so no lock is needed;
+ * acquire/release ordering publishes the event data with the index. A
+ * full queue drops new events rather than blocking the transfer.
+ */
+class OTAProgressQueue {
+public:
+  /**
+   * @brief Producer side: queue an event
+   * @return false if the queue was full and the event was dropped
+   */
+  bool push(const OTAProgress &progress) {
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) >=
+        OTA_PROGRESS_QUEUE_SIZE) {
+      return false;
+    }
+    _events[head % OTA_PROGRESS_QUEUE_SIZE] = progress;
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Consumer side: take the oldest event
+   * @return false if the queue is empty
+   */
+  bool pop(OTAProgress &progress) {
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    progress = _events[tail % OTA_PROGRESS_QUEUE_SIZE];
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  OTAProgress _events[OTA_PROGRESS_QUEUE_SIZE];
+  std::atomic<uint32_t> _head{0};
+  std::atomic<uint32_t> _tail{0};
+};
+
+/**
+ * @brief Streaming gzip decoder built on the ROM's miniz inflater
+ *
+ * Parses the gzip member header and inflates the deflate body through the
+ * 32 KB history window deflate requires, handing output to a sink as it is
+ * produced. Window and decompressor state are heap-allocated (PSRAM when
+ * available) only for the duration of a download.
+ */
+class OTAInflater {
+public:
+  typedef std::function<bool(const uint8_t *, size_t)> Sink;
+
+  ~OTAInflater() { end(); }
+
+  /**
+   * @brief Allocate the inflate window and start a new stream
+   * @param sink Receives inflated data, returns false to abort
+   * @return true on success, false if memory could not be allocated
+   */
+  bool begin(Sink sink) {
+    end();
+    _window = (uint8_t *)allocate(TINFL_LZ_DICT_SIZE);
+    _inflator = (tinfl_decompressor *)allocate(sizeof(tinfl_decompressor));
+    if (_window == nullptr || _inflator == nullptr) {
+      end();
+      return false;
+    }
+    tinfl_init(_inflator);
+    _sink = sink;
+    _state = HEADER;
+    _fill = 0;
+    _skip = 0;
+    _windowPos = 0;
+    return true;
+  }
+
+  /**
+   * @brief Release the inflate window
+   */
+  void end() {
+    if (_window != nullptr) {
+      heap_caps_free(_window);
+      _window = nullptr;
+    }
+    if (_inflator != nullptr) {
+      heap_caps_free(_inflator);
+      _inflator = nullptr;
+    }
+  }
+
+  /**
+   * @brief Feed compressed bytes
+   * @param data Compressed bytes
+   * @param len Number of bytes
+   * @return true on success, false on corrupt stream or sink error
+   */
+  bool write(const uint8_t *data, size_t len) {
+    while (len > 0 && _state != DATA) {
+      if (_state == DONE) {
+        return true; // CRC32/ISIZE trailer, the image is verified later
+      }
+      if (_state == FAILED || !parseHeader(data, len)) {
+        _state = FAILED;
+        return false;
+      }
+    }
+    if (_state == DATA && !inflate(data, len)) {
+      _state = FAILED;
+      return false;
+    }
+    return true;
+  }
+
+  bool finished() const { return _state == DONE; }
+
+private:
+  enum State { HEADER, EXTRA_LEN, EXTRA, NAME, COMMENT, HCRC, DATA, DONE,
+               FAILED };
+  enum Flags { FHCRC = 0x02, FEXTRA = 0x04, FNAME = 0x08, FCOMMENT = 0x10 };
+
+  Sink _sink = nullptr;
+  uint8_t *_window = nullptr;
+  tinfl_decompressor *_inflator = nullptr;
+  State _state = HEADER;
+  uint8_t _header[OTA_GZIP_HEADER_SIZE];
+  uint8_t _flags = 0;
+  size_t _fill = 0;
+  size_t _skip = 0;
+  size_t _windowPos = 0;
+
+  /**
+   * @brief Allocate from PSRAM, or internal RAM if it is missing or full
+   */
+  static void *allocate(size_t size) {
+    void *block = nullptr;
+    if (psramFound()) {
+      block = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (block == nullptr) {
+      block = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    return block;
+  }
+
+  /**
+   * @brief Consume gzip header bytes, advancing data/len
+   * @return false if the header is not a deflate gzip member
+   */
+  bool parseHeader(const uint8_t *&data, size_t &len) {
+    switch (_state) {
+    case HEADER:
+    case EXTRA_LEN: {
+      size_t need = _state == HEADER ? OTA_GZIP_HEADER_SIZE : 2;
+      size_t n = min(len, need - _fill);
+      memcpy(_header + _fill, data, n);
+      _fill += n;
+      data += n;
+      len -= n;
+      if (_fill < need) {
+        return true;
+      }
+      _fill = 0;
+      if (_state == HEADER) {
+        if (_header[0] != 0x1F || _header[1] != 0x8B || _header[2] != 8) {
+          return false;
+        }
+        _flags = _header[3];
+        _state = EXTRA_LEN;
+        if (!(_flags & FEXTRA)) {
+          nextField();
+        }
+      } else {
+        _skip = _header[0] | (_header[1] << 8);
+        _state = EXTRA;
+      }
+      return true;
+    }
+    case EXTRA:
+    case HCRC: {
+      size_t n = min(len, _skip);
+      data += n;
+      len -= n;
+      _skip -= n;
+      if (_skip == 0) {
+        nextField();
+      }
+      return true;
+    }
+    case NAME:
+    case COMMENT:
+      while (len > 0) {
+        len--;
+        if (*data++ == 0) {
+          nextField();
+          break;
+        }
+      }
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Move to the next optional header field present in _flags
+  void nextField() {
+    switch (_state) {
+    case EXTRA_LEN:
+    case EXTRA:
+      if (_flags & FNAME) {
+        _state = NAME;
+        return;
+      }
+      // fall through
+    case NAME:
+      if (_flags & FCOMMENT) {
+        _state = COMMENT;
+        return;
+      }
+      // fall through
+    case COMMENT:
+      if (_flags & FHCRC) {
+        _state = HCRC;
+        _skip = 2;
+        return;
+      }
+      // fall through
+    default:
+      _state = DATA;
+    }
+  }
+
+  bool inflate(const uint8_t *data, size_t len) {
+    tinfl_status status;
+    do {
+      size_t in = len;
+      size_t out = TINFL_LZ_DICT_SIZE - _windowPos;
+      status = tinfl_decompress(_inflator, data, &in, _window,
+                                _window + _windowPos, &out,
+                                TINFL_FLAG_HAS_MORE_INPUT);
+      data += in;
+      len -= in;
+
+      if (out > 0 && !_sink(_window + _windowPos, out)) {
+        return false;
+      }
+      _windowPos = (_windowPos + out) & (TINFL_LZ_DICT_SIZE - 1);
+
+      if (status == TINFL_STATUS_DONE) {
+        _state = DONE;
+        return true;
+      }
+      if (status < 0) {
+        return false;
+      }
+    } while (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT);
+    return true;
+  }
+};
+
+/**
+ * @brief Streaming bsdiff patch decoder
+ *
+ * Consumes a patch in the ENDSLEY/BSDIFF43 layout with an uncompressed body
+ * (bsdiff output with the bzip2 stream after the 24-byte header inflated
+ * ahead of time). Old bytes are read from the running app partition and the
+ * reconstructed image is handed to a sink in small pieces, so the new image
+ * never has to sit in RAM.
+ *
+ * Body: repeated control records of three 8-byte sign-magnitude integers
+ * (diff length, extra length, old-position seek), each followed by `diff`
+ * bytes added to the old image and `extra` bytes copied verbatim.
+ */
+class OTADeltaDecoder {
+public:
+  typedef std::function<bool(const uint8_t *, size_t)> Sink;
+
+  /**
+   * @brief Start decoding a patch
+   * @param source Partition holding the image the patch was made against
+   * @param sink Receives reconstructed image data, returns false to abort
+   */
+  void begin(const esp_partition_t *source, Sink sink) {
+    _source = source;
+    _sink = sink;
+    _state = HEADER;
+    _fill = 0;
+    _newSize = 0;
+    _newPos = 0;
+    _oldPos = 0;
+    _remaining = 0;
+    _extra = 0;
+    _seek = 0;
+  }
+
+  /**
+   * @brief Feed patch bytes
+   * @param data Patch bytes
+   * @param len Number of bytes
+   * @return true on success, false on corrupt patch or sink error
+   */
+  bool write(const uint8_t *data, size_t len) {
+    while (len > 0) {
+      size_t n;
+      switch (_state) {
+      case HEADER:
+      case CTRL: {
+        size_t need =
+            _state == HEADER ? OTA_DELTA_HEADER_SIZE : OTA_DELTA_CTRL_SIZE;
+        n = min(len, need - _fill);
+        memcpy(_header + _fill, data, n);
+        _fill += n;
+        if (_fill == need &&
+            !(_state == HEADER ? parseHeader() : parseCtrl())) {
+          _state = FAILED;
+          return false;
+        }
+        break;
+      }
+      case DIFF:
+        n = min(len, min(_remaining, (size_t)OTA_DELTA_BUFFER_SIZE));
+        if (!applyDiff(data, n)) {
+          _state = FAILED;
+          return false;
+        }
+        break;
+      case EXTRA:
+        n = min(len, _remaining);
+        if (!emit(data, n)) {
+          _state = FAILED;
+          return false;
+        }
+        _remaining -= n;
+        if (_remaining == 0) {
+          nextRecord();
+        }
+        break;
+      default: // DONE or FAILED: trailing bytes are an error
+        _state = FAILED;
+        return false;
+      }
+      data += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  bool finished() const { return _state == DONE; }
+  size_t imageSize() const { return _newSize; }
+
+private:
+  enum State { HEADER, CTRL, DIFF, EXTRA, DONE, FAILED };
+
+  const esp_partition_t *_source = nullptr;
+  Sink _sink = nullptr;
+  State _state = HEADER;
+  uint8_t _header[OTA_DELTA_HEADER_SIZE];
+  uint8_t _buffer[OTA_DELTA_BUFFER_SIZE];
+  size_t _fill = 0;
+  size_t _newSize = 0;
+  size_t _newPos = 0;
+  int64_t _oldPos = 0;
+  size_t _remaining = 0; // Bytes left in the current diff or extra block
+  size_t _extra = 0;     // Extra length of the current record
+  int64_t _seek = 0;     // Old-position adjustment after the record
+
+  // bsdiff "offtin": little-endian magnitude, sign in the top bit
+  static int64_t readOff(const uint8_t *b) {
+    int64_t v = b[7] & 0x7F;
+    for (int i = 6; i >= 0; i--) {
+      v = (v << 8) | b[i];
+    }
+    return (b[7] & 0x80) ? -v : v;
+  }
+
+  bool parseHeader() {
+    _fill = 0;
+    int64_t size = readOff(_header + 16);
+    if (memcmp(_header, OTA_DELTA_MAGIC, 16) != 0 || size <= 0) {
+      return false;
+    }
+    _newSize = (size_t)size;
+    _state = CTRL;
+    return true;
+  }
+
+  bool parseCtrl() {
+    _fill = 0;
+    int64_t diff = readOff(_header);
+    int64_t extra = readOff(_header + 8);
+    _seek = readOff(_header + 16);
+    if (diff < 0 || extra < 0 ||
+        (uint64_t)_newPos + (uint64_t)diff + (uint64_t)extra > _newSize) {
+      return false;
+    }
+    _remaining = (size_t)diff;
+    _extra = (size_t)extra;
+    _state = DIFF;
+    if (_remaining == 0) {
+      startExtra();
+    }
+    return true;
+  }
+
+  /**
+   * @brief Add patch diff bytes to the matching old image bytes
+   */
+  bool applyDiff(const uint8_t *data, size_t n) {
+    memset(_buffer, 0, n);
+    // Only the part that lies inside the source partition is read
+    int64_t start = max(_oldPos, (int64_t)0);
+    int64_t end = min(_oldPos + (int64_t)n, (int64_t)_source->size);
+    if (start < end &&
+        esp_partition_read(_source, (size_t)start, _buffer + (start - _oldPos),
+                           (size_t)(end - start)) != ESP_OK) {
+      return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+      _buffer[i] += data[i];
+    }
+    if (!emit(_buffer, n)) {
+      return false;
+    }
+    _oldPos += n;
+    _remaining -= n;
+    if (_remaining == 0) {
+      startExtra();
+    }
+    return true;
+  }
+
+  void startExtra() {
+    _remaining = _extra;
+    _state = EXTRA;
+    if (_remaining == 0) {
+      nextRecord();
+    }
+  }
+
+  void nextRecord() {
+    _oldPos += _seek;
+    _state = _newPos >= _newSize ? DONE : CTRL;
+  }
+
+  bool emit(const uint8_t *data, size_t n) {
+    _newPos += n;
+    return _sink(data, n);
+  }
+};
+
+/**
+ * @brief Owned, reusable HTTP transport
+ *
+ * One HTTPClient plus one plain and one TLS socket live for the lifetime of
+ * the OTAClient, so nothing is allocated per request or per redirect hop.
+ * HTTPClient keeps the socket open between requests (HTTP/1.1 keep-alive);
+ * this class only has to make sure a kept-alive socket is never reused for
+ * a different host.
+ *
+ * HTTPS servers are verified against a CA certificate or bundle, and/or a
+ * set of pinned SHA-256 hashes of the server's public key (SPKI). Without
+ * any of these the certificate is not checked.
+ *
+ * This is the default OTAHttpTransport; OTAClient::setTransport() installs
+ * another one.
+ */
+class OTATransport : public OTAHttpTransport {
+public:
+  OTATransport() {
+    _http.setReuse(true);
+    _secure.setHandshakeTimeout(OTA_TLS_HANDSHAKE_TIMEOUT);
+  }
+
+  /**
+   * @brief Add connection phase timings to a metrics record
+   * @param metrics Record to update, nullptr to stop
+   */
+  void setMetrics(OTAMetrics *metrics) { _metrics = metrics; }
+
+  /**
+   * @brief Send every request through a caller-provided client
+   *
+   * The client is used as-is for all hosts: no DNS timing, TLS settings or
+   * pins are applied. Useful for other network interfaces or to replay
+   * recorded traffic through a WiFiClient subclass.
+   * @param client Client to use, nullptr for the built-in sockets
+   */
+  void setClient(WiFiClient *client) {
+    close();
+    _custom = client;
+  }
+
+  ~OTATransport() override { close(); }
+
+  /**
+   * @brief Start a request on the shared HTTPClient
+   *
+   * New connections are opened here rather than inside HTTPClient, so each
+   * phase can be timed and, with pins configured, the server key is checked
+   * before any request is sent. HTTPClient then reuses the open socket.
+   * @param url Absolute http:// or https:// URL
+   * @return true on success, false if the URL is invalid or the server
+   * could not be connected or verified (see error())
+   */
+  bool begin(const String &url) override {
+    bool secure = url.startsWith("https://");
+    String host = hostOf(url);
+    _error = nullptr;
+
+    if (_trustChanged) {
+      stopClients();
+      applyTrust();
+    }
+
+    // A kept-alive socket is only valid for the host it was opened to
+    if (secure != _secureActive || host != _host) {
+      stopClients();
+    }
+    _secureActive = secure;
+    _host = host;
+
+    if (_custom != nullptr) {
+      _reused = _custom->connected();
+      return open(*_custom, url);
+    }
+
+    WiFiClient &client = secure ? (WiFiClient &)_secure : _plain;
+    _reused = client.connected();
+
+    if (!_reused && !connect(host, secure)) {
+      stopClients();
+      return false;
+    }
+
+    return open(client, url);
+  }
+
+  HTTPClient &http() { return _http; }
+
+  bool reused() const override { return _reused; }
+
+  bool verifying() const override {
+    return _caCert != nullptr || _caBundle != nullptr || _pinCount > 0;
+  }
+
+  String error() override {
+    if (_error != nullptr) {
+      return _error;
+    }
+    char buf[96];
+    if (_secureActive && _secure.lastError(buf, sizeof(buf)) != 0) {
+      return buf;
+    }
+    return "";
+  }
+
+  /**
+   * @brief Use the same CA and pins as another transport
+   * @param other Transport whose trust settings are copied
+   */
+  void copyTrust(const OTATransport &other) {
+    _caCert = other._caCert;
+    _caBundle = other._caBundle;
+    memcpy(_pins, other._pins, sizeof(_pins));
+    _pinCount = other._pinCount;
+    _trustChanged = true;
+  }
+
+  /**
+   * @brief Verify HTTPS servers against a PEM CA certificate
+   * @param pem Certificate, must stay valid while the client is used
+   */
+  void setCACert(const char *pem) {
+    _caCert = pem;
+    _trustChanged = true;
+  }
+
+  /**
+   * @brief Verify HTTPS servers against an x509 certificate bundle
+   * @param bundle Bundle in ESP-IDF crt bundle format, must stay valid
+   */
+  void setCACertBundle(const uint8_t *bundle) {
+    _caBundle = bundle;
+    _trustChanged = true;
+  }
+
+  /**
+   * @brief Pin a server public key
+   * @param sha256Hex SHA-256 of the DER SubjectPublicKeyInfo as 64 hex
+   * digits, optionally separated by ':' or spaces
+   * @return false if the hash is malformed or the pin set is full
+   */
+  bool addPin(const char *sha256Hex) {
+    if (_pinCount >= OTA_TLS_MAX_PINS) {
+      return false;
+    }
+    uint8_t *pin = _pins[_pinCount];
+    size_t digits = 0;
+    for (const char *c = sha256Hex; *c; c++) {
+      if (*c == ':' || *c == ' ') {
+        continue;
+      }
+      int nibble = hexValue(*c);
+      if (nibble < 0 || digits >= 64) {
+        return false;
+      }
+      pin[digits / 2] = (digits % 2) ? (pin[digits / 2] | nibble) : nibble << 4;
+      digits++;
+    }
+    if (digits != 64) {
+      return false;
+    }
+    _pinCount++;
+    _trustChanged = true;
+    return true;
+  }
+
+  void clearPins() {
+    _pinCount = 0;
+    _trustChanged = true;
+  }
+
+  void setTimeout(uint16_t ms) override { _http.setTimeout(ms); }
+  void collectHeaders(const char *names[], size_t count) override {
+    _http.collectHeaders(names, count);
+  }
+  void addHeader(const String &name, const String &value) override {
+    _http.addHeader(name, value);
+  }
+  int GET() override { return _http.GET(); }
+  int POST(const String &body) override { return _http.POST(body); }
+  int getSize() override { return _http.getSize(); }
+  String header(const char *name) override { return _http.header(name); }
+  String getLocation() override { return _http.getLocation(); }
+  Stream &getStream() override { return _http.getStream(); }
+  bool connected() override { return _http.connected(); }
+
+  void discard() override { stopClients(); }
+  void release() override { _http.end(); }
+
+  /**
+   * @brief Close sockets and release TLS state
+   */
+  void close() override {
+    _http.end();
+    stopClients();
+  }
+
+private:
+  HTTPClient _http;
+  WiFiClient _plain;
+  WiFiClientSecure _secure;
+  bool _secureActive = false;
+  bool _reused = false;
+  String _host = "";
+  const char *_error = nullptr;
+
+  const char *_caCert = nullptr;
+  const uint8_t *_caBundle = nullptr;
+  uint8_t _pins[OTA_TLS_MAX_PINS][32];
+  uint8_t _pinCount = 0;
+  bool _trustChanged = true;
+  OTAMetrics *_metrics = nullptr;
+  WiFiClient *_custom = nullptr;
+
+  bool open(WiFiClient &client, const String &url) {
+    if (!_http.begin(client, url)) {
+      _error = "Invalid URL";
+      return false;
+    }
+    // Redirects are followed by OTAClient, one checked hop at a time
+    _http.setFollowRedirects(HTTPC_DISABLE_FOLLOW_REDIRECTS);
+    return true;
+  }
+
+  void stopClients() {
+    _plain.stop();
+    _secure.stop();
+    if (_custom != nullptr) {
+      _custom->stop();
+    }
+    _host = "";
+  }
+
+  void applyTrust() {
+    _trustChanged = false;
+    _secure.setCACert(_caCert); // Also leaves insecure mode
+    if (_caCert == nullptr && _caBundle != nullptr) {
+      _secure.setCACertBundle(_caBundle);
+    } else if (_caCert == nullptr) {
+      // Either pin-only (checked after the handshake) or no verification
+      _secure.setInsecure();
+    }
+  }
+
+  /**
+   * @brief Resolve, connect and (for HTTPS) handshake, timing each phase
+   * @param host "host[:port]"
+   * @param secure true for TLS; the server key is checked against pins
+   */
+  bool connect(const String &host, bool secure) {
+    int colon = host.lastIndexOf(':');
+    String name = colon < 0 ? host : host.substring(0, colon);
+    uint16_t port = colon < 0 ? (secure ? 443 : 80)
+                              : host.substring(colon + 1).toInt();
+
+    unsigned long start = millis();
+    IPAddress ip;
+    if (!WiFi.hostByName(name.c_str(), ip)) {
+      _error = "DNS lookup failed";
+      return false;
+    }
+    unsigned long resolved = millis();
+
+    // The TLS client resolves again, which is answered from the DNS cache
+    bool connected = secure ? _secure.connect(name.c_str(), port)
+                            : _plain.connect(ip, port, OTA_CONNECT_TIMEOUT);
+    unsigned long done = millis();
+
+    if (_metrics != nullptr) {
+      _metrics->dnsMs += resolved - start;
+      (secure ? _metrics->tlsMs : _metrics->connectMs) += done - resolved;
+    }
+
+    if (!connected) {
+      _error = secure ? "TLS connection failed" : "Connection failed";
+      return false;
+    }
+    if (secure && _pinCount > 0 && !peerKeyPinned()) {
+      _error = "Server public key does not match any pin";
+      return false;
+    }
+    return true;
+  }
+
+  bool peerKeyPinned() {
+    const mbedtls_x509_crt *cert = _secure.getPeerCertificate();
+    if (cert == nullptr) {
+      return false;
+    }
+
+    // mbedtls writes DER at the end of the buffer
+    uint8_t der[OTA_TLS_KEY_DER_MAX];
+    int len = mbedtls_pk_write_pubkey_der((mbedtls_pk_context *)&cert->pk,
+                                          der, sizeof(der));
+    if (len <= 0) {
+      return false;
+    }
+
+    uint8_t hash[32];
+    if (mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                   der + sizeof(der) - len, len, hash) != 0) {
+      return false;
+    }
+    for (uint8_t i = 0; i < _pinCount; i++) {
+      if (memcmp(hash, _pins[i], sizeof(hash)) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    c |= 0x20; // Lower case
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    return -1;
+  }
+
+  // "scheme://host:port/path" -> "host:port"
+  static String hostOf(const String &url) {
+    int start = url.indexOf("://");
+    start = start < 0 ? 0 : start + 3;
+    int end = url.indexOf('/', start);
+    return end < 0 ? url.substring(start) : url.substring(start, end);
+  }
+};
+
+/**
+ * @brief Serves the running firmware image to other devices on the LAN
+ *
+ * The image is read straight from its partition and offered at
+ * "/ota/<sha256>.bin", so a URL can only ever return the image it names.
+ * Requests are handled one at a time on a background task; Range requests
+ * are honoured so peers can resume. OTAClient::beginPeerServer() starts it
+ * and announces it over mDNS.
+ */
+class OTAPeerServer {
+public:
+  ~OTAPeerServer() { end(); }
+
+  /**
+   * @brief Start serving
+   * @param partition Partition holding the image
+   * @param size Image size in bytes
+   * @param sha256 Hex SHA-256 of the image
+   * @param port TCP port
+   * @return false if the image does not fit the partition or no task could
+   * be started
+   */
+  bool begin(const esp_partition_t *partition, size_t size,
+             const char *sha256, uint16_t port) {
+    end();
+    if (partition == nullptr || size == 0 || size > partition->size ||
+        strlen(sha256) != 64) {
+      return false;
+    }
+    _partition = partition;
+    _size = size;
+    strlcpy(_hash, sha256, sizeof(_hash));
+    _stop = false;
+
+    _done = xSemaphoreCreateBinary();
+    if (_done == nullptr) {
+      return false;
+    }
+    _server.begin(port);
+    if (xTaskCreatePinnedToCore(serverTaskEntry, "ota_peer",
+                                OTA_PEER_STACK_SIZE, this, OTA_TASK_PRIORITY,
+                                NULL, tskNO_AFFINITY) != pdPASS) {
+      _server.end();
+      vSemaphoreDelete(_done);
+      _done = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Stop serving; waits for a running transfer to be cut off
+   */
+  void end() {
+    if (_done != nullptr) {
+      _stop = true;
+      xSemaphoreTake(_done, portMAX_DELAY);
+      vSemaphoreDelete(_done);
+      _done = nullptr;
+      _server.end();
+    }
+  }
+
+  bool running() const { return _done != nullptr; }
+  const char *hash() const { return _hash; }
+  size_t size() const { return _size; }
+
+private:
+  WiFiServer _server;
+  const esp_partition_t *_partition = nullptr;
+  size_t _size = 0;
+  char _hash[65] = {0};
+  volatile bool _stop = false;
+  SemaphoreHandle_t _done = nullptr;
+
+  /**
+   * @brief Read one header line, dropping the CRLF
+   * @return Line length (truncated to the buffer), -1 on timeout
+   */
+  static int readLine(WiFiClient &client, char *line, size_t cap) {
+    size_t n = 0;
+    uint8_t c;
+    while (true) {
+      if (client.readBytes(&c, 1) != 1) {
+        return -1;
+      }
+      if (c == '\n') {
+        break;
+      }
+      if (c != '\r' && n + 1 < cap) {
+        line[n++] = c;
+      }
+    }
+    line[n] = '\0';
+    return n;
+  }
+
+  void serve(WiFiClient &client) {
+    char line[OTA_PEER_LINE_MAX];
+    if (readLine(client, line, sizeof(line)) <= 0) {
+      return;
+    }
+    // "GET /ota/<sha256>.bin HTTP/1.1"
+    char path[80];
+    int pathLen = snprintf(path, sizeof(path), "GET /ota/%s.bin ", _hash);
+    bool found = strncmp(line, path, pathLen) == 0;
+
+    size_t from = 0;
+    size_t to = _size - 1;
+    bool ranged = false;
+    int n;
+    while ((n = readLine(client, line, sizeof(line))) > 0) {
+      if (strncasecmp(line, "Range: bytes=", 13) == 0) {
+        char *end;
+        from = strtoul(line + 13, &end, 10);
+        if (*end == '-' && end[1] >= '0' && end[1] <= '9') {
+          to = min((size_t)strtoul(end + 1, NULL, 10), _size - 1);
+        }
+        ranged = true;
+      }
+    }
+    if (n < 0) {
+      return;
+    }
+
+    char header[256];
+    if (!found) {
+      client.print("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                   "Connection: close\r\n\r\n");
+      return;
+    }
+    if (from > to) {
+      snprintf(header, sizeof(header),
+               "HTTP/1.1 416 Range Not Satisfiable\r\n"
+               "Content-Range: bytes */%u\r\nContent-Length: 0\r\n"
+               "Connection: close\r\n\r\n",
+               (unsigned)_size);
+      client.print(header);
+      return;
+    }
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %s\r\nContent-Type: application/octet-stream"
+                       "\r\nContent-Length: %u\r\nETag: \"%s\"\r\n",
+                       ranged ? "206 Partial Content" : "200 OK",
+                       (unsigned)(to - from + 1), _hash);
+    if (ranged) {
+      len += snprintf(header + len, sizeof(header) - len,
+                      "Content-Range: bytes %u-%u/%u\r\n", (unsigned)from,
+                      (unsigned)to, (unsigned)_size);
+    }
+    snprintf(header + len, sizeof(header) - len, "Connection: close\r\n\r\n");
+    client.print(header);
+
+    uint8_t buffer[OTA_PEER_CHUNK];
+    while (from <= to && !_stop && client.connected()) {
+      size_t chunk = min((size_t)OTA_PEER_CHUNK, to - from + 1);
+      if (esp_partition_read(_partition, from, buffer, chunk) != ESP_OK ||
+          client.write(buffer, chunk) != chunk) {
+        break;
+      }
+      from += chunk;
+    }
+  }
+
+  /**
+   * @brief FreeRTOS entry point: accept and serve clients until end()
+   */
+  static void serverTaskEntry(void *arg) {
+    OTAPeerServer *self = static_cast<OTAPeerServer *>(arg);
+    while (!self->_stop) {
+      WiFiClient client = self->_server.accept();
+      if (client) {
+        self->serve(client);
+        client.stop();
+      } else {
+        vTaskDelay(pdMS_TO_TICKS(50));
+      }
+    }
+    xSemaphoreGive(self->_done);
+    vTaskDelete(NULL);
+  }
+};
+
+/**
+ * @brief Watches a push channel and flags when a new manifest is out
+ *
+ * Keeps one HTTP request open on a background task. Two server styles are
+ * understood:
+ * - Server-Sent Events (Content-Type text/event-stream): every event
+ *   raises the flag; comment lines (": keep-alive") do not.
+ * - Long-poll: the server holds the request until something changes and
+ *   answers 200; 204 or 304 means "nothing new, ask again".
+ * Failed connections are retried with exponential backoff. The channel
+ * only triggers a check, which is verified as usual, so a bogus push
+ * costs one extra manifest request.
+ */
+class OTAPushWatcher {
+public:
+  ~OTAPushWatcher() { end(); }
+
+  /**
+   * @brief Start watching
+   * @param url Event stream or long-poll URL
+   * @param trust Transport whose CA and public key pins apply to HTTPS
+   * @return false if the task could not be started
+   */
+  bool begin(const String &url, const OTATransport &trust) {
+    end();
+    _url = url;
+    _transport.copyTrust(trust);
+    _stop = false;
+    _done = xSemaphoreCreateBinary();
+    if (_done == nullptr) {
+      return false;
+    }
+    if (xTaskCreatePinnedToCore(watchTaskEntry, "ota_push",
+                                OTA_PUSH_STACK_SIZE, this, OTA_TASK_PRIORITY,
+                                NULL, tskNO_AFFINITY) != pdPASS) {
+      vSemaphoreDelete(_done);
+      _done = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Stop watching; waits for the task to close its connection
+   */
+  void end() {
+    if (_done != nullptr) {
+      _stop = true;
+      xSemaphoreTake(_done, portMAX_DELAY);
+      vSemaphoreDelete(_done);
+      _done = nullptr;
+    }
+  }
+
+  bool running() const { return _done != nullptr; }
+
+  /**
+   * @brief Take the "new manifest" flag
+   * @return true once per notification (several may merge into one)
+   */
+  bool take() { return _pending.exchange(false); }
+
+private:
+  String _url;
+  OTATransport _transport; // Only used by the watcher task
+  volatile bool _stop = false;
+  std::atomic<bool> _pending{false};
+  SemaphoreHandle_t _done = nullptr;
+
+  /**
+   * @brief One request: hold it open until it ends or end() is called
+   * @return false if the server could not be reached or refused; a
+   * long-poll that times out without an answer just polls again
+   */
+  bool watchOnce() {
+    static const char *headers[] = {"Content-Type", "Transfer-Encoding"};
+    if (!_transport.begin(_url)) {
+      _transport.close();
+      return false;
+    }
+    HTTPClient &http = _transport.http();
+    http.setReuse(false);
+    http.setTimeout(OTA_PUSH_TIMEOUT);
+    http.collectHeaders(headers, 2);
+    http.addHeader("Accept", "text/event-stream");
+    http.addHeader("Cache-Control", "no-cache");
+
+    int httpCode = http.GET();
+    bool ok = httpCode == 200 || httpCode == 204 || httpCode == 304 ||
+              httpCode == HTTPC_ERROR_READ_TIMEOUT;
+    if (httpCode == 200 &&
+        http.header("Content-Type").startsWith("text/event-stream")) {
+      OTABodyStream body(http.getStream(),
+                         http.header("Transfer-Encoding") == "chunked",
+                         http.getSize());
+      readEvents(http, body);
+    } else if (httpCode == 200) {
+      _pending = true; // Long-poll answered: something changed
+    }
+    _transport.close();
+    return ok;
+  }
+
+  /**
+   * @brief Raise the flag for each event of an SSE stream until it closes
+   *
+   * Comment lines (":" keep-alives) and blank lines without a field
+   * before them are no events.
+   */
+  void readEvents(HTTPClient &http, OTABodyStream &stream) {
+    size_t lineLength = 0;
+    bool comment = false;
+    bool event = false;
+    while (!_stop && http.connected() && !stream.ended()) {
+      int c = stream.available() > 0 ? stream.read() : -1;
+      if (c < 0) {
+        vTaskDelay(pdMS_TO_TICKS(50));
+        continue;
+      }
+      if (c == '\r') {
+        continue;
+      }
+      if (c != '\n') {
+        comment = lineLength == 0 ? c == ':' : comment;
+        lineLength++;
+        continue;
+      }
+      if (lineLength == 0 && event) {
+        _pending = true; // A blank line dispatches the event
+        event = false;
+      } else if (lineLength > 0 && !comment) {
+        event = true;
+      }
+      lineLength = 0;
+    }
+  }
+
+  /**
+   * @brief FreeRTOS entry point: reconnect until end()
+   */
+  static void watchTaskEntry(void *arg) {
+    OTAPushWatcher *self = static_cast<OTAPushWatcher *>(arg);
+    uint32_t retry = OTA_PUSH_RETRY_MIN;
+    while (!self->_stop) {
+      if (WiFi.isConnected() && self->watchOnce()) {
+        retry = OTA_PUSH_RETRY_MIN;
+        continue;
+      }
+      for (uint32_t waited = 0; waited < retry && !self->_stop;
+           waited += 100) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+      }
+      retry = min(retry * 2, (uint32_t)OTA_PUSH_RETRY_MAX);
+    }
+    xSemaphoreGive(self->_done);
+    vTaskDelete(NULL);
+  }
+};
+
+/**
+ * @brief ESP32 OTA Client class
+ *
+ * Example usage:
+ * @code
+ * #include "ESP32OTAClient.h"
+ *
+ * OTAClient ota("http://server/api/update?device=esp32", "1.0.0");
+ *
+ * void setup() {
+ *     WiFi.begin("SSID", "PASSWORD");
+ *     while (!WiFi.isConnected()) delay(100);
+ *
+ *     // Check and update
+ *     if (ota.hasUpdate()) {
+ *         ota.update();
+ *     }
+ * }
+ * @endcode
+ */
+class OTAClient {
+private:
+  String _jsonUrl;
+  String _currentVersion;
+  OTAVersion _parsedVersion;
+  unsigned long _checkInterval = 0;
+
+  // Periodic check schedule
+  unsigned long _nextCheck = 0; // millis() of the next check
+  bool _scheduleLoaded = false;
+  long _checkJitter = OTA_JITTER_DEFAULT;
+  unsigned long _maxBackoff = OTA_BACKOFF_MAX;
+  uint8_t _failures = 0;
+  unsigned long _retryAfter = 0;     // From the last Retry-After header
+  unsigned long _serverInterval = 0; // From the manifest "pollInterval"
+  OTAProgressCallback _progressCallback = nullptr;
+  OTAProgressDetailCallback _progressDetailCallback = nullptr;
+  String _lastInstalledFilename = "";
+
+  // Persistent state, committed in batches (see commitState())
+  OTAPersistentState _saved;
+  bool _savedLoaded = false;
+  bool _savedDirty = false;  // OTA_RECORD_MAIN
+  bool _resumeDirty = false; // OTA_RECORD_RESUME
+  bool _statsDirty = false;  // OTA_RECORD_STATS, written lazily
+  bool _scheduleDirty = false; // OTA_RECORD_SCHEDULE
+  uint32_t _statsChecks = 0; // _saved.checks when the stats were written
+  UpdateInfo _updateInfo;
+
+  // Background update task
+  OTACompleteCallback _completeCallback = nullptr;
+  volatile OTAState _state = OTA_STATE_IDLE;
+  volatile int _lastResult = OTA_NO_UPDATE;
+  TaskHandle_t _asyncTask = nullptr;
+  bool _asyncMode = false;
+  bool _asyncRecheck = false;
+  BaseType_t _taskCore = OTA_TASK_CORE;
+  UBaseType_t _taskPriority = OTA_TASK_PRIORITY;
+  uint32_t _taskStackSize = OTA_TASK_STACK_SIZE;
+
+  // Transfer progress (one transfer at a time)
+  int _contentLength = 0;
+  int _written = 0;
+  int _lastPercent = -1;
+
+  // Progress throttling and hand-off
+  uint32_t _progressInterval = 0;
+  size_t _progressBytes = 0;
+  unsigned long _lastProgressTime = 0;
+  size_t _lastProgressBytes = 0;
+  bool _progressQueued = false;
+  OTAProgressQueue _progressQueue;
+
+  // Pipelined transfer
+  bool _pipelined = false;
+  uint8_t _pipeSlots = OTA_PIPE_SLOTS;
+  size_t _pipeSlotSize = OTA_PIPE_SLOT_SIZE;
+  OTAChunkRing _ring;
+  SemaphoreHandle_t _writerDone = nullptr;
+  volatile bool _writeFailed = false;
+
+  // Flash writer and persistent storage (replaceable, see setFlashWriter())
+  OTAFlashWriter _defaultFlash;
+  OTAImageWriter *_flash = &_defaultFlash;
+  OTAFlashWriter _defaultDataFlash; // Data images of a multi-image update
+  OTAImageWriter *_dataFlash = &_defaultDataFlash;
+  OTAPreferencesStorage _defaultStorage;
+  OTAStorage *_storage = &_defaultStorage;
+  OTAEraseMode _eraseMode = OTA_ERASE_LOOKAHEAD;
+
+  bool _dryRun = false;
+  OTAStageMode _stageMode = OTA_STAGE_OFF;
+  int8_t _windowStart = -1; // Activation window, local hours; -1 = none
+  int8_t _windowEnd = -1;
+  bool _profileEnabled = false;
+  OTATransferProfile _profile;
+
+  // Multi-image updates
+  bool _deferActivation = false; // Verify only, installImages() activates
+  const esp_partition_t *_targetPartition = nullptr; // nullptr = OTA slot
+  const OTAImage *_targetImage = nullptr; // Data image being installed
+
+  // Image verification
+  const char *_signingKey = nullptr;
+  String _expectedHash = "";
+  String _expectedSignature = "";
+  bool _hashImage = false;
+
+  // Validators of the last manifest that was up to date
+  String _manifestETag = "";
+  String _manifestModified = "";
+  uint32_t _manifestFrom = 0;  // Hash of the endpoint of the validators
+  String _manifestUrls[OTA_MAX_SOURCES - 1]; // Fallbacks for _jsonUrl
+  uint8_t _manifestUrlCount = 0;
+
+  // Result reports
+  String _reportUrl = "";
+
+  // Boot validation
+  struct HealthCheck {
+    const char *name;
+    OTAHealthCheck check;
+  };
+  HealthCheck _healthChecks[OTA_MAX_HEALTH_CHECKS];
+  uint8_t _healthCheckCount = 0;
+  OTABootResult _bootResult = OTA_BOOT_NORMAL;
+  String _failedCheck = "";
+  OTABootCallback _bootCallback;
+
+  // Push-triggered checks
+  OTAPushWatcher _push;
+  std::atomic<bool> _checkRequested{false};
+  bool _requestPending = false;
+  unsigned long _requestAt = 0;
+  uint32_t _pushSpread = OTA_PUSH_SPREAD;
+
+  // LAN peer distribution
+  OTAPeerServer _peerServer;
+  bool _peerDownloads = false;
+  bool _peerActive = false; // Downloading from a peer
+  bool _manifestCacheLoaded = false;
+  String _cohorts[OTA_MAX_COHORTS];
+  uint8_t _cohortCount = 0;
+  size_t _manifestMaxSize = OTA_MANIFEST_MAX_SIZE;
+  JsonDocument _manifestFilter;        // Built on the first check
+  bool _manifestArenaEnabled = false;
+  uint8_t *_manifestArena = nullptr;   // _manifestMaxSize bytes, kept
+
+  // Resume checkpoint of the current download
+  bool _resumable = true;
+  bool _checkpointing = false;
+  size_t _lastCheckpoint = 0;
+
+  // Stalled downloads
+  OTAStallMonitor _stall;
+  uint32_t _stallTimeout = OTA_STALL_TIMEOUT;
+  uint32_t _minThroughput = OTA_MIN_THROUGHPUT;
+  uint32_t _throughputWindow = OTA_THROUGHPUT_WINDOW;
+  uint8_t _stallRetries = OTA_STALL_RETRIES;
+  TaskHandle_t _watchdogTask = nullptr; // Update task, if on the watchdog
+
+  // Delta updates
+  bool _deltaEnabled = true;
+  bool _deltaActive = false;
+  bool _flashReady = false;
+  int _installError = OTA_ERR_UPDATE;
+  OTADeltaDecoder _delta;
+
+  // Compressed downloads
+  bool _acceptGzip = false;
+  bool _gzipActive = false;
+  bool _sniffGzip = false;
+  size_t _imageWritten = 0;
+  OTAInflater _inflater;
+
+  // Shared connection for manifest and firmware requests
+  OTATransport _defaultTransport;
+  OTAHttpTransport *_transport = &_defaultTransport;
+  bool _keepAlive = false;
+  bool _insecureWarned = false;
+
+  // Metrics of the current/last attempt
+  OTAMetrics _metrics;
+  OTAMetricsCallback _metricsCallback = nullptr;
+  uint32_t _heapStart = 0;
+  uint32_t _heapLow = 0;
+  uint64_t _flashWriteUs = 0;
+
+  void log(const char *msg) {
+    Serial.print("[OTA] ");
+    Serial.println(msg);
+  }
+
+  void log(const char *msg, const char *param) {
+    Serial.print("[OTA] ");
+    Serial.print(msg);
+    Serial.println(param);
+  }
+
+  void log(const char *msg, long value) {
+    Serial.print("[OTA] ");
+    Serial.print(msg);
+    Serial.println(value);
+  }
+
+  /**
+   * @brief Load the persistent state record (once)
+   *
+   * Without a record, the filename kept by earlier versions in EEPROM is
+   * imported and a record is written, so this only happens once.
+   */
+  void loadState() {
+    if (_savedLoaded) {
+      return;
+    }
+    _savedLoaded = true;
+
+    bool found = false;
+    uint8_t *buf = (uint8_t *)malloc(OTA_STATE_MAX_SIZE);
+    OTAStorage &store = *_storage;
+    if (buf != nullptr && store.begin(true)) {
+      for (int i = 0; i < OTA_RECORD_COUNT; i++) {
+        OTAStateRecord record = (OTAStateRecord)i;
+        size_t len = store.getBytes(OTAPersistentState::key(record), buf,
+                                    OTA_STATE_MAX_SIZE);
+        bool decoded = len > 0 && _saved.decode(record, buf, len);
+        if (record == OTA_RECORD_MAIN) {
+          found = decoded;
+        }
+      }
+      store.end();
+    }
+    free(buf);
+
+    if (!found) {
+      _saved = OTAPersistentState();
+      migrateEEPROM();
+      _savedDirty = _resumeDirty = _statsDirty = _scheduleDirty = true;
+      commitState(true);
+    }
+    _statsChecks = _saved.checks;
+
+    // A staged image that is now running has been activated
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (!_saved.stagedPartition.isEmpty() && running != nullptr &&
+        _saved.stagedPartition == running->label) {
+      _saved.stagedPartition = "";
+      _savedDirty = true;
+    }
+
+    _lastInstalledFilename = _saved.filename;
+    if (!_lastInstalledFilename.isEmpty()) {
+      log("Last installed firmware: ", _lastInstalledFilename.c_str());
+    } else {
+      log("No previous firmware record");
+    }
+  }
+
+  /**
+   * @brief Write the state records that changed since the last write
+   *
+   * Changes are batched: most fields only mark their record dirty and it
+   * is written at the end of a check or update attempt. Resume checkpoints
+   * and the pre-reboot state are committed immediately. The statistics
+   * change with every check, so they are only written every
+   * OTA_STATS_FLUSH_CHECKS checks, or with flush. The schedule is written
+   * whenever it changed.
+   * @param flush true to write the statistics too (e.g. before a reboot)
+   */
+  void commitState(bool flush = false) {
+    bool stats = _statsDirty &&
+                 (flush || _saved.checks - _statsChecks >=
+                               OTA_STATS_FLUSH_CHECKS);
+    if (!_savedDirty && !_resumeDirty && !stats && !_scheduleDirty) {
+      return;
+    }
+    uint8_t *buf = (uint8_t *)malloc(OTA_STATE_MAX_SIZE);
+    OTAStorage &store = *_storage;
+    if (buf == nullptr || !store.begin(false)) {
+      free(buf);
+      return;
+    }
+    if (_savedDirty) {
+      _savedDirty = !writeRecord(store, OTA_RECORD_MAIN, buf);
+    }
+    if (_resumeDirty) {
+      _resumeDirty = !writeRecord(store, OTA_RECORD_RESUME, buf);
+    }
+    if (stats) {
+      _statsDirty = !writeRecord(store, OTA_RECORD_STATS, buf);
+      _statsChecks = _saved.checks;
+    }
+    if (_scheduleDirty) {
+      _scheduleDirty = !writeRecord(store, OTA_RECORD_SCHEDULE, buf);
+    }
+    store.end();
+    free(buf);
+  }
+
+  /**
+   * @brief Encode and store one state record
+   *
+   * A record that outgrows OTA_STATE_MAX_SIZE sheds its least useful
+   * content (see OTAPersistentState::shed()) until it fits.
+   * @param store Open storage
+   * @param record Record to write
+   * @param buf Scratch buffer of OTA_STATE_MAX_SIZE bytes
+   * @return true if the record was written
+   */
+  bool writeRecord(OTAStorage &store, OTAStateRecord record, uint8_t *buf) {
+    size_t len;
+    bool shed = false;
+    while ((len = _saved.encode(record, buf, OTA_STATE_MAX_SIZE)) == 0 &&
+           _saved.shed(record)) {
+      shed = true;
+    }
+    if (len == 0) {
+      log("State record too large, not saved: ",
+          OTAPersistentState::key(record));
+      return false;
+    }
+    if (shed) {
+      log("State record too large, oldest entries dropped: ",
+          OTAPersistentState::key(record));
+    }
+    store.putBytes(OTAPersistentState::key(record), buf, len);
+    return true;
+  }
+
+  /**
+   * @brief Import the filename record of the old EEPROM layout
+   *
+   * The Arduino EEPROM emulation keeps its bytes in an NVS blob named
+   * "eeprom" in namespace "eeprom". Reading it directly avoids allocating
+   * (or creating) the emulation buffer. Only the record's magic is cleared,
+   * in case the application keeps its own data further into the blob.
+   */
+  void migrateEEPROM() {
+    Preferences eeprom;
+    if (!eeprom.begin("eeprom", true)) {
+      return;
+    }
+    size_t len = eeprom.getBytesLength("eeprom");
+    if (len < OTA_EEPROM_START_ADDR + 3 || len > 4096) {
+      eeprom.end();
+      return;
+    }
+    uint8_t *data = (uint8_t *)malloc(len);
+    if (data == nullptr) {
+      eeprom.end();
+      return;
+    }
+    eeprom.getBytes("eeprom", data, len);
+    eeprom.end();
+
+    uint8_t *record = data + OTA_EEPROM_START_ADDR;
+    uint16_t magic = record[0] | (record[1] << 8);
+    uint8_t nameLen = record[2];
+    if (magic == OTA_EEPROM_MAGIC && nameLen > 0 &&
+        nameLen < OTA_EEPROM_SIZE - 3 &&
+        (size_t)(OTA_EEPROM_START_ADDR + 3 + nameLen) <= len) {
+      char name[OTA_EEPROM_SIZE];
+      memcpy(name, record + 3, nameLen);
+      name[nameLen] = '\0';
+      _saved.filename = name;
+      log("Migrated firmware record from EEPROM: ", name);
+
+      record[0] = 0;
+      record[1] = 0;
+      if (eeprom.begin("eeprom", false)) {
+        eeprom.putBytes("eeprom", data, len);
+        eeprom.end();
+      }
+    }
+    free(data);
+  }
+
+  /**
+   * @brief Remember the firmware that is about to boot
+   * @param filename Firmware filename, empty to keep the previous one
+   */
+  void recordInstall(const String &filename) {
+    loadState();
+    if (!filename.isEmpty()) {
+      _saved.filename = filename;
+      _lastInstalledFilename = filename;
+      log("Saved firmware filename: ", filename.c_str());
+    }
+    const uint8_t *digest = _flash->digest();
+    _saved.hasImageHash = digest != nullptr;
+    if (digest != nullptr) {
+      memcpy(_saved.imageHash, digest, sizeof(_saved.imageHash));
+    }
+    _saved.imageSize = _flash->written();
+    _saved.imagePartition = _flash->label();
+    _savedDirty = true;
+  }
+
+  /**
+   * @brief Filename recorded for an installed image
+   * @param image URL the manifest lists for the image
+   * @return The manifest's filename, else the last path segment of image
+   */
+  String imageFilename(const String &image) {
+    OTAFixedString<OTA_FILENAME_MAX> filename = _updateInfo.filename;
+    if (filename.isEmpty()) {
+      size_t length;
+      const char *name = OTAManifest::extractFilename(image.c_str(), length);
+      filename.assign(name, length);
+    }
+    return filename.toString();
+  }
+
+  /**
+   * @brief Keep the image the flash writer just wrote as the staged update
+   * @param image URL the manifest lists for the image
+   * @return OTA_UPDATE_STAGED, OTA_ERR_VERIFY if the image is not a valid
+   * app image, OTA_ERR_UPDATE if OTA_STAGE_NEXT_BOOT could not make it
+   * bootable
+   */
+  int stageImage(const String &image) {
+    clearCheckpoint();
+    // Nothing else checks the image format until activation, which may
+    // come much later (or never, without a manifest sha256)
+    if (!_flash->verify()) {
+      log("Staged image failed verification");
+      return OTA_ERR_VERIFY;
+    }
+    loadState();
+    const uint8_t *digest = _flash->digest();
+    bool listed = image == _updateInfo.url || image == _updateInfo.patchUrl;
+    _saved.stagedVersion = listed ? _updateInfo.version.c_str() : "";
+    _saved.stagedFilename = imageFilename(image);
+    _saved.stagedPartition = _flash->label();
+    _saved.stagedSize = _flash->written();
+    _saved.hasStagedHash = digest != nullptr;
+    if (digest != nullptr) {
+      memcpy(_saved.stagedHash, digest, sizeof(_saved.stagedHash));
+    }
+    _savedDirty = true;
+
+    if (_stageMode == OTA_STAGE_NEXT_BOOT) {
+      if (!_flash->activate()) {
+        log("Staging failed, image not bootable");
+        _saved.stagedPartition = "";
+        return OTA_ERR_UPDATE;
+      }
+      recordStaged();
+      log("Update staged, runs after the next reboot");
+    } else {
+      log("Update staged, waiting for activation");
+    }
+    return OTA_UPDATE_STAGED;
+  }
+
+  /**
+   * @brief Make the staged image the installed firmware record
+   */
+  void recordStaged() {
+    if (!_saved.stagedFilename.isEmpty()) {
+      _saved.filename = _saved.stagedFilename;
+      _lastInstalledFilename = _saved.stagedFilename;
+    }
+    _saved.hasImageHash = _saved.hasStagedHash;
+    memcpy(_saved.imageHash, _saved.stagedHash, sizeof(_saved.imageHash));
+    _saved.imageSize = _saved.stagedSize;
+    _saved.imagePartition = _saved.stagedPartition;
+    _savedDirty = true;
+  }
+
+  /**
+   * @brief Forget the staged update before its slot is overwritten
+   *
+   * An OTA_STAGE_NEXT_BOOT image is already bootable, so the boot
+   * partition goes back to the running app first.
+   */
+  void discardStaged() {
+    loadState();
+    if (_saved.stagedPartition.isEmpty()) {
+      return;
+    }
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (esp_ota_get_boot_partition() != running) {
+      esp_ota_set_boot_partition(running);
+    }
+    log("Discarding staged update: ", _saved.stagedVersion.c_str());
+    _saved.stagedPartition = "";
+    _savedDirty = true;
+    commitState();
+  }
+
+  /**
+   * @brief True inside the activation window (false if the clock is unset)
+   */
+  bool inActivationWindow() {
+    if (_windowStart < 0) {
+      return false;
+    }
+    time_t now = time(nullptr);
+    if (now <= 1600000000) { // Clock not set yet
+      return false;
+    }
+    struct tm local;
+    localtime_r(&now, &local);
+    if (_windowStart <= _windowEnd) {
+      return local.tm_hour >= _windowStart && local.tm_hour < _windowEnd;
+    }
+    return local.tm_hour >= _windowStart || local.tm_hour < _windowEnd;
+  }
+
+  /**
+   * @brief Skip a response body so the connection stays reusable
+   * @param http Transport holding the response
+   */
+  void discardBody(OTAHttpTransport &http) {
+    OTABodyStream body(http.getStream(),
+                       http.header("Transfer-Encoding") == "chunked",
+                       http.getSize());
+    if (!body.drain()) {
+      http.discard();
+    }
+  }
+
+  /**
+   * @brief Follow HTTP redirects and return final response code
+   * @param http Transport the requests are sent through
+   * @param url Initial URL to request
+   * @param maxRedirects Maximum number of redirects to follow (default 5)
+   * @param prepare Optional hook to add request headers on every hop
+   * @return Final HTTP response code
+   */
+  int followRedirects(
+      OTAHttpTransport &http, const String &url, int maxRedirects = 5,
+      std::function<void(OTAHttpTransport &)> prepare = nullptr) {
+    static const char *responseHeaders[] = {"ETag", "Last-Modified",
+                                            "Content-Range",
+                                            "Transfer-Encoding",
+                                            "Content-Encoding",
+                                            "Retry-After"};
+    String currentUrl = url;
+    int redirectCount = 0;
+
+    while (redirectCount < maxRedirects) {
+      if (!http.begin(currentUrl)) {
+        log(http.error().c_str(), (": " + currentUrl).c_str());
+        return -1;
+      }
+      if (!_insecureWarned && currentUrl.startsWith("https://") &&
+          !http.verifying()) {
+        log("Warning: server certificate is not verified");
+        _insecureWarned = true;
+      }
+
+      http.setTimeout(30000);
+      http.collectHeaders(responseHeaders, 6);
+      if (prepare) {
+        prepare(http);
+      }
+
+      unsigned long requested = millis();
+      int httpCode = http.GET();
+      _metrics.ttfbMs += millis() - requested;
+
+      if (httpCode < 0 && http.reused()) {
+        // The server closed the kept-alive connection; retry on a new one
+        http.discard();
+        _metrics.retries++;
+        continue;
+      }
+      if (httpCode < 0) {
+        String tlsError = http.error();
+        if (!tlsError.isEmpty()) {
+          log("TLS error: ", tlsError.c_str());
+        }
+      }
+
+      // Check if response is a redirect
+      if (httpCode == 301 || httpCode == 302 || httpCode == 307 ||
+          httpCode == 308) {
+        String newUrl = http.getLocation();
+        discardBody(http);
+        http.release();
+
+        if (newUrl.isEmpty()) {
+          log("Redirect without Location header");
+          return httpCode;
+        }
+
+        log("Following redirect to: ", newUrl.c_str());
+        currentUrl = newUrl;
+        redirectCount++;
+        _metrics.redirects++;
+      } else {
+        // Not a redirect, return the response code
+        return httpCode;
+      }
+    }
+
+    log("Too many redirects");
+    return -1; // Too many redirects
+  }
+
+  /**
+   * @brief Apply a manifest entry's rollout constraints to this device
+   * @param config Candidate updater entry
+   * @param version The entry's version
+   * @return true if the entry targets this device
+   */
+  bool inRollout(JsonObject config, const char *version) {
+    switch (OTAManifest::targets(config, _parsedVersion, _cohorts,
+                                 _cohortCount, getRolloutBucket(version))) {
+    case OTA_ROLLOUT_MIN_VERSION:
+      log("Update requires at least version ", config["minVersion"] | "");
+      return false;
+    case OTA_ROLLOUT_COHORT:
+      log("Update is for other cohorts: ", version);
+      return false;
+    case OTA_ROLLOUT_LATER:
+      log("Device not in rollout yet: ", version);
+      return false;
+    default:
+      return true;
+    }
+  }
+
+  /**
+   * @brief FNV-1a over a byte range, continuing from hash
+   */
+  static uint32_t hashBytes(uint32_t hash, const void *data, size_t len) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++) {
+      hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  /**
+   * @brief Hash of a URL as kept in the state record, never 0
+   */
+  static uint32_t urlKey(const String &url) {
+    uint32_t hash = hashBytes(2166136261u, url.c_str(), url.length());
+    return hash ? hash : 1;
+  }
+
+  /**
+   * @brief Running version plus cohorts: what manifest validators depend on
+   */
+  uint32_t manifestKey() {
+    uint32_t key = hashBytes(2166136261u, _currentVersion.c_str(),
+                             _currentVersion.length());
+    for (uint8_t i = 0; i < _cohortCount; i++) {
+      key = hashBytes(key, "|", 1);
+      key = hashBytes(key, _cohorts[i].c_str(), _cohorts[i].length());
+    }
+    return key ? key : 1;
+  }
+
+  /**
+   * @brief Copy a manifest entry into _updateInfo
+   * @param config The chosen updater entry
+   * @param force Value for UpdateInfo::force
+   * @param name Filename view into the entry's url
+   * @param nameLength Filename length
+   * @return false if a field exceeds its UpdateInfo capacity, which fails
+   * the check
+   */
+  bool selectUpdate(JsonObject config, bool force, const char *name,
+                    size_t nameLength) {
+    if (!OTAManifest::select(config, force, name, nameLength,
+                             _currentVersion.c_str(), _updateInfo)) {
+      log("Manifest entry exceeds the UpdateInfo limits: ",
+          config["version"] | "");
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Load manifest validators saved by a previous up-to-date check
+   *
+   * Validators are tied to the running version and cohorts, so a freshly
+   * installed firmware always fetches the full manifest once.
+   */
+  void loadManifestCache() {
+    _manifestCacheLoaded = true;
+    loadState();
+
+    if (_saved.manifestKey == manifestKey()) {
+      _manifestFrom = _saved.manifestUrl;
+      _manifestETag = _saved.manifestETag;
+      _manifestModified = _saved.manifestModified;
+    }
+  }
+
+  /**
+   * @brief Remember validators of a manifest that had no update for us
+   * @param etag ETag response header (may be empty)
+   * @param modified Last-Modified response header (may be empty)
+   * @param endpoint Manifest URL that sent them
+   */
+  void saveManifestCache(const String &etag, const String &modified,
+                         const String &endpoint) {
+    uint32_t from = urlKey(endpoint);
+    if (etag == _manifestETag && modified == _manifestModified &&
+        from == _manifestFrom) {
+      return; // Nothing changed, spare the NVS write
+    }
+    _manifestFrom = from;
+    _manifestETag = etag;
+    _manifestModified = modified;
+
+    _saved.manifestKey = manifestKey();
+    _saved.manifestUrl = from;
+    _saved.manifestETag = etag;
+    _saved.manifestModified = modified;
+    _savedDirty = true;
+    commitState();
+  }
+
+  /**
+   * @brief Load the resume checkpoint for a firmware URL
+   * @param url Firmware URL being downloaded
+   * @param validator Receives the stored ETag / Last-Modified value
+   * @param size Receives the total image size
+   * @return Resume offset, 0 if there is no usable checkpoint
+   */
+  size_t loadCheckpoint(const String &url, String &validator, size_t &size) {
+    loadState();
+
+    const esp_partition_t *next = targetPartition();
+    if (next == NULL || _saved.resumeUrl != urlKey(url) ||
+        _saved.resumePartition != next->label) {
+      return 0;
+    }
+
+    // A verified download can only resume with the hash of what is in
+    // flash; the context is only meaningful to this firmware build
+    if (_hashImage && _saved.resumeHashSize == 0) {
+      return 0;
+    }
+
+    validator = _saved.resumeTag;
+    size = _saved.resumeSize;
+    return _saved.resumeOffset;
+  }
+
+  /**
+   * @brief Start a new resume checkpoint for a download
+   *
+   * Only committed with the first saveCheckpoint(); until then there is
+   * nothing in flash worth resuming.
+   * @param url Firmware URL
+   * @param validator ETag or Last-Modified of the response (may be empty)
+   * @param size Total image size
+   * @param source Mirror the data comes from (differs from url for mirrors)
+   */
+  void beginCheckpoint(const String &url, const String &validator,
+                       size_t size, const String &source) {
+    _saved.resumeUrl = urlKey(url);
+    _saved.resumeSource = urlKey(source);
+    _saved.resumeTag = validator;
+    _saved.resumePartition = _flash->label();
+    _saved.resumeSize = size;
+    _saved.resumeOffset = 0;
+    _saved.resumeHashSize = 0;
+    _resumeDirty = true;
+  }
+
+  /**
+   * @brief Persist the number of bytes safely in flash
+   * @param offset Sector-aligned offset from OTAFlashWriter::flushed()
+   */
+  void saveCheckpoint(size_t offset) {
+    _saved.resumeHashSize =
+        _flash->hashState(_saved.resumeHash, sizeof(_saved.resumeHash));
+    _saved.resumeOffset = offset;
+    _resumeDirty = true;
+    commitState();
+    _lastCheckpoint = offset;
+  }
+
+  /**
+   * @brief Forget the resume checkpoint
+   */
+  void clearCheckpoint() {
+    if (_saved.resumeUrl != 0) {
+      _saved.resumeUrl = 0;
+      _saved.resumeOffset = 0;
+      _saved.resumeHashSize = 0;
+      _resumeDirty = true;
+    }
+    _lastCheckpoint = 0;
+  }
+
+  /**
+   * @brief Remember a Retry-After delay (delta-seconds form) sent by the
+   * server, so the scheduler does not check again before it expires
+   */
+  void noteRetryAfter(OTAHttpTransport &http) {
+    String value = http.header("Retry-After");
+    if (!value.isEmpty() && isDigit(value[0])) {
+      _retryAfter = value.toInt() * 1000UL;
+    }
+  }
+
+  /**
+   * @brief Restore the next check time saved before the last reboot
+   *
+   * With a valid wall clock (NTP) the absolute time is used; otherwise the
+   * delay that was left is applied from now. Without a saved schedule the
+   * first check happens one jittered interval after boot.
+   */
+  void loadSchedule() {
+    _scheduleLoaded = true;
+    loadState();
+    _failures = _saved.failures;
+    unsigned long wait = checkDelay(false);
+
+    uint32_t at = _saved.nextCheckAt;
+    time_t now = time(nullptr);
+    if (at > 0 && now > 1600000000) {
+      // Overdue after a power cut: spread the devices that lost it
+      // together instead of all checking once the clock is set
+      wait = at > now ? (at - now) * 1000UL : randomJitter();
+    } else if (_saved.nextCheckWait > 0) {
+      wait = _saved.nextCheckWait;
+    }
+    _nextCheck = millis() + wait;
+  }
+
+  /**
+   * @brief Schedule the next periodic check after an attempt
+   * @param result Result code of the attempt
+   */
+  void scheduleNext(int result) {
+    if (result == OTA_ERR_BUSY) {
+      return;
+    }
+    bool failed = result < 0;
+    _failures = failed ? min(_failures + 1, 16) : 0;
+
+    unsigned long wait = checkDelay(failed);
+    if (_retryAfter > wait) {
+      wait = _retryAfter;
+    }
+    _retryAfter = 0;
+    _nextCheck = millis() + wait;
+    _scheduleLoaded = true;
+
+    // Committed by finish(), in its own small record
+    time_t now = time(nullptr);
+    _saved.nextCheckAt = now > 1600000000 ? now + wait / 1000 : 0;
+    _saved.nextCheckWait = wait;
+    _saved.failures = _failures;
+    _scheduleDirty = true;
+  }
+
+  /**
+   * @brief Start a check from loop(): on the update task in async mode,
+   * otherwise inline
+   */
+  void runCheck() {
+    if (_asyncMode) {
+      beginUpdateAsync(true);
+    } else if (!isUpdating()) {
+      checkUpdate();
+    }
+  }
+
+  /**
+   * @brief Delay until the next check: the interval (server-provided if
+   * set), doubled per consecutive failure up to the backoff limit, plus
+   * random jitter
+   */
+  unsigned long checkDelay(bool failed) {
+    unsigned long interval =
+        _serverInterval > 0 ? _serverInterval : _checkInterval;
+    unsigned long wait = interval;
+    if (failed) {
+      unsigned long limit = max(_maxBackoff, interval);
+      for (uint8_t i = 0; i < _failures && wait < limit; i++) {
+        wait = wait > limit / 2 ? limit : wait * 2;
+      }
+    }
+
+    return wait + randomJitter();
+  }
+
+  /**
+   * @brief Random delay of up to the check jitter (see setCheckJitter())
+   */
+  unsigned long randomJitter() {
+    unsigned long interval =
+        _serverInterval > 0 ? _serverInterval : _checkInterval;
+    unsigned long jitter = _checkJitter < 0 ? interval / 10 : _checkJitter;
+    return jitter > 0 ? esp_random() % (jitter + 1) : 0;
+  }
+
+  /**
+   * @brief Start a fresh metrics record for a check or update attempt
+   */
+  void resetMetrics() {
+    _metrics = OTAMetrics();
+    _flashWriteUs = 0;
+    _heapStart = ESP.getFreeHeap();
+    _heapLow = _heapStart;
+  }
+
+  /**
+   * @brief Track the lowest free heap seen during the attempt
+   */
+  void sampleHeap() {
+    uint32_t free = ESP.getFreeHeap();
+    if (free < _heapLow) {
+      _heapLow = free;
+      _metrics.peakHeapUsed = _heapStart - _heapLow;
+    }
+  }
+
+  /**
+   * @brief Record the outcome of an update attempt and notify listeners
+   * @param result Result code (OTA_UPDATE_OK, OTA_NO_UPDATE or OTA_ERR_*)
+   * @param report false to not queue a report (e.g. already reported)
+   * @return The same result code, for convenient chaining
+   */
+  int finish(int result, bool report = true) {
+    if (_keepAlive && result == OTA_NO_UPDATE) {
+      _transport->release();
+    } else {
+      _transport->close();
+    }
+    _lastResult = result;
+    if (result == OTA_UPDATE_OK) {
+      _state = _dryRun ? OTA_STATE_IDLE : OTA_STATE_REBOOTING;
+    } else if (result == OTA_UPDATE_STAGED) {
+      _state = OTA_STATE_STAGED;
+    } else if (result == OTA_NO_UPDATE) {
+      _state = OTA_STATE_UP_TO_DATE;
+    } else {
+      _state = OTA_STATE_FAILED;
+    }
+
+    loadState();
+    if (report && result != OTA_NO_UPDATE && result != OTA_ERR_BUSY) {
+      queueReport(OTA_REPORT_UPDATE, result, _updateInfo.version.c_str());
+    }
+    if (result != OTA_ERR_BUSY) {
+      _saved.checks++;
+      if (result == OTA_UPDATE_OK) {
+        _saved.updates++;
+      } else if (result < 0) {
+        _saved.errors++;
+      }
+      _statsDirty = true;
+    }
+    if (_checkInterval > 0) {
+      scheduleNext(result);
+    }
+    commitState(_state == OTA_STATE_REBOOTING);
+
+    if (_metricsCallback) {
+      _metricsCallback(_metrics);
+    }
+    if (_completeCallback) {
+      _completeCallback(result);
+    }
+    return result;
+  }
+
+  /**
+   * @brief Query the manifest endpoints; body of hasUpdate()
+   * @return true if update available, false otherwise
+   */
+  bool queryServer() {
+    // Load persistent state on first call (after Serial is ready)
+    loadState();
+
+    if (!_manifestCacheLoaded) {
+      loadManifestCache();
+    }
+
+    log("Checking for updates...");
+    _state = OTA_STATE_CHECKING;
+    resetMetrics();
+    unsigned long checkStart = millis();
+    sendReports();
+
+    // Fastest endpoint first, the others only if it fails
+    const String *endpoints[OTA_MAX_SOURCES];
+    const char *names[OTA_MAX_SOURCES];
+    uint8_t n = 0;
+    endpoints[n++] = &_jsonUrl;
+    for (uint8_t i = 0; i < _manifestUrlCount; i++) {
+      endpoints[n++] = &_manifestUrls[i];
+    }
+    for (uint8_t i = 0; i < n; i++) {
+      names[i] = endpoints[i]->c_str();
+    }
+    uint8_t order[OTA_MAX_SOURCES];
+    _saved.mirrors.rank(names, n, false, order);
+
+    OTAHttpTransport &http = *_transport;
+    const String *endpoint = endpoints[order[0]];
+    int httpCode = -1;
+    for (uint8_t i = 0; i < n; i++) {
+      endpoint = endpoints[order[i]];
+      bool validators = urlKey(*endpoint) == _manifestFrom;
+      uint32_t connectStart = connectionTime();
+      httpCode = followRedirects(http, *endpoint, 5, [&](OTAHttpTransport &h) {
+        if (validators && !_manifestETag.isEmpty()) {
+          h.addHeader("If-None-Match", _manifestETag);
+        }
+        if (validators && !_manifestModified.isEmpty()) {
+          h.addHeader("If-Modified-Since", _manifestModified);
+        }
+      });
+      _statsDirty = true;
+      if (httpCode == 200 || httpCode == 304) {
+        _saved.mirrors.recordLatency(endpoint->c_str(),
+                                     connectionTime() - connectStart);
+        break;
+      }
+      _saved.mirrors.recordFailure(endpoint->c_str());
+      if (i + 1 < n) {
+        log("Manifest request failed, trying: ",
+            endpoints[order[i + 1]]->c_str());
+        _transport->close();
+      }
+    }
+
+    if (httpCode == 304) {
+      // Same manifest as the last check, which had no update for us
+      if (_keepAlive) {
+        _transport->release();
+      } else {
+        _transport->close();
+      }
+      log("Already up to date (not modified)");
+      _updateInfo.available = false;
+      _updateInfo.force = false;
+      _state = OTA_STATE_UP_TO_DATE;
+      _metrics.manifestMs = millis() - checkStart;
+      return false;
+    }
+
+    if (httpCode != 200) {
+      log("Server error: ", httpCode);
+      noteRetryAfter(http);
+      _transport->close();
+      _lastResult = OTA_ERR_DOWNLOAD;
+      _state = OTA_STATE_FAILED;
+      _metrics.manifestMs = millis() - checkStart;
+      return false;
+    }
+
+    String etag = http.header("ETag");
+    String modified = http.header("Last-Modified");
+
+    // Parse straight from the socket, keeping only the fields we use
+    if (_manifestFilter.isNull()) {
+      OTAManifest::buildFilter(_manifestFilter);
+    }
+    if (_manifestArenaEnabled && _manifestArena == nullptr) {
+      _manifestArena = (uint8_t *)malloc(_manifestMaxSize);
+    }
+
+    OTAJsonAllocator allocator(_manifestMaxSize, _manifestArena);
+    JsonDocument doc(&allocator);
+    OTABodyStream body(http.getStream(),
+                       http.header("Transfer-Encoding") == "chunked",
+                       http.getSize());
+    DeserializationError error = deserializeJson(
+        doc, body, DeserializationOption::Filter(_manifestFilter));
+    sampleHeap();
+
+    // Keep the connection for the firmware request if the body was consumed
+    if (error || !body.drain()) {
+      _transport->discard();
+    }
+    _transport->release();
+
+    if (error) {
+      log(error == DeserializationError::NoMemory
+              ? "Manifest exceeds size limit"
+              : "Invalid JSON response");
+      _lastResult = OTA_ERR_DOWNLOAD;
+      _state = OTA_STATE_FAILED;
+      _metrics.manifestMs = millis() - checkStart;
+      return false;
+    }
+
+    uint32_t pollInterval = doc["pollInterval"] | 0;
+    if (pollInterval > 0) {
+      _serverInterval = pollInterval * 1000UL;
+    }
+
+    JsonArray configs = doc["updater"].as<JsonArray>();
+    bool oversize = false;
+
+    for (JsonObject config : configs) {
+      const char *version = config["version"] | "";
+      const char *url = config["url"] | "";
+      bool force = config["force"] | false;
+      size_t nameLength;
+      const char *name = OTAManifest::extractFilename(url, nameLength);
+
+      // For force update, check if firmware filename is different from last
+      // installed
+      if (force) {
+        if (nameLength > 0 &&
+            _lastInstalledFilename.length() == nameLength &&
+            memcmp(name, _lastInstalledFilename.c_str(), nameLength) == 0) {
+          log("Force update skipped - same firmware: ",
+              _lastInstalledFilename.c_str());
+          continue;
+        }
+        if (!inRollout(config, version)) {
+          continue;
+        }
+        if (!selectUpdate(config, true, name, nameLength)) {
+          oversize = true;
+          break;
+        }
+        log("Force update: ", version);
+        log("New firmware file: ", _updateInfo.filename.c_str());
+        _state = OTA_STATE_IDLE;
+        _metrics.manifestMs = millis() - checkStart;
+        return true;
+      }
+
+      // Normal version comparison
+      if (OTAVersion(version) > _parsedVersion) {
+        if (!inRollout(config, version)) {
+          continue;
+        }
+        if (!selectUpdate(config, false, name, nameLength)) {
+          oversize = true;
+          break;
+        }
+        log("Update available: ", version);
+        _state = OTA_STATE_IDLE;
+        _metrics.manifestMs = millis() - checkStart;
+        return true;
+      }
+    }
+
+    if (oversize) {
+      // No validators: a 304 would otherwise hide the entry for good,
+      // even from a build with larger limits
+      _transport->close();
+      _updateInfo.force = false;
+      _lastResult = OTA_ERR_DOWNLOAD;
+      _state = OTA_STATE_FAILED;
+      _metrics.manifestMs = millis() - checkStart;
+      return false;
+    }
+
+    log("Already up to date");
+    if (!_keepAlive) {
+      _transport->close();
+    }
+    saveManifestCache(etag, modified, *endpoint);
+    _updateInfo.available = false;
+    _updateInfo.force = false;
+    _state = OTA_STATE_UP_TO_DATE;
+    _metrics.manifestMs = millis() - checkStart;
+    return false;
+  }
+
+  /**
+   * @brief Shared body of update()/checkUpdate() and the background task
+   * @param recheck true to always query the server, false to reuse the
+   * cached UpdateInfo from a previous hasUpdate()
+   * @return 1 on success (will reboot), 0 if no update, negative on error
+   */
+  int runUpdate(bool recheck) {
+    if (recheck || !_updateInfo.available || _updateInfo.url.isEmpty()) {
+      if (!queryServer()) {
+        if (_state == OTA_STATE_FAILED) {
+          return finish(_lastResult);
+        }
+        return finish(OTA_NO_UPDATE);
+      }
+    } else {
+      resetMetrics();
+      log("Updating to: ", _updateInfo.version.c_str());
+    }
+    if (_stageMode != OTA_STAGE_OFF && _updateInfo.imageCount == 0 &&
+        isStaged() &&
+        _saved.stagedVersion == _updateInfo.version.c_str()) {
+      log("Update already staged: ", _updateInfo.version.c_str());
+      return finish(OTA_UPDATE_STAGED, false); // Reported when staged
+    }
+    if (_stageMode != OTA_STAGE_OFF && _updateInfo.imageCount > 0) {
+      log("Data images cannot be staged, installing now");
+    }
+    if (!rollbackSafe()) {
+      return finish(OTA_ERR_UPDATE);
+    }
+
+    // Every data image needs a writable partition before anything starts
+    const esp_partition_t *partitions[OTA_MAX_IMAGES];
+    for (uint8_t i = 0; i < _updateInfo.imageCount; i++) {
+      partitions[i] = dataPartition(_updateInfo.images[i].partition.c_str());
+      if (partitions[i] == nullptr) {
+        log("No writable data partition: ",
+            _updateInfo.images[i].partition.c_str());
+        return finish(OTA_ERR_NO_PARTITION);
+      }
+    }
+    _deferActivation = _updateInfo.imageCount > 0;
+
+    int result;
+    if (_deltaEnabled && !_updateInfo.patchUrl.isEmpty()) {
+      // Any patch failure (download, stall, no space, bad rebuild) falls
+      // back to the full image; only its own result is final
+      result = install(_updateInfo.patchUrl.c_str(), true);
+      if (result >= 0) { // Installed, or staged (OTA_UPDATE_STAGED)
+        return finish(installed(result, partitions));
+      }
+      log("Delta update failed, downloading full image");
+      _metrics.retries++;
+    }
+
+    result = installFromMirrors();
+    if (result < 0) {
+      _deferActivation = false;
+      return finish(result);
+    }
+    return finish(installed(result, partitions));
+  }
+
+  /**
+   * @brief Check that the other app slot may be overwritten
+   * @return false while the running firmware awaits validation; the other
+   * slot then holds the rollback image
+   */
+  bool rollbackSafe() {
+    if (!OTAFlashWriter::pendingVerify()) {
+      return true;
+    }
+    log("Firmware not validated yet, call validateBoot() or markAsValid()");
+    return false;
+  }
+
+  /**
+   * @brief Complete a successful app install
+   * @param result Result of the app image, OTA_UPDATE_OK or
+   * OTA_UPDATE_STAGED
+   * @param partitions Target of each UpdateInfo::images entry
+   * @return result, or installImages() when the app waits for them
+   */
+  int installed(int result, const esp_partition_t *const *partitions) {
+    bool deferred = _deferActivation;
+    _deferActivation = false;
+    return deferred ? installImages(partitions) : result;
+  }
+
+  /**
+   * @brief Write the data images of the update, then boot the new app
+   *
+   * Runs once the app image is written and verified but not yet bootable.
+   * Data partitions have no second slot, so a data image that fails
+   * leaves its partition incomplete; the boot partition is only switched
+   * when every image succeeded.
+   * @param partitions Target of each UpdateInfo::images entry
+   * @return Result code (does not return when the app is activated)
+   */
+  int installImages(const esp_partition_t *const *partitions) {
+    if (_updateInfo.imageCount == 0 || _dryRun) {
+      if (_updateInfo.imageCount > 0) {
+        log("Dry run: data images not written");
+      }
+      return OTA_UPDATE_OK;
+    }
+
+    OTAImageWriter *app = _flash; // Keeps the app image ready to activate
+    _flash = _dataFlash;
+    int result = OTA_UPDATE_OK;
+    for (uint8_t i = 0; i < _updateInfo.imageCount; i++) {
+      const OTAImage &image = _updateInfo.images[i];
+      log("Installing data image: ", image.partition.c_str());
+      _targetPartition = partitions[i];
+      _targetImage = &image;
+      _deferActivation = true;
+      result = install(image.url.c_str(), false);
+      if (result != OTA_UPDATE_OK) {
+        break;
+      }
+    }
+    _deferActivation = false;
+    _targetPartition = nullptr;
+    _targetImage = nullptr;
+    _flash = app;
+
+    if (result != OTA_UPDATE_OK) {
+      log("Data image failed, boot partition unchanged");
+      return result;
+    }
+    return activateImage(_updateInfo.url.c_str());
+  }
+
+  /**
+   * @brief Find a data partition that may receive an image
+   * @param label Partition label from the manifest
+   * @return Partition, nullptr if missing or a system partition
+   */
+  static const esp_partition_t *dataPartition(const char *label) {
+    const esp_partition_t *partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (partition == nullptr || partition->subtype < OTA_DATA_SUBTYPE_MIN) {
+      return nullptr;
+    }
+    return partition;
+  }
+
+  /**
+   * @brief Partition the current download is written to
+   */
+  const esp_partition_t *targetPartition() const {
+    return _targetPartition != nullptr
+               ? _targetPartition
+               : esp_ota_get_next_update_partition(NULL);
+  }
+
+  /**
+   * @brief Label of targetPartition(), "" if there is none
+   */
+  const char *targetLabel() const {
+    const esp_partition_t *partition = targetPartition();
+    return partition != nullptr ? partition->label : "";
+  }
+
+  /**
+   * @brief Download the full image from a LAN peer or the best WAN source
+   *
+   * Peers are only asked when the manifest lists the image's SHA-256, so
+   * whatever they send is verified before it is installed.
+   * @return Result code of the last attempt
+   */
+  int installFromMirrors() {
+    if (_peerDownloads && !_updateInfo.sha256.isEmpty()) {
+      String peers[OTA_MAX_SOURCES];
+      const char *sources[OTA_MAX_SOURCES];
+      uint8_t n = findPeers(peers, OTA_MAX_SOURCES);
+      for (uint8_t i = 0; i < n; i++) {
+        sources[i] = peers[i].c_str();
+      }
+      if (n > 0) {
+        _peerActive = true; // Peers serve the image uncompressed
+        int result = installFromSources(sources, n, false);
+        _peerActive = false;
+        if (result != OTA_ERR_DOWNLOAD) {
+          return result;
+        }
+        log("No peer could serve the image, using the server");
+      }
+    }
+
+    const char *sources[OTA_MAX_SOURCES];
+    uint8_t n = 0;
+    sources[n++] = _updateInfo.url.c_str();
+    for (uint8_t i = 0; i < _updateInfo.mirrorCount; i++) {
+      sources[n++] = _updateInfo.mirrors[i].c_str();
+    }
+    return installFromSources(sources, n, n > 1);
+  }
+
+  /**
+   * @brief Try sources of the listed image best first
+   *
+   * Sources are ordered by OTAMirrorTable::rank(). When one fails or drops
+   * the connection it is marked and the next takes over, resuming from the
+   * last checkpoint.
+   * @param sources URLs serving the same image
+   * @param n Number of sources
+   * @param probe true to measure never-seen sources first
+   * @return Result code of the last attempt
+   */
+  int installFromSources(const char *const *sources, uint8_t n, bool probe) {
+    if (probe) {
+      probeMirrors(sources, n);
+    }
+    uint8_t order[OTA_MAX_SOURCES];
+    _saved.mirrors.rank(sources, n, true, order);
+
+    int result = OTA_ERR_DOWNLOAD;
+    for (uint8_t i = 0; i < n; i++) {
+      const char *source = sources[order[i]];
+      if (n > 1) {
+        log("Downloading from: ", source);
+      }
+      result = install(source, false, _updateInfo.url.c_str());
+      if (result != OTA_ERR_DOWNLOAD && result != OTA_ERR_STALLED) {
+        break;
+      }
+      _saved.mirrors.recordFailure(source);
+      _statsDirty = true;
+      if (i + 1 < n) {
+        log("Source failed, switching to the next one");
+        _metrics.retries++;
+      }
+    }
+    return result;
+  }
+
+  /**
+   * @brief Look up peers announcing the image the manifest lists
+   * @param urls Receives peer download URLs
+   * @param max Capacity of urls
+   * @return Number of peers found
+   */
+  uint8_t findPeers(String *urls, uint8_t max) {
+    int found = MDNS.queryService(OTA_PEER_SERVICE, "tcp");
+    uint8_t n = 0;
+    for (int i = 0; i < found && n < max; i++) {
+      String hash = MDNS.txt(i, "sha256");
+      if (!hash.equalsIgnoreCase(_updateInfo.sha256.c_str())) {
+        continue;
+      }
+      urls[n++] = "http://" + MDNS.IP(i).toString() + ":" +
+                  String(MDNS.port(i)) + "/ota/" + hash + ".bin";
+    }
+    if (n > 0) {
+      log("Peers with this image: ", n);
+    }
+    return n;
+  }
+
+  /**
+   * @brief Measure connect + TTFB of sources never seen before
+   *
+   * Requests the first byte only, so a source gets a latency score before
+   * the first download picks between them.
+   * @param sources Firmware URLs
+   * @param n Number of sources
+   */
+  void probeMirrors(const char *const *sources, uint8_t n) {
+    OTAHttpTransport &http = *_transport;
+    for (uint8_t i = 0; i < n; i++) {
+      const OTAMirrorScore *score = _saved.mirrors.find(sources[i]);
+      if (score != nullptr && score->latencyMs > 0) {
+        continue;
+      }
+      uint32_t start = connectionTime();
+      int httpCode =
+          followRedirects(http, sources[i], 5, [](OTAHttpTransport &h) {
+            h.addHeader("Range", "bytes=0-0");
+          });
+      if (httpCode == 200 || httpCode == 206) {
+        _saved.mirrors.recordLatency(sources[i], connectionTime() - start);
+      } else {
+        _saved.mirrors.recordFailure(sources[i]);
+      }
+      _statsDirty = true;
+      _transport->close();
+    }
+  }
+
+  /**
+   * @brief Queue an event for the next report upload
+   * @param type OTAReportType
+   * @param result Result code or OTABootResult
+   * @param version Version the event is about
+   * @param check Failed health check, if any
+   */
+  void queueReport(OTAReportType type, int result, const char *version,
+                   const char *check = "") {
+    if (_reportUrl.isEmpty()) {
+      return;
+    }
+    loadState();
+    OTAReport report;
+    report.type = type;
+    report.result = result;
+    time_t now = time(nullptr);
+    report.time = now > 1600000000 ? now : 0;
+    report.version = version;
+    report.check = check;
+    if (type == OTA_REPORT_UPDATE) {
+      report.downloadMs = _metrics.downloadMs;
+      report.downloaded = _metrics.downloaded;
+      report.bytesPerSecond = _metrics.bytesPerSecond;
+      report.retries = _metrics.retries;
+    }
+    _saved.reports.push(report);
+    _savedDirty = true;
+  }
+
+  /**
+   * @brief Upload queued reports in one POST ahead of the manifest request
+   *
+   * Goes out on the connection the manifest request then reuses (same
+   * host). Reports stay queued until the server answers 2xx.
+   */
+  void sendReports() {
+    uint8_t n = _saved.reports.count;
+    if (_reportUrl.isEmpty() || n == 0) {
+      return;
+    }
+
+    JsonDocument doc;
+    doc["device"] = WiFi.macAddress();
+    doc["version"] = _currentVersion;
+    doc["dropped"] = _saved.reports.dropped;
+    JsonArray list = doc["reports"].to<JsonArray>();
+    for (uint8_t i = 0; i < n; i++) {
+      const OTAReport &report = _saved.reports.at(i);
+      JsonObject entry = list.add<JsonObject>();
+      static const char *types[] = {"update", "boot", "rollback"};
+      entry["type"] = types[report.type % 3];
+      entry["result"] = report.result;
+      entry["version"] = report.version.c_str();
+      if (report.time > 0) {
+        entry["time"] = report.time;
+      }
+      if (!report.check.isEmpty()) {
+        entry["check"] = report.check.c_str();
+      }
+      if (report.downloaded > 0) {
+        entry["downloadMs"] = report.downloadMs;
+        entry["downloaded"] = report.downloaded;
+        entry["bytesPerSecond"] = report.bytesPerSecond;
+      }
+      if (report.retries > 0) {
+        entry["retries"] = report.retries;
+      }
+    }
+    String body;
+    serializeJson(doc, body);
+    doc.clear();
+
+    static const char *responseHeaders[] = {"Transfer-Encoding"};
+    OTAHttpTransport &http = *_transport;
+    int httpCode = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+      if (!_transport->begin(_reportUrl)) {
+        log(_transport->error().c_str(), (": " + _reportUrl).c_str());
+        break;
+      }
+      http.setTimeout(30000);
+      http.collectHeaders(responseHeaders, 1);
+      http.addHeader("Content-Type", "application/json");
+      httpCode = http.POST(body);
+      if (httpCode < 0 && _transport->reused()) {
+        _transport->discard(); // Kept-alive socket was closed, retry once
+        continue;
+      }
+      break;
+    }
+
+    if (httpCode >= 200 && httpCode < 300) {
+      log("Reports sent: ", (long)n);
+      _saved.reports.drop(n);
+      _savedDirty = true;
+    } else {
+      log("Report upload failed: ", httpCode);
+    }
+    if (httpCode > 0) {
+      discardBody(http);
+      _transport->release();
+    } else {
+      _transport->close();
+    }
+  }
+
+  /**
+   * @brief Boot record in RTC memory, shared by every OTAClient
+   */
+  static OTABootRecord &bootRecord() {
+    static RTC_NOINIT_ATTR OTABootRecord record;
+    return record;
+  }
+
+  /**
+   * @brief Run the health checks against one shared time budget
+   * @param budgetMs Time for all checks together
+   * @return Index of the first check that failed, -1 if all passed
+   */
+  int runHealthChecks(uint32_t budgetMs) {
+    unsigned long start = millis();
+    for (uint8_t i = 0; i < _healthCheckCount; i++) {
+      log("Health check: ", _healthChecks[i].name);
+      while (!_healthChecks[i].check()) {
+        if (millis() - start >= budgetMs) {
+          return i;
+        }
+        delay(OTA_VALIDATE_POLL);
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * @brief Store and report the outcome of validateBoot()
+   */
+  OTABootResult reportBoot(OTABootResult result, const char *failed) {
+    _bootResult = result;
+    _failedCheck = failed;
+    if (_bootCallback) {
+      _bootCallback(result, failed);
+    }
+    return result;
+  }
+
+  /**
+   * @brief Connection setup and TTFB accumulated in the current metrics
+   */
+  uint32_t connectionTime() const {
+    return _metrics.dnsMs + _metrics.connectMs + _metrics.tlsMs +
+           _metrics.ttfbMs;
+  }
+
+  /**
+   * @brief FreeRTOS entry point for beginUpdateAsync()
+   * @param arg Owning OTAClient instance
+   */
+  static void asyncTaskEntry(void *arg) {
+    OTAClient *self = static_cast<OTAClient *>(arg);
+    self->runUpdate(self->_asyncRecheck);
+    self->_asyncTask = nullptr;
+    vTaskDelete(NULL);
+  }
+
+  /**
+   * @brief Write reconstructed image data to the target partition
+   *
+   * For delta and compressed updates the flash writer is started here, once
+   * the patch header has revealed the image size (or with the size unknown
+   * for gzip streams).
+   * @param data Image bytes
+   * @param len Number of bytes
+   * @return true on success, false if the flash write failed
+   */
+  bool writeImage(const uint8_t *data, size_t len) {
+    if (!_flashReady) {
+      if (!_flash->begin(targetLabel(), _deltaActive ? _delta.imageSize() : 0,
+                         _eraseMode)) {
+        log("Not enough space for update");
+        _installError = OTA_ERR_NO_SPACE;
+        return false;
+      }
+      if (_hashImage) {
+        _flash->beginHash();
+      }
+      _flashReady = true;
+    }
+
+    unsigned long start = micros();
+    bool ok = _flash->write(data, len);
+    uint32_t elapsed = micros() - start;
+    _flashWriteUs += elapsed;
+    _metrics.flashWriteMs = _flashWriteUs / 1000;
+    if (elapsed / 1000 > _metrics.maxWriteStallMs) {
+      _metrics.maxWriteStallMs = elapsed / 1000;
+    }
+
+    if (!ok) {
+      log("Flash write failed");
+      return false;
+    }
+    _imageWritten += len;
+    feedWatchdog();
+    return true;
+  }
+
+  /**
+   * @brief Reset the task watchdog if the update task is subscribed to it
+   *
+   * A no-op on other tasks, e.g. the pipelined writer, which is not on the
+   * watchdog (resetting from there fails and logs on every chunk).
+   */
+  void feedWatchdog() {
+    if (_watchdogTask != nullptr &&
+        xTaskGetCurrentTaskHandle() == _watchdogTask) {
+      esp_task_wdt_reset();
+    }
+  }
+
+  /**
+   * @brief Check the running transfer for a stall
+   * @return true if it must be aborted (sets OTA_ERR_STALLED)
+   */
+  bool stalled() {
+    const char *reason = _stall.check();
+    if (reason == nullptr) {
+      return false;
+    }
+    log("Download stalled: ", reason);
+    _installError = OTA_ERR_STALLED;
+    return true;
+  }
+
+  /**
+   * @brief Route decompressed data to the patch decoder or straight to flash
+   */
+  bool decodeImage(const uint8_t *data, size_t len) {
+    return _deltaActive ? _delta.write(data, len) : writeImage(data, len);
+  }
+
+  /**
+   * @brief Switch the current download to gzip decoding
+   * @return true on success, false if the inflate window is unavailable
+   */
+  bool beginGzip() {
+    _gzipActive = true;
+    _checkpointing = false; // Inflater state cannot be resumed
+    if (!_deltaActive) {
+      _flashReady = false; // Image size is unknown, restart lazily
+    }
+    if (!_inflater.begin([this](const uint8_t *data, size_t len) {
+          return decodeImage(data, len);
+        })) {
+      log("Not enough memory to decompress");
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Process one chunk of downloaded data and report progress
+   * @param data Downloaded bytes (image or patch)
+   * @param len Number of bytes
+   * @return true on success, false if decoding or the flash write failed
+   */
+  bool writeChunk(const uint8_t *data, size_t len) {
+    sampleHeap();
+
+    // Static hosts serve .gz files without Content-Encoding: check the magic
+    if (_sniffGzip) {
+      _sniffGzip = false;
+      if (len >= 2 && data[0] == 0x1F && data[1] == 0x8B && !beginGzip()) {
+        return false;
+      }
+    }
+
+    bool ok = _gzipActive ? _inflater.write(data, len) : decodeImage(data, len);
+    if (!ok) {
+      return false;
+    }
+    _written += len;
+
+    if (_checkpointing &&
+        _flash->flushed() - _lastCheckpoint >= OTA_RESUME_CHECKPOINT) {
+      saveCheckpoint(_flash->flushed());
+    }
+
+    // Without a Content-Length (chunked) only bytes can be reported
+    int percent = _contentLength > 0
+                      ? (int)(((int64_t)_written * 100) / _contentLength)
+                      : 0;
+    if ((percent != _lastPercent || _contentLength == 0) &&
+        (percent == 100 ||
+         (millis() - _lastProgressTime >= _progressInterval &&
+          (size_t)_written - _lastProgressBytes >= _progressBytes))) {
+      _lastPercent = percent;
+      _lastProgressTime = millis();
+      _lastProgressBytes = _written;
+
+      OTAProgress progress;
+      progress.percent = percent;
+      progress.downloaded = _written;
+      progress.total = _contentLength;
+      progress.written = _imageWritten;
+
+      if (_progressQueued) {
+        _progressQueue.push(progress);
+      } else {
+        deliverProgress(progress);
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Run the progress callbacks for one event
+   */
+  void deliverProgress(const OTAProgress &progress) {
+    if (_progressDetailCallback) {
+      _progressDetailCallback(progress);
+    }
+
+    if (_progressCallback) {
+      _progressCallback(progress.percent, progress.downloaded, progress.total);
+    } else if (!_progressDetailCallback && progress.percent % 10 == 0) {
+      Serial.printf("[OTA] Progress: %d%%\n", progress.percent);
+    }
+  }
+
+  /**
+   * @brief Check the written image against the manifest hash and signature
+   * @return true if every configured check passes
+   */
+  bool verifyImage() {
+    if (!_hashImage) {
+      return true;
+    }
+    const uint8_t *digest = _flash->digest();
+    if (digest == nullptr) {
+      log("Image hash unavailable");
+      return false;
+    }
+
+    if (!_expectedHash.isEmpty()) {
+      char hex[65];
+      for (int i = 0; i < 32; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+      }
+      if (!_expectedHash.equalsIgnoreCase(hex)) {
+        log("SHA-256 mismatch: ", hex);
+        return false;
+      }
+    }
+
+    if (_signingKey != nullptr) {
+      uint8_t sig[OTA_SIGNATURE_MAX_SIZE];
+      size_t sigLen = 0;
+      if (_expectedSignature.isEmpty() ||
+          mbedtls_base64_decode(
+              sig, sizeof(sig), &sigLen,
+              (const unsigned char *)_expectedSignature.c_str(),
+              _expectedSignature.length()) != 0) {
+        log("Missing or malformed firmware signature");
+        return false;
+      }
+
+      mbedtls_pk_context key;
+      mbedtls_pk_init(&key);
+      bool valid =
+          mbedtls_pk_parse_public_key(&key,
+                                      (const unsigned char *)_signingKey,
+                                      strlen(_signingKey) + 1) == 0 &&
+          mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, 32, sig,
+                            sigLen) == 0;
+      mbedtls_pk_free(&key);
+      if (!valid) {
+        log("Firmware signature invalid");
+        return false;
+      }
+    }
+
+    log("Image verified");
+    return true;
+  }
+
+  /**
+   * @brief Whether more of the response body is expected
+   * @param received Body bytes (plus resume offset) read so far
+   */
+  bool bodyPending(OTAHttpTransport &http, OTABodyStream *stream,
+                   int received) {
+    return http.connected() && !stream->ended() &&
+           (_contentLength == 0 || received < _contentLength);
+  }
+
+  /**
+   * @brief Stream the response body to flash on the calling task
+   * @return true if every byte was written, false on write error or stall
+   */
+  bool transferDirect(OTAHttpTransport &http, OTABodyStream *stream) {
+    uint8_t buff[OTA_BUFFER_SIZE];
+
+    while (bodyPending(http, stream, _written)) {
+      int available = stream->available();
+      if (available > 0) {
+        int len = stream->readBytes(buff, min(available, (int)sizeof(buff)));
+        if (!writeChunk(buff, len)) {
+          return false;
+        }
+        _stall.received(len);
+      }
+      if (stalled()) {
+        return false;
+      }
+      feedWatchdog();
+      delay(1);
+    }
+    return true;
+  }
+
+  /**
+   * @brief FreeRTOS entry point for the pipelined flash writer
+   * @param arg Owning OTAClient instance
+   */
+  static void writerTaskEntry(void *arg) {
+    OTAClient *self = static_cast<OTAClient *>(arg);
+    OTAChunkRing::Chunk chunk;
+
+    while (xQueueReceive(self->_ring.fullSlots, &chunk, portMAX_DELAY) ==
+           pdTRUE) {
+      if (chunk.len == 0) {
+        break;
+      }
+      // Keep draining after a failure so the reader never blocks on a slot
+      if (!self->_writeFailed &&
+          !self->writeChunk(self->_ring.data(chunk.slot), chunk.len)) {
+        self->_writeFailed = true;
+      }
+      xQueueSend(self->_ring.freeSlots, &chunk, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(self->_writerDone);
+    vTaskDelete(NULL);
+  }
+
+  /**
+   * @brief Stream the response body with network reads and flash writes
+   * overlapped: this task fills ring slots, a writer task on the other core
+   * empties them into flash
+   * @return true if every byte was written, false on write error or stall
+   */
+  bool transferPipelined(OTAHttpTransport &http, OTABodyStream *stream) {
+    if (!_ring.begin(_pipeSlots, _pipeSlotSize)) {
+      log("Pipeline buffers unavailable, using direct transfer");
+      return transferDirect(http, stream);
+    }
+
+    if (_writerDone == nullptr) {
+      _writerDone = xSemaphoreCreateBinary();
+    }
+    _writeFailed = false;
+
+    BaseType_t core =
+        portNUM_PROCESSORS > 1 ? 1 - xPortGetCoreID() : tskNO_AFFINITY;
+    if (_writerDone == nullptr ||
+        xTaskCreatePinnedToCore(writerTaskEntry, "ota_writer",
+                                OTA_WRITER_STACK_SIZE, this, _taskPriority,
+                                NULL, core) != pdPASS) {
+      log("Failed to start writer task, using direct transfer");
+      _ring.end();
+      return transferDirect(http, stream);
+    }
+
+    size_t slotSize = _ring.slotSize();
+    int received = _written;
+    OTAChunkRing::Chunk chunk;
+
+    bool aborted = false;
+    while (bodyPending(http, stream, received) && !_writeFailed && !aborted) {
+      feedWatchdog();
+      if (xQueueReceive(_ring.freeSlots, &chunk, pdMS_TO_TICKS(100)) !=
+          pdTRUE) {
+        _stall.touch();
+        continue; // Writer is busy, all slots are full
+      }
+
+      uint8_t *dst = _ring.data(chunk.slot);
+      size_t want = _contentLength > 0
+                        ? min(slotSize, (size_t)(_contentLength - received))
+                        : slotSize;
+      chunk.len = 0;
+
+      // Fill the slot with whatever has arrived; hand it off once the
+      // socket runs dry so the writer never waits on a half-empty slot
+      while (chunk.len < want) {
+        int available = stream->available();
+        if (available <= 0) {
+          if (chunk.len > 0 || !http.connected() || stream->ended()) {
+            break;
+          }
+          if (stalled()) {
+            aborted = true;
+            break;
+          }
+          feedWatchdog();
+          delay(1);
+          continue;
+        }
+        size_t len = stream->readBytes(
+            dst + chunk.len, min((size_t)available, want - chunk.len));
+        chunk.len += len;
+        _stall.received(len);
+      }
+
+      if (chunk.len == 0) {
+        xQueueSend(_ring.freeSlots, &chunk, 0);
+        continue;
+      }
+      received += chunk.len;
+      xQueueSend(_ring.fullSlots, &chunk, portMAX_DELAY);
+    }
+
+    // End-of-stream marker, then wait for the writer to drain
+    chunk.len = 0;
+    xQueueSend(_ring.fullSlots, &chunk, portMAX_DELAY);
+    xSemaphoreTake(_writerDone, portMAX_DELAY);
+    _ring.end();
+
+    return !_writeFailed && !aborted;
+  }
+
+  /**
+   * @brief Download and install a full image or a delta patch
+   *
+   * Reports success through finish() right before rebooting; failures are
+   * returned to the caller, which decides whether to retry or report them.
+   * @param url Firmware binary or patch URL
+   * @param delta true if url points to a patch against the running image
+   * @return 1 on success (will reboot), negative on error
+   */
+  int install(const String &url, bool delta) {
+    return install(url, delta, url);
+  }
+
+  /**
+   * @brief Download and install one image from one of its sources
+   * @param url URL to download from
+   * @param delta true if url is a bsdiff patch
+   * @param image URL the manifest lists for the image; a mirror's download
+   * resumes checkpoints and is verified under this name
+   * @return Result code (see OTA_UPDATE_OK / OTA_ERR_*)
+   */
+  int install(const String &url, bool delta, const String &image) {
+    int result = installOnce(url, delta, image);
+    for (uint8_t retry = 0; result == OTA_ERR_STALLED && retry < _stallRetries;
+         retry++) {
+      log("Retrying stalled download");
+      _metrics.retries++;
+      result = installOnce(url, delta, image);
+    }
+    return result;
+  }
+
+  /**
+   * @brief One download attempt of install()
+   * @return Result code (see OTA_UPDATE_OK / OTA_ERR_*)
+   */
+  int installOnce(const String &url, bool delta, const String &image) {
+    OTAProfileScope profile(_profileEnabled ? &_profile : nullptr);
+    log(delta ? "Downloading patch..." : "Downloading firmware...");
+    _state = OTA_STATE_DOWNLOADING;
+
+    // A patch reconstructs the same image, so it is checked the same way
+    bool listed = image == _updateInfo.url || image == _updateInfo.patchUrl;
+    _expectedHash = listed ? _updateInfo.sha256.c_str() : "";
+    _expectedSignature = listed ? _updateInfo.signature.c_str() : "";
+    if (_targetImage != nullptr) {
+      _expectedHash = _targetImage->sha256.c_str();
+      _expectedSignature = _targetImage->signature.c_str();
+    }
+    _hashImage = !_expectedHash.isEmpty() || _signingKey != nullptr;
+
+    // Decoder state cannot be checkpointed, so patches and gzip images
+    // always start over (a peer sends even gzip-listed images raw)
+    bool hinted =
+        image == _updateInfo.url && _updateInfo.compressed && !_peerActive;
+    bool resumable = _resumable && !delta && !hinted;
+    String validator;
+    size_t totalSize = 0;
+    size_t resumeFrom =
+        resumable ? loadCheckpoint(image, validator, totalSize) : 0;
+
+    // Another mirror's validator means nothing here. Without it the bytes
+    // are only trusted when the finished image is hash-checked; otherwise
+    // If-Range makes the server send the whole file.
+    bool otherMirror = resumeFrom > 0 && _saved.resumeSource != urlKey(url);
+    if (otherMirror && _hashImage) {
+      validator = "";
+    }
+
+    OTAHttpTransport &http = *_transport;
+    uint32_t connectStart = connectionTime();
+    int httpCode = followRedirects(http, url, 5, [&](OTAHttpTransport &h) {
+      if (_acceptGzip && resumeFrom == 0) {
+        h.addHeader("Accept-Encoding", "gzip");
+      }
+      if (resumeFrom > 0) {
+        h.addHeader("Range", "bytes=" + String(resumeFrom) + "-");
+        if (!validator.isEmpty()) {
+          h.addHeader("If-Range", validator);
+        }
+      }
+    });
+
+    if (httpCode == 206 && resumeFrom > 0) {
+      // Content-Range: bytes <start>-<end>/<total>
+      String range = http.header("Content-Range");
+      int dash = range.indexOf('-');
+      int slash = range.indexOf('/');
+      if (dash < 0 || slash < 0 ||
+          (size_t)range.substring(6, dash).toInt() != resumeFrom ||
+          (size_t)range.substring(slash + 1).toInt() != totalSize) {
+        log("Resume rejected, restarting download");
+        _transport->close();
+        clearCheckpoint();
+        _metrics.retries++;
+        return installOnce(url, delta, image);
+      }
+      log("Resuming download at byte ", resumeFrom);
+      if (otherMirror) {
+        String tag = http.header("ETag");
+        _saved.resumeSource = urlKey(url);
+        _saved.resumeTag = tag.isEmpty() ? http.header("Last-Modified") : tag;
+        _resumeDirty = true;
+      }
+    } else if (httpCode == 200) {
+      resumeFrom = 0; // Server ignored the range or the file changed
+    } else {
+      log("Download failed: ", httpCode);
+      noteRetryAfter(http);
+      _transport->close();
+      return OTA_ERR_DOWNLOAD;
+    }
+    _saved.mirrors.recordLatency(url.c_str(), connectionTime() - connectStart);
+    _statsDirty = true;
+    if (_targetPartition == nullptr) {
+      discardStaged(); // The slot is about to be overwritten
+    }
+
+    // A chunked body has no Content-Length (e.g. compressed on the fly);
+    // it is written without a known size and cannot be resumed
+    bool chunked = http.header("Transfer-Encoding") == "chunked";
+    int contentLength = resumeFrom > 0 ? (int)totalSize : http.getSize();
+    if (contentLength <= 0 && !chunked) {
+      log("Invalid content length");
+      _transport->close();
+      return OTA_ERR_DOWNLOAD;
+    }
+    if (contentLength <= 0) {
+      contentLength = 0;
+      resumable = false;
+    }
+
+    OTABodyStream body(http.getStream(), chunked, http.getSize());
+    OTABodyStream *stream = &body;
+
+    bool gzip = http.header("Content-Encoding") == "gzip" || hinted;
+    if (gzip) {
+      resumable = false; // Inflater state cannot be checkpointed
+    }
+
+    _deltaActive = delta;
+    _gzipActive = false;
+    _sniffGzip = !gzip && resumeFrom == 0;
+    _flashReady = false;
+    _imageWritten = resumeFrom;
+    _installError = OTA_ERR_UPDATE;
+    _checkpointing = resumable;
+
+    if (delta) {
+      _delta.begin(esp_ota_get_running_partition(),
+                   [this](const uint8_t *data, size_t len) {
+                     return writeImage(data, len);
+                   });
+    }
+    if (gzip && !beginGzip()) {
+      _transport->close();
+      return OTA_ERR_UPDATE;
+    }
+
+    // Patches and gzip streams start the flash writer lazily in writeImage()
+    if (!delta && !gzip) {
+      if (!_flash->begin(targetLabel(), contentLength, _eraseMode,
+                         resumeFrom)) {
+        log("Not enough space for update");
+        _transport->close();
+        clearCheckpoint();
+        return OTA_ERR_NO_SPACE;
+      }
+      const uint8_t *state = resumeFrom > 0 ? _saved.resumeHash : nullptr;
+      size_t stateSize = resumeFrom > 0 ? _saved.resumeHashSize : 0;
+      if (_hashImage && !_flash->beginHash(state, stateSize)) {
+        _flash->abort();
+        _transport->close();
+        if (resumeFrom == 0) {
+          return OTA_ERR_UPDATE;
+        }
+        log("Resume rejected, restarting download"); // Other writer/build
+        clearCheckpoint();
+        _metrics.retries++;
+        return installOnce(url, delta, image);
+      }
+      _flashReady = true;
+    }
+
+    if (resumable && resumeFrom == 0) {
+      String tag = http.header("ETag");
+      if (tag.isEmpty()) {
+        tag = http.header("Last-Modified");
+      }
+      beginCheckpoint(image, tag, contentLength, url);
+    }
+    _lastCheckpoint = resumeFrom;
+
+    log("Installing...");
+
+    _contentLength = contentLength;
+    _written = resumeFrom;
+    _lastPercent = -1;
+    _lastProgressTime = millis() - _progressInterval;
+    _lastProgressBytes = resumeFrom;
+
+    _stall.begin(_stallTimeout, _minThroughput, _throughputWindow);
+    _watchdogTask = esp_task_wdt_status(NULL) == ESP_OK
+                        ? xTaskGetCurrentTaskHandle()
+                        : nullptr;
+
+    unsigned long transferStart = millis();
+    bool ok = _pipelined ? transferPipelined(http, stream)
+                         : transferDirect(http, stream);
+    _metrics.downloadMs = millis() - transferStart;
+    _metrics.downloaded = _written - resumeFrom;
+    if (_metrics.downloadMs > 0) {
+      _metrics.bytesPerSecond =
+          (uint64_t)_metrics.downloaded * 1000 / _metrics.downloadMs;
+    }
+
+    _transport->close();
+    bool inflated = !_gzipActive || _inflater.finished();
+    _inflater.end();
+
+    if (!ok) {
+      _flash->abort();
+      if (_installError != OTA_ERR_STALLED) {
+        clearCheckpoint(); // A stalled download resumes from the checkpoint
+      }
+      log("Update failed");
+      return _installError;
+    }
+
+    if (_metrics.bytesPerSecond > 0) {
+      _saved.mirrors.recordThroughput(url.c_str(), _metrics.bytesPerSecond);
+      _statsDirty = true;
+    }
+
+    if (contentLength == 0 && !body.ended()) {
+      _flash->abort();
+      log("Download interrupted at byte ", _written);
+      return OTA_ERR_DOWNLOAD;
+    }
+    if (_written < contentLength) {
+      // Connection dropped: keep what is in flash for the next attempt
+      if (_checkpointing) {
+        saveCheckpoint(_flash->flushed());
+      }
+      _flash->abort();
+      log("Download interrupted at byte ", _written);
+      return OTA_ERR_DOWNLOAD;
+    }
+
+    if (!inflated || (delta && !_delta.finished())) {
+      log("Download ended before the image was complete");
+      _flash->abort();
+      return OTA_ERR_UPDATE;
+    }
+
+    if (!_flash->end()) {
+      clearCheckpoint();
+      log("Update failed");
+      return OTA_ERR_UPDATE;
+    }
+    if (_eraseMode == OTA_ERASE_CHANGED) {
+      log("Unchanged sectors skipped: ", _flash->skipped());
+    }
+    if (!verifyImage()) {
+      clearCheckpoint();
+      return OTA_ERR_VERIFY;
+    }
+
+    if (_dryRun || _deferActivation) {
+      // Written and verified, but not (yet) made bootable
+      clearCheckpoint();
+      if (_dryRun) {
+        log("Dry run complete, boot partition unchanged");
+      }
+      return OTA_UPDATE_OK;
+    }
+    if (_stageMode != OTA_STAGE_OFF) {
+      return stageImage(image);
+    }
+    return activateImage(image);
+  }
+
+  /**
+   * @brief Boot the app image the flash writer just wrote, then reboot
+   * @param image URL the manifest lists for the image
+   * @return OTA_ERR_UPDATE if the image could not be activated (does not
+   * return on success)
+   */
+  int activateImage(const String &image) {
+    bool installed = _flash->activate();
+    clearCheckpoint();
+
+    if (installed) {
+      recordInstall(imageFilename(image));
+
+      log("Update complete! Rebooting...");
+      finish(OTA_UPDATE_OK); // Commits the state record before reboot
+      delay(500);
+      ESP.restart();
+      return OTA_UPDATE_OK;
+    }
+
+    log("Update failed");
+    return OTA_ERR_UPDATE;
+  }
+
+public:
+  /**
+   * @brief Construct OTA Client
+   * @param jsonUrl URL to JSON API endpoint
+   * @param version Current firmware version (e.g., "1.0.0")
+   */
+  OTAClient(const char *jsonUrl, const char *version) {
+    _jsonUrl = jsonUrl;
+    _currentVersion = version;
+    _parsedVersion = OTAVersion(version);
+    _defaultTransport.setMetrics(&_metrics);
+    // Note: persistent state is loaded on first use so Serial is ready
+  }
+
+  ~OTAClient() { free(_manifestArena); }
+
+  /**
+   * @brief Set progress callback
+   * @param callback Function(int percent, int bytesWritten, int totalBytes)
+   */
+  void onProgress(OTAProgressCallback callback) {
+    _progressCallback = callback;
+  }
+
+  /**
+   * @brief Set detailed progress callback
+   *
+   * Reports downloaded bytes and image bytes written separately, which
+   * differ for compressed and delta downloads.
+   * @param callback Function(const OTAProgress &progress)
+   */
+  void onProgressDetail(OTAProgressDetailCallback callback) {
+    _progressDetailCallback = callback;
+  }
+
+  /**
+   * @brief Limit how often progress is reported
+   *
+   * An event is emitted when the percentage changes and both limits have
+   * passed since the last one; 100% is always reported.
+   * @param minIntervalMs Minimum time between events (0 = no limit)
+   * @param minBytes Minimum downloaded bytes between events (0 = no limit)
+   */
+  void setProgressThrottle(uint32_t minIntervalMs, size_t minBytes = 0) {
+    _progressInterval = minIntervalMs;
+    _progressBytes = minBytes;
+  }
+
+  /**
+   * @brief Deliver progress through a queue instead of from the transfer
+   *
+   * Events are queued lock-free and the callbacks run when the application
+   * drains them: from loop(), or with pollProgress() on any single task.
+   * Meant for async mode, so slow UI work never stalls the download.
+   * @param enabled true to queue progress events
+   */
+  void setProgressQueue(bool enabled) { _progressQueued = enabled; }
+
+  /**
+   * @brief Take the oldest queued progress event (see setProgressQueue())
+   * @param progress Receives the event
+   * @return false if no event is pending
+   */
+  bool pollProgress(OTAProgress &progress) {
+    return _progressQueue.pop(progress);
+  }
+
+  /**
+   * @brief Run the progress callbacks for all queued events
+   */
+  void dispatchProgress() {
+    OTAProgress progress;
+    while (_progressQueue.pop(progress)) {
+      deliverProgress(progress);
+    }
+  }
+
+  /**
+   * @brief Set completion callback
+   *
+   * Called once per update attempt with the result code. On success it runs
+   * just before the device reboots. In async mode it runs on the update task,
+   * so keep it short and thread-safe.
+   * @param callback Function(int result)
+   */
+  void onComplete(OTACompleteCallback callback) {
+    _completeCallback = callback;
+  }
+
+  /**
+   * @brief Set metrics callback
+   *
+   * Called with the timings of each update attempt, right before the
+   * completion callback (see getMetrics()).
+   * @param callback Function(const OTAMetrics &)
+   */
+  void onMetrics(OTAMetricsCallback callback) { _metricsCallback = callback; }
+
+  /**
+   * @brief Timing and throughput of the last check or update attempt
+   *
+   * hasUpdate(), update(), checkUpdate() and doUpdate() each start a new
+   * record; an update that checks the server first reports both together.
+   */
+  OTAMetrics getMetrics() { return _metrics; }
+
+  /**
+   * @brief Check if update is available (does NOT download)
+   * @return true if update available, false otherwise (also while a check
+   * or download is already running)
+   */
+  bool hasUpdate() {
+    if (isUpdating()) {
+      log("Update already in progress");
+      return false;
+    }
+    return queryServer();
+  }
+
+  /**
+   * @brief Perform update (call hasUpdate first or use directly)
+   * @return 1 on success (will reboot), 0 if no update, negative on error
+   */
+  int update() {
+    if (isUpdating()) {
+      log("Update already in progress");
+      return OTA_ERR_BUSY;
+    }
+    return runUpdate(false);
+  }
+
+  /**
+   * @brief Get cached update info (call hasUpdate first)
+   * @return UpdateInfo struct with version and URL
+   */
+  const UpdateInfo &getUpdateInfo() const { return _updateInfo; }
+
+  /**
+   * @brief Check for update and install if available
+   * @return 1 on success (will reboot), 0 if up to date, negative on error
+   */
+  int checkUpdate() {
+    if (isUpdating()) {
+      log("Update already in progress");
+      return OTA_ERR_BUSY;
+    }
+    return runUpdate(true);
+  }
+
+  /**
+   * @brief Run update() on a background FreeRTOS task
+   *
+   * Returns immediately; poll isUpdating()/getState() or use onComplete()
+   * to learn the result. Task placement is set with setAsyncTask().
+   * @param recheck true to query the server first even if hasUpdate() has
+   * already cached an update (checkUpdate() semantics)
+   * @return true if the task was started, false if one is already running
+   */
+  bool beginUpdateAsync(bool recheck = false) {
+    if (isUpdating()) {
+      log("Update already in progress");
+      return false;
+    }
+
+    _asyncRecheck = recheck;
+    _state = OTA_STATE_CHECKING;
+
+    BaseType_t ok = xTaskCreatePinnedToCore(asyncTaskEntry, "ota_update",
+                                            _taskStackSize, this,
+                                            _taskPriority, &_asyncTask,
+                                            _taskCore);
+    if (ok != pdPASS) {
+      log("Failed to start update task");
+      _asyncTask = nullptr;
+      _state = OTA_STATE_FAILED;
+      _lastResult = OTA_ERR_BUSY;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Configure the background update task
+   * @param core CPU core to pin the task to (0, 1 or tskNO_AFFINITY)
+   * @param priority FreeRTOS priority (default 1)
+   * @param stackSize Stack size in bytes (default 8192)
+   */
+  void setAsyncTask(BaseType_t core, UBaseType_t priority = OTA_TASK_PRIORITY,
+                    uint32_t stackSize = OTA_TASK_STACK_SIZE) {
+    _taskCore = core;
+    _taskPriority = priority;
+    _taskStackSize = stackSize;
+  }
+
+  /**
+   * @brief Let loop() run periodic checks on the background task
+   * @param enabled true to make loop() non-blocking
+   */
+  void setAsyncMode(bool enabled) { _asyncMode = enabled; }
+
+  /**
+   * @brief Check whether a check or download is currently running
+   * @return true while checking or downloading
+   */
+  bool isUpdating() {
+    return _asyncTask != nullptr || _state == OTA_STATE_CHECKING ||
+           _state == OTA_STATE_DOWNLOADING;
+  }
+
+  /**
+   * @brief Get current client state
+   * @return OTAState value
+   */
+  OTAState getState() { return _state; }
+
+  /**
+   * @brief Get result code of the last finished update attempt
+   * @return 1 on success, 0 if no update, negative on error
+   */
+  int getLastResult() { return _lastResult; }
+
+  /**
+   * @brief Force check and update (clears cache first)
+   * @return 1 on success (will reboot), 0 if up to date, negative on error
+   */
+  int forceUpdate() {
+    log("Force update check...");
+    _updateInfo.available = false;
+    _manifestETag = "";
+    _manifestModified = "";
+    return checkUpdate();
+  }
+
+  /**
+   * @brief Download and install firmware from URL
+   * @param url Firmware binary URL
+   * @return 1 on success (will reboot), negative on error
+   */
+  int doUpdate(const String &url) {
+    if (isUpdating()) {
+      log("Update already in progress");
+      return OTA_ERR_BUSY;
+    }
+    resetMetrics();
+    if (!rollbackSafe()) {
+      return finish(OTA_ERR_UPDATE);
+    }
+    return finish(install(url, false));
+  }
+
+  /**
+   * @brief Overlap network reads and flash writes
+   *
+   * The calling task reads the download into a ring of slots (PSRAM when
+   * available) while a second task on the other core writes them to flash.
+   * @param enabled true to enable pipelined transfer
+   * @param slots Number of ring slots (default 4)
+   * @param slotSize Bytes per slot (default 4096)
+   */
+  void setPipelined(bool enabled, uint8_t slots = OTA_PIPE_SLOTS,
+                    size_t slotSize = OTA_PIPE_SLOT_SIZE) {
+    _pipelined = enabled;
+    _pipeSlots = slots;
+    _pipeSlotSize = slotSize;
+  }
+
+  /**
+   * @brief Cap the memory used to hold the parsed manifest
+   *
+   * Only the fields the client needs are kept; a manifest whose filtered
+   * content still does not fit fails the check instead of exhausting heap.
+   * @param bytes Maximum document size in bytes (default 8192)
+   */
+  void setManifestLimit(size_t bytes) {
+    _manifestMaxSize = bytes;
+    free(_manifestArena); // Reallocated at the new size by the next check
+    _manifestArena = nullptr;
+  }
+
+  /**
+   * @brief Parse manifests in one buffer kept for the client's lifetime
+   *
+   * The buffer (setManifestLimit() bytes) is allocated by the first check
+   * and reused, so later checks do not allocate for parsing. Costs that
+   * RAM permanently; off by default.
+   * @param enabled true to keep the buffer
+   */
+  void setManifestArena(bool enabled) {
+    _manifestArenaEnabled = enabled;
+    if (!enabled) {
+      free(_manifestArena);
+      _manifestArena = nullptr;
+    }
+  }
+
+  /**
+   * @brief Resume interrupted downloads with HTTP Range requests
+   *
+   * Progress is checkpointed to NVS every 64 KB. The next doUpdate() of the
+   * same URL continues from the last checkpoint if the server still serves
+   * the same file (checked with If-Range and Content-Range).
+   * @param enabled true to enable (default), false to always start over
+   */
+  void setResumable(bool enabled) { _resumable = enabled; }
+
+  /**
+   * @brief Prefer delta patches advertised by the manifest
+   *
+   * When an entry lists a patch for the running version under "patches",
+   * the patch is downloaded and applied against the running partition. If
+   * the patch fails for any reason (download, rebuild or verification),
+   * the full image is downloaded instead.
+   * @param enabled true to use patches (default), false for full images only
+   */
+  void setDeltaUpdates(bool enabled) { _deltaEnabled = enabled; }
+
+  /**
+   * @brief Ask the server for gzip-compressed firmware
+   *
+   * Sends "Accept-Encoding: gzip" with full downloads. Servers that
+   * compress on the fly answer chunked without a Content-Length, which
+   * cannot be resumed, so this is off by default. Pre-compressed files
+   * (Content-Encoding: gzip, "compression": "gzip" in the manifest or a
+   * .gz file) are inflated either way. Compressed downloads need about
+   * 43 KB of heap (PSRAM when available) for the inflate window.
+   * @param enabled true to request gzip, false to ask for raw (default)
+   */
+  void setCompression(bool enabled) { _acceptGzip = enabled; }
+
+  /**
+   * @brief Choose when the target partition is erased
+   * @param mode OTA_ERASE_LOOKAHEAD (default) erases a few sectors ahead of
+   * the write cursor in the background, OTA_ERASE_FULL erases the whole
+   * image range in the background as soon as the size is known,
+   * OTA_ERASE_LAZY erases inline before each sector write,
+   * OTA_ERASE_CHANGED reads each sector back first and leaves it alone if
+   * the slot already holds the same bytes (typically the previous release)
+   */
+  void setEraseMode(OTAEraseMode mode) { _eraseMode = mode; }
+
+  /**
+   * @brief Download and write images without installing them
+   *
+   * The image is streamed into the OTA slot and verified as usual, but the
+   * boot partition is not changed and the device does not reboot; update
+   * calls return OTA_UPDATE_OK. Meant for benchmarks and soak tests.
+   * @param enabled true to skip activation
+   */
+  void setDryRun(bool enabled) { _dryRun = enabled; }
+
+  /**
+   * @brief Abort downloads that receive nothing for a while
+   *
+   * An aborted download fails with OTA_ERR_STALLED and is retried (see
+   * setStallRetries()), resuming from its checkpoint when possible.
+   * @param ms Longest time without data (default OTA_STALL_TIMEOUT),
+   * 0 to wait forever
+   */
+  void setStallTimeout(uint32_t ms) { _stallTimeout = ms; }
+
+  /**
+   * @brief Abort downloads slower than a minimum rate
+   *
+   * The rate is averaged over each window, flash writes included.
+   * @param bytesPerSecond Lowest acceptable rate, 0 to disable (default)
+   * @param windowMs Averaging window (default OTA_THROUGHPUT_WINDOW)
+   */
+  void setMinThroughput(uint32_t bytesPerSecond,
+                        uint32_t windowMs = OTA_THROUGHPUT_WINDOW) {
+    _minThroughput = bytesPerSecond;
+    _throughputWindow = windowMs;
+  }
+
+  /**
+   * @brief Retries of a stalled download before the next mirror or failure
+   * @param retries Attempts after the first one (default OTA_STALL_RETRIES)
+   */
+  void setStallRetries(uint8_t retries) { _stallRetries = retries; }
+
+  /**
+   * @brief Download updates now, activate them later
+   *
+   * With OTA_STAGE_MANUAL a verified app image stays in the inactive slot
+   * and update calls return OTA_UPDATE_STAGED instead of rebooting; boot
+   * it with activateStaged() or setActivationWindow(). With
+   * OTA_STAGE_NEXT_BOOT the image is made bootable at once and runs after
+   * the next reboot, whatever causes it. Later checks do not download a
+   * staged version again; a newer release replaces it. Updates with data
+   * images (see Multi-Image Updates) are not staged.
+   * @param mode OTA_STAGE_OFF (default), OTA_STAGE_MANUAL or
+   * OTA_STAGE_NEXT_BOOT
+   */
+  void setStagedUpdates(OTAStageMode mode) { _stageMode = mode; }
+
+  /**
+   * @brief Activate a staged update from loop() within a daily window
+   *
+   * Uses local time (set TZ and start SNTP); nothing happens while the
+   * clock is not set. The window may wrap midnight, e.g. (23, 4).
+   * @param startHour First hour of the window, 0-23
+   * @param endHour Hour the window closes, 0-23 (exclusive)
+   */
+  void setActivationWindow(uint8_t startHour, uint8_t endHour) {
+    _windowStart = startHour % 24;
+    _windowEnd = endHour % 24;
+  }
+
+  /**
+   * @brief Stop activating staged updates on a schedule
+   */
+  void clearActivationWindow() { _windowStart = _windowEnd = -1; }
+
+  /**
+   * @brief Check whether a verified update waits in the inactive slot
+   * @return true until the staged image is running or replaced
    */
-  OTAClient(const char *jsonUrl, const char *version) {
-    _jsonUrl = jsonUrl;
-    _currentVersion = version;
-    // Note: EEPROM initialization moved to hasUpdate() to ensure Serial is
-    // ready
+  bool isStaged() {
+    loadState();
+    return !_saved.stagedPartition.isEmpty();
   }
 
   /**
-   * @brief Set progress callback
-   * @param callback Function(int percent, int bytesWritten, int totalBytes)
+   * @brief Get the version of the staged update
+   * @return Manifest version, empty if nothing is staged or it was
+   * installed with doUpdate()
    */
-  void onProgress(OTAProgressCallback callback) {
-    _progressCallback = callback;
+  String getStagedVersion() {
+    return isStaged() ? _saved.stagedVersion : String("");
   }
 
   /**
-   * @brief Check if update is available (does NOT download)
-   * @return true if update available, false otherwise
+   * @brief Boot the staged update now
+   *
+   * The bootloader checks the image again before switching to it.
+   * @return OTA_NO_UPDATE if nothing is staged, OTA_ERR_BUSY while an
+   * update runs, OTA_ERR_SET_BOOT if the image is no longer valid (does
+   * not return on success)
    */
-  bool hasUpdate() {
-    // Initialize EEPROM on first call (after Serial is ready)
-    if (!_eepromInitialized) {
-      initEEPROM();
+  int activateStaged() {
+    if (isUpdating()) {
+      return OTA_ERR_BUSY;
     }
-
-    log("Checking for updates...");
-
-    HTTPClient http;
-    int httpCode = followRedirects(http, _jsonUrl);
-
-    if (httpCode != 200) {
-      log("Server error: ", String(httpCode).c_str());
-      http.end();
-      return false;
+    if (!isStaged()) {
+      log("No staged update");
+      return OTA_NO_UPDATE;
     }
-
-    String payload = http.getString();
-    http.end();
-
-    JsonDocument doc;
-    if (deserializeJson(doc, payload)) {
-      log("Invalid JSON response");
-      return false;
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP,
+                                 ESP_PARTITION_SUBTYPE_ANY,
+                                 _saved.stagedPartition.c_str());
+    if (partition == nullptr ||
+        esp_ota_set_boot_partition(partition) != ESP_OK) {
+      log("Staged image is not bootable, discarding it");
+      _saved.stagedPartition = "";
+      _savedDirty = true;
+      commitState();
+      return OTA_ERR_SET_BOOT;
     }
+    recordStaged();
+    _saved.updates++;
+    _statsDirty = true;
+    queueReport(OTA_REPORT_UPDATE, OTA_UPDATE_OK,
+                _saved.stagedVersion.c_str());
+    _state = OTA_STATE_REBOOTING;
+    commitState(true);
 
-    JsonArray configs = doc["updater"].as<JsonArray>();
+    log("Activating staged update! Rebooting...");
+    delay(500);
+    ESP.restart();
+    return OTA_UPDATE_OK;
+  }
 
-    for (JsonObject config : configs) {
-      String version = config["version"] | "";
-      String url = config["url"] | "";
-      bool force = config["force"] | false;
-      String filename = extractFilename(url);
+  /**
+   * @brief Boost the device while an image downloads
+   *
+   * Raises the CPU frequency and turns WiFi power save off for each
+   * download, restoring the previous settings afterwards (also on
+   * failure). Meant for devices that normally run slow and sleepy.
+   * @param enabled true to apply the profile (default off)
+   * @param profile Settings to apply
+   */
+  void setTransferProfile(
+      bool enabled, const OTATransferProfile &profile = OTATransferProfile()) {
+    _profileEnabled = enabled;
+    _profile = profile;
+  }
 
-      // For force update, check if firmware filename is different from last
-      // installed
-      if (force) {
-        if (!filename.isEmpty() && filename == _lastInstalledFilename) {
-          log("Force update skipped - same firmware: ", filename.c_str());
-          continue;
-        }
-        log("Force update: ", version.c_str());
-        log("New firmware file: ", filename.c_str());
-        _updateInfo.available = true;
-        _updateInfo.force = true;
-        _updateInfo.version = version;
-        _updateInfo.url = url;
-        _updateInfo.filename = filename;
-        return true;
-      }
+  /**
+   * @brief Replace the network client used for all requests
+   *
+   * HTTPClient then talks through this client instead of the built-in
+   * WiFiClient/WiFiClientSecure (TLS options and pins do not apply). Any
+   * WiFiClient subclass works, e.g. one that replays recorded responses.
+   * @param client Client that outlives the OTAClient, nullptr for default
+   */
+  void setTransportClient(WiFiClient *client) {
+    _defaultTransport.setClient(client);
+  }
 
-      // Normal version comparison
-      if (version > _currentVersion) {
-        log("Update available: ", version.c_str());
-        _updateInfo.available = true;
-        _updateInfo.force = false;
-        _updateInfo.version = version;
-        _updateInfo.url = url;
-        _updateInfo.filename = filename;
-        return true;
-      }
-    }
+  /**
+   * @brief Replace the HTTP transport used for all requests
+   *
+   * Certificates, pins, setTransportClient() and the connection timings in
+   * OTAMetrics only apply to the built-in OTATransport. Push watching
+   * always uses the built-in sockets.
+   * @param transport OTAHttpTransport that outlives the OTAClient, nullptr
+   * for the built-in one
+   */
+  void setTransport(OTAHttpTransport *transport) {
+    _transport->close();
+    _transport = transport != nullptr ? transport : &_defaultTransport;
+  }
 
-    log("Already up to date");
-    _updateInfo.available = false;
-    _updateInfo.force = false;
-    return false;
+  /**
+   * @brief Replace the partition writer
+   * @param writer OTAImageWriter that outlives the OTAClient, or nullptr
+   * for the built-in OTAFlashWriter
+   * @param dataWriter Writer for the data images of a multi-image update,
+   * which run while the app image waits for activation in writer
+   */
+  void setFlashWriter(OTAImageWriter *writer,
+                      OTAImageWriter *dataWriter = nullptr) {
+    _flash = writer != nullptr ? writer : &_defaultFlash;
+    _dataFlash = dataWriter != nullptr ? dataWriter : &_defaultDataFlash;
   }
 
   /**
-   * @brief Perform update (call hasUpdate first or use directly)
-   * @return 1 on success (will reboot), 0 if no update, negative on error
+   * @brief Replace the store for manifest validators and checkpoints
+   * @param storage OTAStorage that outlives the OTAClient, or nullptr for
+   * NVS
    */
-  int update() {
-    if (_updateInfo.available && !_updateInfo.url.isEmpty()) {
-      log("Updating to: ", _updateInfo.version.c_str());
-      return doUpdate(_updateInfo.url);
-    }
+  void setStorage(OTAStorage *storage) {
+    _storage = storage != nullptr ? storage : &_defaultStorage;
+    _manifestCacheLoaded = false;
+  }
 
-    if (hasUpdate()) {
-      return doUpdate(_updateInfo.url);
-    }
+  /**
+   * @brief Close the kept-alive server connection
+   *
+   * The connection is closed automatically when an update attempt ends;
+   * call this if hasUpdate() found an update you do not install right away.
+   */
+  void disconnect() { _transport->close(); }
+
+  /**
+   * @brief Report update outcomes to the server
+   *
+   * Failed checks, install results (with download metrics), boot
+   * validation outcomes and rollbacks are queued in the persistent state
+   * (up to OTA_REPORT_QUEUE, oldest dropped) and uploaded as one JSON POST
+   * at the start of the next check, on the same connection as the manifest
+   * request when url is on the same server.
+   * @param url Endpoint receiving the POST, empty to stop reporting
+   */
+  void setReportUrl(const char *url) { _reportUrl = url; }
 
-    log("No update available");
-    return 0;
+  /**
+   * @brief Get the number of reports waiting for upload
+   */
+  uint8_t getPendingReports() {
+    loadState();
+    return _saved.reports.count;
   }
 
   /**
-   * @brief Get cached update info (call hasUpdate first)
-   * @return UpdateInfo struct with version and URL
+   * @brief Keep the server connection open between update checks
+   *
+   * A periodic hasUpdate() then reuses the open (already verified) TLS
+   * connection instead of doing a new handshake, for as long as the server
+   * keeps it alive. A connection the server has closed is detected and
+   * replaced transparently.
+   * @param enabled true to keep the connection after an up-to-date check
    */
-  UpdateInfo getUpdateInfo() { return _updateInfo; }
+  void setKeepAlive(bool enabled) { _keepAlive = enabled; }
 
   /**
-   * @brief Check for update and install if available
-   * @return 1 on success (will reboot), 0 if up to date, negative on error
+   * @brief Verify HTTPS servers against a CA certificate
+   * @param pem Root CA in PEM format; the string must outlive the client
    */
-  int checkUpdate() {
-    if (hasUpdate()) {
-      return doUpdate(_updateInfo.url);
-    }
-    return 0;
+  void setCACert(const char *pem) { _defaultTransport.setCACert(pem); }
+
+  /**
+   * @brief Verify HTTPS servers against a certificate bundle
+   * @param bundle x509 crt bundle (as generated by ESP-IDF's gen_crt_bundle
+   * or the Arduino core); must outlive the client
+   */
+  void setCACertBundle(const uint8_t *bundle) {
+    _defaultTransport.setCACertBundle(bundle);
   }
 
   /**
-   * @brief Force check and update (clears cache first)
-   * @return 1 on success (will reboot), 0 if up to date, negative on error
+   * @brief Pin the public key of the update server
+   *
+   * The key of the server (leaf) certificate must match one of the pins.
+   * Add a second pin for the next key before rotating certificates. Pins
+   * can be combined with a CA certificate or used on their own.
+   * @param sha256Hex SHA-256 of the DER SubjectPublicKeyInfo, 64 hex digits
+   * (':' separators allowed)
+   * @return false if the pin is malformed or OTA_TLS_MAX_PINS are set
    */
-  int forceUpdate() {
-    log("Force update check...");
-    _updateInfo.available = false;
-    return checkUpdate();
+  bool addPublicKeyPin(const char *sha256Hex) {
+    return _defaultTransport.addPin(sha256Hex);
   }
 
   /**
-   * @brief Download and install firmware from URL
-   * @param url Firmware binary URL
-   * @return 1 on success (will reboot), negative on error
+   * @brief Remove all public key pins
    */
-  int doUpdate(const String &url) {
-    log("Downloading firmware...");
+  void clearPublicKeyPins() { _defaultTransport.clearPins(); }
 
-    HTTPClient http;
-    int httpCode = followRedirects(http, url);
+  /**
+   * @brief Require firmware images to be signed
+   *
+   * The manifest "signature" is checked against the SHA-256 of the
+   * downloaded image before it is made bootable; unsigned or mismatching
+   * images are rejected with OTA_ERR_VERIFY.
+   * @param publicKeyPem RSA or ECDSA public key in PEM format; must outlive
+   * the client, nullptr to stop requiring signatures
+   */
+  void setSigningKey(const char *publicKeyPem) { _signingKey = publicKeyPem; }
 
-    if (httpCode != 200) {
-      log("Download failed: ", String(httpCode).c_str());
-      http.end();
-      return -3;
-    }
+  /**
+   * @brief Set periodic check interval
+   *
+   * A "pollInterval" (seconds) in the manifest takes precedence once seen.
+   * The next check time is kept in NVS, so a reboot does not restart the
+   * interval (nor make a whole fleet check at once after a power cut).
+   * @param interval Interval in milliseconds (0 to disable)
+   */
+  void setCheckInterval(unsigned long interval) { _checkInterval = interval; }
 
-    int contentLength = http.getSize();
-    if (contentLength <= 0) {
-      log("Invalid content length");
-      http.end();
-      return -3;
-    }
+  /**
+   * @brief Randomize periodic checks
+   * @param maxJitter Up to this many ms are added to every delay (default
+   * 10% of the interval)
+   */
+  void setCheckJitter(unsigned long maxJitter) { _checkJitter = maxJitter; }
 
-    WiFiClient *stream = http.getStreamPtr();
+  /**
+   * @brief Limit the retry delay after failed checks
+   *
+   * After a network or server error the delay doubles with each
+   * consecutive failure, up to this limit. A Retry-After header from the
+   * server is honoured if it asks for longer.
+   * @param maxDelay Longest delay in milliseconds (default 6 hours)
+   */
+  void setRetryBackoff(unsigned long maxDelay) { _maxBackoff = maxDelay; }
 
-    if (!Update.begin(contentLength)) {
-      log("Not enough space for update");
-      http.end();
-      return -4;
+  /**
+   * @brief Time until the next periodic check
+   * @return Milliseconds, 0 if due or periodic checks are disabled
+   */
+  unsigned long getNextCheckIn() {
+    if (_checkInterval == 0 || !_scheduleLoaded) {
+      return 0;
     }
+    long left = (long)(_nextCheck - millis());
+    return left > 0 ? left : 0;
+  }
 
-    log("Installing...");
-
-    int written = 0;
-    int lastPercent = -1;
-    uint8_t buff[512];
-
-    while (http.connected() && written < contentLength) {
-      int available = stream->available();
-      if (available > 0) {
-        int len = stream->readBytes(buff, min(available, (int)sizeof(buff)));
-        Update.write(buff, len);
-        written += len;
-
-        int percent = (written * 100) / contentLength;
-        if (percent != lastPercent) {
-          lastPercent = percent;
+  /**
+   * @brief Call in loop() for periodic auto-check
+   *
+   * With setAsyncMode(true) the check and download run on the background
+   * task and this returns immediately. Queued progress events (see
+   * setProgressQueue()) are delivered from here.
+   */
+  void loop() {
+    if (_progressQueued) {
+      dispatchProgress();
+    }
 
-          if (_progressCallback) {
-            _progressCallback(percent, written, contentLength);
-          } else if (percent % 10 == 0) {
-            Serial.printf("[OTA] Progress: %d%%\n", percent);
-          }
-        }
+    // A push notification: check soon, spread out across the fleet
+    if (_checkRequested.exchange(false) || _push.take()) {
+      if (!_requestPending) {
+        _requestPending = true;
+        _requestAt = millis() + (_pushSpread ? esp_random() % _pushSpread : 0);
       }
-      delay(1);
+    }
+    if (_requestPending && (long)(millis() - _requestAt) >= 0) {
+      _requestPending = false;
+      runCheck();
+      return;
     }
 
-    http.end();
-
-    if (Update.end(true)) {
-      // Save firmware filename to EEPROM before reboot
-      if (!_updateInfo.filename.isEmpty()) {
-        saveFilenameToEEPROM(_updateInfo.filename);
-      } else {
-        // Extract filename from URL if not already set
-        String filename = extractFilename(url);
-        if (!filename.isEmpty()) {
-          saveFilenameToEEPROM(filename);
-        }
-      }
+    if (_stageMode == OTA_STAGE_MANUAL && inActivationWindow() &&
+        !isUpdating() && isStaged()) {
+      activateStaged();
+    }
 
-      log("Update complete! Rebooting...");
-      delay(500);
-      ESP.restart();
-      return 1;
+    if (_checkInterval == 0) {
+      return;
+    }
+    if (!_scheduleLoaded) {
+      loadSchedule();
     }
 
-    log("Update failed");
-    return -5;
+    if ((long)(millis() - _nextCheck) >= 0) {
+      // Placeholder until the attempt finishes and reschedules
+      _nextCheck = millis() + checkDelay(false);
+      runCheck();
+    }
   }
 
   /**
-   * @brief Set periodic check interval
-   * @param interval Interval in milliseconds (0 to disable)
+   * @brief Check now, out of schedule
+   *
+   * Safe to call from any task, e.g. from an MQTT message callback when a
+   * release is published. The check runs from loop() after a random delay
+   * of up to setPushSpread() ms, so a fleet notified at the same moment
+   * does not hit the server at once. The periodic schedule restarts from
+   * that check.
    */
-  void setCheckInterval(unsigned long interval) { _checkInterval = interval; }
+  void requestCheck() { _checkRequested = true; }
 
   /**
-   * @brief Call in loop() for periodic auto-check
+   * @brief Listen on an HTTP push channel for new releases
+   *
+   * Keeps a request to url open on a background task (Server-Sent Events
+   * or long-poll, see OTAPushWatcher) and calls requestCheck() whenever
+   * the server signals a change. HTTPS is verified like the update server:
+   * the CA from setCACert() or setCACertBundle() and the public key pins
+   * set before this call. Keep setCheckInterval() as a slow fallback.
+   * @param url Event stream or long-poll URL
+   * @return false if the watcher task could not be started
    */
-  void loop() {
-    if (_checkInterval > 0 && millis() - _lastCheck > _checkInterval) {
-      _lastCheck = millis();
-      checkUpdate();
-    }
+  bool beginPushWatch(const char *url) {
+    return _push.begin(url, _defaultTransport);
   }
 
+  /**
+   * @brief Close the push channel
+   */
+  void endPushWatch() { _push.end(); }
+
+  /**
+   * @brief Upper bound of the random delay before a push-triggered check
+   * @param ms Maximum delay in ms (0 = check immediately; default 5000)
+   */
+  void setPushSpread(uint32_t ms) { _pushSpread = ms; }
+
   /**
    * @brief Check if rollback is possible
+   *
+   * A staged update has replaced the previous firmware in the other slot,
+   * so rollback is refused until it is activated or replaced.
    * @return true if can rollback to previous partition, false otherwise
    */
   bool canRollback() {
+    if (isStaged()) {
+      return false;
+    }
     const esp_partition_t *running = esp_ota_get_running_partition();
     const esp_partition_t *last_invalid = esp_ota_get_last_invalid_partition();
 
@@ -523,15 +5090,18 @@ public:
 
     if (next_partition == NULL) {
       log("Failed to find rollback partition");
-      return -1;
+      return OTA_ERR_NO_PARTITION;
     }
 
     esp_err_t err = esp_ota_set_boot_partition(next_partition);
     if (err != ESP_OK) {
       log("Failed to set boot partition");
-      return -2;
+      return OTA_ERR_SET_BOOT;
     }
 
+    queueReport(OTA_REPORT_ROLLBACK, OTA_UPDATE_OK, _currentVersion.c_str());
+    commitState(true);
+
     log("Rollback successful! Rebooting...");
     delay(500);
     ESP.restart();
@@ -543,21 +5113,155 @@ public:
    * @return true on success, false on error
    */
   bool markAsValid() {
-    const esp_partition_t *running = esp_ota_get_running_partition();
-    esp_ota_img_states_t ota_state;
-
-    if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
-      if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
-        esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
-        if (err == ESP_OK) {
-          log("Firmware marked as valid");
-          return true;
-        }
+    if (OTAFlashWriter::pendingVerify()) {
+      esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
+      if (err == ESP_OK) {
+        log("Firmware marked as valid");
+        return true;
       }
     }
     return false;
   }
 
+  /**
+   * @brief Register a health check for validateBoot()
+   *
+   * The check is called repeatedly until it returns true or the time
+   * budget runs out, so it may test something that takes a while to come
+   * up. Checks run in the order they were added.
+   * @param name Name reported when the check fails (kept, not copied)
+   * @param check Returns true once healthy
+   * @return false if OTA_MAX_HEALTH_CHECKS are already registered
+   */
+  bool addHealthCheck(const char *name, OTAHealthCheck check) {
+    if (_healthCheckCount >= OTA_MAX_HEALTH_CHECKS) {
+      return false;
+    }
+    _healthChecks[_healthCheckCount++] = {name, check};
+    return true;
+  }
+
+  /**
+   * @brief Health check: WiFi is associated and has an address
+   */
+  bool addWiFiCheck() {
+    return addHealthCheck("wifi", []() { return WiFi.isConnected(); });
+  }
+
+  /**
+   * @brief Health check: the update server answers
+   *
+   * Any HTTP response counts, the manifest itself is not evaluated.
+   * @param url URL to request, the manifest URL if empty
+   */
+  bool addServerCheck(const char *url = "") {
+    return addHealthCheck("server", [this, url]() {
+      if (!WiFi.isConnected()) {
+        return false;
+      }
+      OTAHttpTransport &http = *_transport;
+      int httpCode = followRedirects(http, *url ? String(url) : _jsonUrl, 5,
+                                     [](OTAHttpTransport &h) {});
+      _transport->close();
+      return httpCode > 0;
+    });
+  }
+
+  /**
+   * @brief Set callback for the outcome of validateBoot()
+   * @param callback Function(OTABootResult result, const char *failedCheck)
+   */
+  void onBootValidated(OTABootCallback callback) {
+    _bootCallback = callback;
+  }
+
+  /**
+   * @brief Keep or roll back a freshly installed update
+   *
+   * Call early in setup(), after adding health checks. On the first boot
+   * of an update (ESP_OTA_IMG_PENDING_VERIFY) the checks run; if they all
+   * pass within the budget the app is marked valid, otherwise the device
+   * rolls back and reboots. A crash or reset during the checks rolls back
+   * as well (bootloader rollback must be enabled). Other boots are
+   * recognised from RTC memory and return within microseconds.
+   * @param budgetMs Time for all checks together (default
+   * OTA_VALIDATE_BUDGET)
+   * @return OTA_BOOT_VALIDATED, OTA_BOOT_NORMAL, OTA_BOOT_ROLLED_BACK on
+   * the first boot after a rollback, or OTA_BOOT_FAILED if rolling back
+   * was impossible (does not return when it rolls back)
+   */
+  OTABootResult validateBoot(uint32_t budgetMs = OTA_VALIDATE_BUDGET) {
+    OTABootRecord &record = bootRecord();
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (running == nullptr) {
+      return reportBoot(OTA_BOOT_NORMAL, "");
+    }
+    uint32_t version = hashBytes(2166136261u, _currentVersion.c_str(),
+                                 _currentVersion.length());
+
+    bool known = record.valid();
+    if (known && record.partition == running->address &&
+        record.version == version && record.result != OTA_BOOT_FAILED) {
+      return reportBoot(OTA_BOOT_NORMAL, ""); // Validated before
+    }
+
+    OTABootResult previous =
+        known ? (OTABootResult)record.result : OTA_BOOT_NORMAL;
+    String failed = known ? record.failed : "";
+    String failedVersion = known ? record.versionName : "";
+    const char *name = _currentVersion.c_str();
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK ||
+        state != ESP_OTA_IMG_PENDING_VERIFY) {
+      record.set(running->address, version, name, OTA_BOOT_NORMAL, "");
+      if (previous == OTA_BOOT_ROLLED_BACK) {
+        // The report is about the update that failed, not this firmware
+        log("Update rolled back, failed check: ", failed.c_str());
+        queueReport(OTA_REPORT_BOOT, OTA_BOOT_ROLLED_BACK,
+                    failedVersion.c_str(), failed.c_str());
+        commitState();
+        return reportBoot(OTA_BOOT_ROLLED_BACK, failed.c_str());
+      }
+      return reportBoot(OTA_BOOT_NORMAL, "");
+    }
+
+    log("Validating new firmware...");
+    int check = runHealthChecks(budgetMs);
+    if (check < 0) {
+      markAsValid();
+      record.set(running->address, version, name, OTA_BOOT_VALIDATED, "");
+      queueReport(OTA_REPORT_BOOT, OTA_BOOT_VALIDATED,
+                  _currentVersion.c_str());
+      commitState();
+      return reportBoot(OTA_BOOT_VALIDATED, "");
+    }
+
+    const char *checkName = _healthChecks[check].name;
+    log("Health check failed: ", checkName);
+    record.set(running->address, version, name, OTA_BOOT_ROLLED_BACK,
+               checkName);
+    reportBoot(OTA_BOOT_ROLLED_BACK, checkName);
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+
+    log("No app to roll back to");
+    record.set(running->address, version, name, OTA_BOOT_FAILED, checkName);
+    queueReport(OTA_REPORT_BOOT, OTA_BOOT_FAILED, name, checkName);
+    commitState();
+    return reportBoot(OTA_BOOT_FAILED, checkName);
+  }
+
+  /**
+   * @brief Get the outcome of the last validateBoot()
+   * @return OTABootResult value
+   */
+  OTABootResult getBootResult() { return _bootResult; }
+
+  /**
+   * @brief Get the health check that failed the last validation
+   * @return Check name, empty if none failed
+   */
+  String getFailedCheck() { return _failedCheck; }
+
   /**
    * @brief Get current boot partition name
    * @return Partition name (e.g., "ota_0", "ota_1")
@@ -588,6 +5292,12 @@ public:
    */
   String getVersion() { return _currentVersion; }
 
+  /**
+   * @brief Get current firmware version as a comparable value
+   * @return OTAVersion parsed from the constructor's version string
+   */
+  OTAVersion getParsedVersion() { return _parsedVersion; }
+
   /**
    * @brief Get API URL
    * @return URL string
@@ -595,28 +5305,201 @@ public:
   String getUrl() { return _jsonUrl; }
 
   /**
-   * @brief Get last installed firmware filename from EEPROM
+   * @brief Add a fallback manifest endpoint
+   *
+   * Every endpoint must serve the same manifest. Each check asks the one
+   * with the lowest measured latency first and moves on when a request
+   * fails (see getMirrorScore()).
+   * @param url Manifest URL
+   * @return false if OTA_MAX_SOURCES endpoints are already registered
+   */
+  bool addManifestUrl(const char *url) {
+    if (_manifestUrlCount == OTA_MAX_SOURCES - 1) {
+      return false;
+    }
+    _manifestUrls[_manifestUrlCount++] = url;
+    return true;
+  }
+
+  /**
+   * @brief Tag this device with a cohort
+   *
+   * A manifest entry listing "cohorts" only applies to devices tagged
+   * with at least one of them. Manifest validators are tied to the
+   * cohorts, so the next check fetches the full manifest.
+   * @param tag Cohort name, e.g. "beta"
+   * @return false if OTA_MAX_COHORTS cohorts are already set
+   */
+  bool addCohort(const char *tag) {
+    if (_cohortCount == OTA_MAX_COHORTS) {
+      return false;
+    }
+    _cohorts[_cohortCount++] = tag;
+    _manifestETag = "";
+    _manifestModified = "";
+    return true;
+  }
+
+  /**
+   * @brief Remove all cohort tags
+   */
+  void clearCohorts() {
+    _cohortCount = 0;
+    _manifestETag = "";
+    _manifestModified = "";
+  }
+
+  /**
+   * @brief This device's rollout bucket for a release
+   *
+   * FNV-1a over the six eFuse MAC bytes (in WiFi.macAddress() order)
+   * followed by the version string, modulo OTA_ROLLOUT_BUCKETS. An entry
+   * with "rollout": p reaches devices whose bucket is below p * 100, so
+   * raising p only adds devices, and each release samples a different
+   * subset of the fleet.
+   * @param version Release version as listed in the manifest
+   * @return Bucket, 0 to OTA_ROLLOUT_BUCKETS - 1
+   */
+  uint16_t getRolloutBucket(const char *version) {
+    uint64_t mac = ESP.getEfuseMac();
+    uint8_t bytes[6];
+    for (uint8_t i = 0; i < 6; i++) {
+      bytes[i] = mac >> (8 * i);
+    }
+    uint32_t hash = hashBytes(2166136261u, bytes, sizeof(bytes));
+    hash = hashBytes(hash, version, strlen(version));
+    return hash % OTA_ROLLOUT_BUCKETS;
+  }
+
+  /**
+   * @brief Measurements remembered for a server
+   * @param url Any URL on that server (scheme, host and port count)
+   * @return Score, nullptr if the server was never contacted
+   */
+  const OTAMirrorScore *getMirrorScore(const char *url) {
+    loadState();
+    return _saved.mirrors.find(url);
+  }
+
+  /**
+   * @brief Serve the running image to other devices on the LAN
+   *
+   * Only works when the running image is the last one this client
+   * installed and it was hashed (the manifest listed its sha256). The
+   * image is announced over mDNS as _esp-ota._tcp with TXT records
+   * "sha256" and "size"; call MDNS.begin() first.
+   * @param port TCP port for the image server
+   * @return false if there is no verified image to share or the server
+   * could not start
+   */
+  bool beginPeerServer(uint16_t port = OTA_PEER_PORT) {
+    loadState();
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    String hash = getLastInstalledHash();
+    if (running == nullptr || hash.isEmpty() ||
+        _saved.imagePartition != running->label) {
+      log("No verified image to share");
+      return false;
+    }
+    if (!_peerServer.begin(running, _saved.imageSize, hash.c_str(), port)) {
+      log("Peer server failed to start");
+      return false;
+    }
+    if (!MDNS.addService(OTA_PEER_SERVICE, "tcp", port) ||
+        !MDNS.addServiceTxt(OTA_PEER_SERVICE, "tcp", "sha256",
+                            hash.c_str()) ||
+        !MDNS.addServiceTxt(OTA_PEER_SERVICE, "tcp", "size",
+                            String(_saved.imageSize).c_str())) {
+      log("mDNS announcement failed (MDNS.begin() not called?)");
+    }
+    log("Sharing firmware with peers on port ", port);
+    return true;
+  }
+
+  /**
+   * @brief Stop serving the image and withdraw the announcement
+   */
+  void endPeerServer() {
+    if (_peerServer.running()) {
+      mdns_service_remove("_" OTA_PEER_SERVICE, "_tcp");
+      _peerServer.end();
+    }
+  }
+
+  /**
+   * @brief Prefer LAN peers over the server for firmware downloads
+   *
+   * Peers found over mDNS that announce the manifest's sha256 are tried
+   * first; the server and its mirrors are used when none answers. Images
+   * without a sha256 in the manifest are always fetched from the server.
+   * @param enabled true to look for peers (default off)
+   */
+  void setPeerDownloads(bool enabled) { _peerDownloads = enabled; }
+
+  /**
+   * @brief Get last installed firmware filename
    * @return Firmware filename string, empty if not set
    */
-  String getLastInstalledFilename() { return _lastInstalledFilename; }
+  String getLastInstalledFilename() {
+    loadState();
+    return _lastInstalledFilename;
+  }
+
+  /**
+   * @brief SHA-256 of the last installed image, if it was hashed
+   * @return 64 hex digits, empty if unknown
+   */
+  String getLastInstalledHash() {
+    loadState();
+    if (!_saved.hasImageHash) {
+      return "";
+    }
+    char hex[65];
+    for (int i = 0; i < 32; i++) {
+      sprintf(hex + i * 2, "%02x", _saved.imageHash[i]);
+    }
+    return hex;
+  }
+
+  /**
+   * @brief Lifetime check/update counters kept in the state record
+   *
+   * They are saved with the statistics record, every
+   * OTA_STATS_FLUSH_CHECKS checks and when the device reboots into an
+   * update, so a power cut may lose the last few checks.
+   * @param checks Update attempts (including "no update")
+   * @param updates Successful installs
+   * @param errors Failed attempts
+   */
+  void getCounters(uint32_t &checks, uint32_t &updates, uint32_t &errors) {
+    loadState();
+    checks = _saved.checks;
+    updates = _saved.updates;
+    errors = _saved.errors;
+  }
 
   /**
-   * @brief Clear the last installed firmware record from EEPROM
+   * @brief Clear the last installed firmware record
    * This allows force update to run again even with the same firmware filename
+   *
+   * The manifest validators are dropped too, so the next check fetches the
+   * full manifest instead of a 304 that would skip the force entry.
    * @return true on success, false on error
    */
   bool clearFirmwareRecord() {
-    if (!_eepromInitialized) {
-      initEEPROM();
-    }
-
-    // Clear magic number to invalidate the record
-    EEPROM.write(OTA_EEPROM_START_ADDR, 0);
-    EEPROM.write(OTA_EEPROM_START_ADDR + 1, 0);
+    loadState();
+    _saved.filename = "";
+    _saved.hasImageHash = false;
+    _saved.manifestETag = "";
+    _saved.manifestModified = "";
+    _manifestETag = "";
+    _manifestModified = "";
+    _savedDirty = true;
+    commitState();
 
-    if (EEPROM.commit()) {
+    if (!_savedDirty) {
       _lastInstalledFilename = "";
-      log("Firmware record cleared from EEPROM");
+      log("Firmware record cleared");
       return true;
     }
 
@@ -0,0 +1,1215 @@
+/*
+ * OTACore.h - platform-independent part of ESP32-OTA-Client
+ *
+ * Types that need nothing from ESP-IDF or FreeRTOS: version parsing, the
+ * persistent state record, mirror scores, the report queue, HTTP body
+ * de-chunking, and the interfaces the client reaches storage, flash and
+ * the network through (OTAStorage, OTAImageWriter, OTAHttpTransport).
+ * Only Arduino's String, Stream and millis() are used, so this header
+ * also builds on the host; see test/ and the "native" PlatformIO env.
+ *
+ * License: MIT
+ */
+
+#ifndef OTA_CORE_H
+#define OTA_CORE_H
+
+#include <Arduino.h>
+#include <functional>
+#include <stdint.h>
+#include <string.h>
+
+// Persistent state (one blob per OTAStateRecord)
+#define OTA_STATE_KEY "state"
+#define OTA_RESUME_KEY "resume"
+#define OTA_STATS_KEY "stats"
+#define OTA_SCHEDULE_KEY "schedule"
+#define OTA_STATE_VERSION 2
+#define OTA_STATE_MAX_SIZE 2048 // Per record
+#define OTA_HASH_STATE_MAX 256  // Hash context saved with a checkpoint
+
+// Result reports
+#define OTA_CHECK_NAME_MAX 16
+#define OTA_REPORT_QUEUE 8 // Reports kept until uploaded, oldest dropped
+
+// Mirrors
+#define OTA_MIRROR_SCORES 8 // Hosts whose measurements are remembered
+
+// Version string capacity (including the terminator); override with -D
+#ifndef OTA_VERSION_MAX
+#define OTA_VERSION_MAX 32
+#endif
+
+/**
+ * @brief Semantic version packed into a single 64-bit integer
+ *
+ * Parsed once, compared with one integer compare. Layout (MSB first):
+ * major:16 | minor:16 | patch:16 | pre-release:16. A release ranks above
+ * any of its pre-releases ("1.0.0-rc.1" < "1.0.0"). Pre-release tags are
+ * ordered by their first two letters and first number ("alpha" < "beta" <
+ * "rc", "rc.2" < "rc.10"), which covers the usual tagging schemes.
+ * A leading "v" and "+build" metadata are ignored; fields above 65535 are
+ * clamped. Strings that do not start with a digit are invalid and compare
+ * below every valid version.
+ *
+ * Parsing is constexpr, so literals can be checked at compile time:
+ * @code
+ * static_assert(OTAVersion("1.10.0") > OTAVersion("1.9.0"), "semver");
+ * @endcode
+ */
+class OTAVersion {
+public:
+  constexpr OTAVersion() : _packed(0) {}
+  constexpr OTAVersion(const char *version) : _packed(parse(version)) {}
+  OTAVersion(const String &version) : _packed(parse(version.c_str())) {}
+
+  constexpr bool isValid() const { return _packed != 0; }
+  constexpr uint16_t major() const { return (uint16_t)(_packed >> 48); }
+  constexpr uint16_t minor() const { return (uint16_t)(_packed >> 32); }
+  constexpr uint16_t patch() const { return (uint16_t)(_packed >> 16); }
+  constexpr bool isPrerelease() const {
+    return isValid() && (uint16_t)_packed != kRelease;
+  }
+  constexpr uint64_t packed() const { return _packed; }
+
+  constexpr bool operator==(const OTAVersion &o) const {
+    return _packed == o._packed;
+  }
+  constexpr bool operator!=(const OTAVersion &o) const {
+    return _packed != o._packed;
+  }
+  constexpr bool operator<(const OTAVersion &o) const {
+    return _packed < o._packed;
+  }
+  constexpr bool operator>(const OTAVersion &o) const {
+    return _packed > o._packed;
+  }
+  constexpr bool operator<=(const OTAVersion &o) const {
+    return _packed <= o._packed;
+  }
+  constexpr bool operator>=(const OTAVersion &o) const {
+    return _packed >= o._packed;
+  }
+
+  /**
+   * @brief Format as "major.minor.patch", with "-pre" for pre-releases
+   * @return Version string, "invalid" if parsing failed
+   */
+  String toString() const {
+    if (!isValid()) {
+      return "invalid";
+    }
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%u.%u.%u%s", major(), minor(), patch(),
+             isPrerelease() ? "-pre" : "");
+    return String(buffer);
+  }
+
+private:
+  static constexpr uint16_t kRelease = 0xFFFF;
+  uint64_t _packed;
+
+  // Single-expression helpers so parsing stays constexpr under C++11
+  static constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+  static constexpr bool isAlpha(char c) {
+    return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+  }
+  static constexpr uint64_t letter(char c) {
+    return isAlpha(c) ? (uint64_t)((c | 0x20) - 'a' + 1) : 0;
+  }
+  static constexpr uint64_t clamp(uint64_t v, uint64_t max) {
+    return v > max ? max : v;
+  }
+  static constexpr const char *skipDigits(const char *s) {
+    return isDigit(*s) ? skipDigits(s + 1) : s;
+  }
+  static constexpr const char *skipAlpha(const char *s) {
+    return isAlpha(*s) ? skipAlpha(s + 1) : s;
+  }
+  static constexpr const char *skipDot(const char *s) {
+    return *s == '.' ? s + 1 : s;
+  }
+  static constexpr uint64_t readNum(const char *s, uint64_t acc = 0) {
+    return isDigit(*s) ? readNum(s + 1, clamp(acc * 10 + (*s - '0'), 0xFFFFF))
+                       : acc;
+  }
+  // Start of the next numeric field
+  static constexpr const char *field(const char *s) {
+    return skipDot(skipDigits(s));
+  }
+  // Pre-release rank: letter1:5 | letter2:5 | number:6, release = 0xFFFF
+  static constexpr uint64_t preRelease(const char *s) {
+    return *s != '-' ? kRelease
+                     : (letter(s[1]) << 11) |
+                           ((isAlpha(s[1]) ? letter(s[2]) : 0) << 6) |
+                           clamp(readNum(skipDot(skipAlpha(s + 1))), 62);
+  }
+  static constexpr uint64_t parseFields(const char *s) {
+    return !isDigit(*s) ? 0
+                        : clamp(readNum(s), 0xFFFF) << 48 |
+                              clamp(readNum(field(s)), 0xFFFF) << 32 |
+                              clamp(readNum(field(field(s))), 0xFFFF) << 16 |
+                              preRelease(skipDigits(field(field(s))));
+  }
+  static constexpr uint64_t parse(const char *s) {
+    return s == nullptr ? 0
+                        : parseFields((*s == 'v' || *s == 'V') ? s + 1 : s);
+  }
+};
+
+/**
+ * @brief Fixed-capacity string stored inline
+ *
+ * Holds up to N - 1 characters without touching the heap. Reads like a
+ * String for the usual calls (c_str(), length(), isEmpty(), ==) and
+ * converts to const char *, so it can be printed or compared directly.
+ * @tparam N Capacity in bytes, including the terminator
+ */
+template <size_t N> class OTAFixedString {
+public:
+  OTAFixedString() { _buffer[0] = '\0'; }
+  OTAFixedString(const char *s) { assign(s); }
+
+  /**
+   * @brief Copy a string
+   * @param s Characters to copy (nullptr clears)
+   * @param length Number of characters, or strlen(s) when omitted
+   * @return false if it did not fit; the content is then cleared
+   */
+  bool assign(const char *s, size_t length) {
+    if (s == nullptr || length >= N) {
+      _buffer[0] = '\0';
+      _length = 0;
+      return s == nullptr;
+    }
+    memcpy(_buffer, s, length);
+    _buffer[length] = '\0';
+    _length = length;
+    return true;
+  }
+  bool assign(const char *s) { return assign(s, s ? strlen(s) : 0); }
+
+  OTAFixedString &operator=(const char *s) {
+    assign(s);
+    return *this;
+  }
+  OTAFixedString &operator=(const String &s) {
+    assign(s.c_str(), s.length());
+    return *this;
+  }
+
+  const char *c_str() const { return _buffer; }
+  operator const char *() const { return _buffer; }
+  size_t length() const { return _length; }
+  bool isEmpty() const { return _length == 0; }
+  static constexpr size_t capacity() { return N - 1; }
+  String toString() const { return String(_buffer); }
+
+  bool equals(const char *s, size_t length) const {
+    return length == _length && memcmp(_buffer, s, length) == 0;
+  }
+  bool operator==(const char *s) const {
+    return s != nullptr && strcmp(_buffer, s) == 0;
+  }
+  bool operator==(const String &s) const {
+    return equals(s.c_str(), s.length());
+  }
+  bool operator!=(const char *s) const { return !(*this == s); }
+  bool operator!=(const String &s) const { return !(*this == s); }
+  friend bool operator==(const char *a, const OTAFixedString &b) {
+    return b == a;
+  }
+  friend bool operator==(const String &a, const OTAFixedString &b) {
+    return b == a;
+  }
+  friend bool operator!=(const char *a, const OTAFixedString &b) {
+    return b != a;
+  }
+  friend bool operator!=(const String &a, const OTAFixedString &b) {
+    return b != a;
+  }
+
+private:
+  char _buffer[N];
+  size_t _length = 0;
+};
+/**
+ * @brief When the flash writer erases the target partition
+ */
+enum OTAEraseMode {
+  OTA_ERASE_LAZY = 0,  // Erase each sector right before writing it
+  OTA_ERASE_LOOKAHEAD, // Background task erases a few sectors ahead
+  OTA_ERASE_FULL,      // Background task erases the whole image range
+  OTA_ERASE_CHANGED    // Erase and write only sectors that differ from the
+                       // slot's current content
+};
+/**
+ * @brief Key-value store for state that must survive a reboot
+ *
+ * Holds the manifest validators and download checkpoints. The default
+ * implementation is OTAPreferencesStorage (NVS); install another one with
+ * OTAClient::setStorage(), e.g. an in-memory map for host tests.
+ */
+class OTAStorage {
+public:
+  virtual ~OTAStorage() {}
+
+  /**
+   * @brief Open the store; every begin() is paired with end()
+   * @param readOnly true if no keys will be written
+   * @return false if the store is unavailable
+   */
+  virtual bool begin(bool readOnly) = 0;
+  virtual void end() = 0;
+
+  virtual String getString(const char *key) = 0;
+  virtual void putString(const char *key, const String &value) = 0;
+  virtual uint32_t getUInt(const char *key, uint32_t defaultValue) = 0;
+  virtual void putUInt(const char *key, uint32_t value) = 0;
+  /**
+   * @return Number of bytes copied, 0 if missing or larger than len
+   */
+  virtual size_t getBytes(const char *key, void *buf, size_t len) = 0;
+  virtual void putBytes(const char *key, const void *buf, size_t len) = 0;
+  virtual void remove(const char *key) = 0;
+};
+/**
+ * @brief Detects downloads that stopped or slowed to a crawl
+ *
+ * Fed with every chunk once it is in flash, so time spent writing never
+ * counts as a stall. A half-open connection keeps HTTPClient::connected()
+ * true forever; this is what ends such a transfer.
+ */
+class OTAStallMonitor {
+public:
+  /**
+   * @brief Start watching a transfer
+   * @param timeoutMs Longest time without data, 0 for no limit
+   * @param minRate Lowest acceptable bytes/s, 0 for no minimum
+   * @param windowMs Period minRate is averaged over
+   */
+  void begin(uint32_t timeoutMs, uint32_t minRate, uint32_t windowMs) {
+    _timeoutMs = timeoutMs;
+    _minRate = windowMs > 0 ? minRate : 0;
+    _windowMs = windowMs;
+    _lastData = _windowStart = millis();
+    _windowBytes = 0;
+  }
+
+  void received(size_t len) {
+    _lastData = millis();
+    _windowBytes += len;
+  }
+
+  // Waiting for the flash writer, not for the network
+  void touch() { _lastData = millis(); }
+
+  /**
+   * @brief Check the transfer
+   * @return nullptr while it is healthy, else why it should be aborted
+   */
+  const char *check() {
+    uint32_t now = millis();
+    if (_timeoutMs > 0 && now - _lastData >= _timeoutMs) {
+      return "no data received";
+    }
+    if (_minRate > 0 && now - _windowStart >= _windowMs) {
+      uint64_t rate = (uint64_t)_windowBytes * 1000 / (now - _windowStart);
+      _windowStart = now;
+      _windowBytes = 0;
+      if (rate < _minRate) {
+        return "below minimum throughput";
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  uint32_t _timeoutMs = 0;
+  uint32_t _minRate = 0;
+  uint32_t _windowMs = 0;
+  uint32_t _lastData = 0;
+  uint32_t _windowStart = 0;
+  size_t _windowBytes = 0;
+};
+
+/**
+ * @brief Measured quality of one server (scheme, host and port)
+ */
+struct OTAMirrorScore {
+  uint32_t host = 0;           // Hash of the URL's authority
+  uint32_t latencyMs = 0;      // Connect + TTFB, 0 = never measured
+  uint32_t bytesPerSecond = 0; // Download throughput, 0 = never measured
+  uint8_t failures = 0;        // Consecutive failed requests
+};
+
+/**
+ * @brief Remembered mirror scores, most recently used first
+ *
+ * Samples are smoothed (each one counts a quarter), so one slow transfer
+ * does not demote a usually fast mirror. The least recently used host is
+ * dropped when the table is full.
+ */
+class OTAMirrorTable {
+public:
+  OTAMirrorScore entries[OTA_MIRROR_SCORES];
+  uint8_t count = 0;
+
+  /**
+   * @brief Record connect + TTFB of a successful request
+   */
+  void recordLatency(const char *url, uint32_t ms) {
+    OTAMirrorScore &e = touch(url);
+    e.latencyMs = smooth(e.latencyMs, ms);
+    e.failures = 0;
+  }
+
+  /**
+   * @brief Record the throughput of a completed download
+   */
+  void recordThroughput(const char *url, uint32_t bytesPerSecond) {
+    OTAMirrorScore &e = touch(url);
+    e.bytesPerSecond = smooth(e.bytesPerSecond, bytesPerSecond);
+  }
+
+  /**
+   * @brief Record a failed request or an interrupted download
+   */
+  void recordFailure(const char *url) {
+    OTAMirrorScore &e = touch(url);
+    if (e.failures < 255) {
+      e.failures++;
+    }
+  }
+
+  /**
+   * @brief Look up a URL's score
+   * @return Score, nullptr if the host was never seen
+   */
+  const OTAMirrorScore *find(const char *url) const {
+    uint32_t host = hostKey(url);
+    for (uint8_t i = 0; i < count; i++) {
+      if (entries[i].host == host) {
+        return &entries[i];
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief Sort sources best first
+   *
+   * Healthy sources come before failing ones. Among those, downloads
+   * prefer higher measured throughput and fall back to latency; manifest
+   * requests only look at latency. Unmeasured sources keep their listed
+   * order after measured ones.
+   * @param urls Candidate URLs
+   * @param n Number of candidates
+   * @param bulk true for firmware downloads
+   * @param order Receives indices into urls, best first
+   */
+  void rank(const char *const *urls, uint8_t n, bool bulk,
+            uint8_t *order) const {
+    for (uint8_t i = 0; i < n; i++) {
+      order[i] = i;
+      for (uint8_t j = i; j > 0 &&
+                          better(find(urls[order[j]]), find(urls[order[j - 1]]),
+                                 bulk);
+           j--) {
+        uint8_t tmp = order[j];
+        order[j] = order[j - 1];
+        order[j - 1] = tmp;
+      }
+    }
+  }
+
+  /**
+   * @brief Hash the scheme, host and port of a URL
+   */
+  static uint32_t hostKey(const char *url) {
+    const char *p = strstr(url, "://");
+    p = p ? p + 3 : url;
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const char *c = url; *c && (c < p || (*c != '/' && *c != '?'));
+         c++) {
+      hash = (hash ^ (uint8_t)(*c | 0x20)) * 16777619u;
+    }
+    return hash ? hash : 1;
+  }
+
+private:
+  static uint32_t smooth(uint32_t old, uint32_t sample) {
+    if (sample == 0) {
+      sample = 1; // 0 means unmeasured
+    }
+    return old == 0 ? sample : (old * 3 + sample) / 4;
+  }
+
+  static bool better(const OTAMirrorScore *a, const OTAMirrorScore *b,
+                     bool bulk) {
+    uint8_t failA = a ? a->failures : 0;
+    uint8_t failB = b ? b->failures : 0;
+    if (failA != failB) {
+      return failA < failB;
+    }
+    uint32_t bpsA = a ? a->bytesPerSecond : 0;
+    uint32_t bpsB = b ? b->bytesPerSecond : 0;
+    if (bulk && bpsA && bpsB) {
+      return bpsA > bpsB;
+    }
+    uint32_t latA = a ? a->latencyMs : 0;
+    uint32_t latB = b ? b->latencyMs : 0;
+    if (latA && latB) {
+      return latA < latB;
+    }
+    return latA && !latB;
+  }
+
+  // Move (or insert) the host to the front
+  OTAMirrorScore &touch(const char *url) {
+    uint32_t host = hostKey(url);
+    uint8_t i = 0;
+    while (i < count && entries[i].host != host) {
+      i++;
+    }
+    OTAMirrorScore entry;
+    if (i < count) {
+      entry = entries[i];
+    } else {
+      entry.host = host;
+      if (count < OTA_MIRROR_SCORES) {
+        count++;
+      }
+      i = count - 1; // Drops the least recently used when full
+    }
+    for (; i > 0; i--) {
+      entries[i] = entries[i - 1];
+    }
+    entries[0] = entry;
+    return entries[0];
+  }
+};
+
+/**
+ * @brief Kind of event an OTAReport describes
+ */
+enum OTAReportType {
+  OTA_REPORT_UPDATE = 0, // Check or install that did not end up to date
+  OTA_REPORT_BOOT,       // validateBoot() outcome other than OTA_BOOT_NORMAL
+  OTA_REPORT_ROLLBACK    // rollback() called
+};
+
+/**
+ * @brief One event queued for the server, see OTAClient::setReportUrl()
+ */
+struct OTAReport {
+  uint8_t type = OTA_REPORT_UPDATE; // OTAReportType
+  int8_t result = 0; // Result code, OTABootResult for OTA_REPORT_BOOT
+  uint32_t time = 0; // Epoch seconds, 0 if the clock was not set
+  OTAFixedString<OTA_VERSION_MAX> version; // Version the event is about
+  OTAFixedString<OTA_CHECK_NAME_MAX> check; // Failed health check
+  uint32_t downloadMs = 0;
+  uint32_t downloaded = 0;
+  uint32_t bytesPerSecond = 0;
+  uint8_t retries = 0;
+};
+
+/**
+ * @brief Fixed ring of reports waiting for upload, oldest first
+ *
+ * When it is full the oldest report is overwritten and counted in
+ * dropped, so the server at least learns that events were lost.
+ */
+struct OTAReportQueue {
+  OTAReport entries[OTA_REPORT_QUEUE];
+  uint8_t head = 0;
+  uint8_t count = 0;
+  uint32_t dropped = 0;
+
+  const OTAReport &at(uint8_t i) const {
+    return entries[(head + i) % OTA_REPORT_QUEUE];
+  }
+
+  void push(const OTAReport &report) {
+    if (count == OTA_REPORT_QUEUE) {
+      entries[head] = report;
+      head = (head + 1) % OTA_REPORT_QUEUE;
+      dropped++;
+      return;
+    }
+    entries[(head + count) % OTA_REPORT_QUEUE] = report;
+    count++;
+  }
+
+  // Forget the n oldest reports once the server has them
+  void drop(uint8_t n) {
+    n = min(n, count);
+    head = (head + n) % OTA_REPORT_QUEUE;
+    count -= n;
+    if (count == 0) {
+      dropped = 0;
+    }
+  }
+};
+
+/**
+ * @brief Records the persistent state is split into, one key each
+ *
+ * The main record only changes with an install, the manifest validators,
+ * staging or a report. The checkpoint is rewritten every 64 KB while
+ * downloading, and the statistics (counters, mirror scores) change with
+ * every check, so neither of them rewrites the main record. The schedule
+ * is a few bytes written whenever it changes, so a reboot never runs an
+ * old one.
+ */
+enum OTAStateRecord {
+  OTA_RECORD_MAIN = 0, // OTA_STATE_KEY
+  OTA_RECORD_RESUME,   // OTA_RESUME_KEY
+  OTA_RECORD_STATS,    // OTA_STATS_KEY
+  OTA_RECORD_SCHEDULE, // OTA_SCHEDULE_KEY
+  OTA_RECORD_COUNT
+};
+
+/**
+ * @brief Everything the client keeps across reboots
+ *
+ * Stored as versioned blobs, one per OTAStateRecord, so that saving is
+ * one NVS write per record however many of its fields changed. Strings
+ * are length-prefixed, so a record only takes the space its contents
+ * need; URLs are kept as hashes. Fields may be added at the end of a
+ * record without a version bump; decode() leaves missing ones at their
+ * defaults.
+ */
+struct OTAPersistentState {
+  // Last installed firmware (force update duplicate check)
+  String filename = "";
+  bool hasImageHash = false;
+  uint8_t imageHash[32] = {0};
+
+  // Validators of the last manifest that was up to date
+  uint32_t manifestKey = 0; // Hash of the running version and cohorts
+  uint32_t manifestUrl = 0; // Hash of the endpoint that sent them
+  String manifestETag = "";
+  String manifestModified = "";
+
+  // Resume checkpoint (OTA_RECORD_RESUME)
+  uint32_t resumeUrl = 0;    // Hash of the image URL, 0 if none
+  uint32_t resumeSource = 0; // Hash of the mirror the data came from
+  String resumeTag = "";
+  String resumePartition = "";
+  uint32_t resumeSize = 0;
+  uint32_t resumeOffset = 0;
+  uint8_t resumeHash[OTA_HASH_STATE_MAX]; // OTAImageWriter::hashState()
+  uint16_t resumeHashSize = 0;            // 0 if none
+
+  // Periodic check schedule (OTA_RECORD_SCHEDULE)
+  uint32_t nextCheckAt = 0;   // Epoch seconds, 0 if the clock was not set
+  uint32_t nextCheckWait = 0; // Remaining delay in ms
+  uint8_t failures = 0;
+
+  // Lifetime counters (OTA_RECORD_STATS)
+  uint32_t checks = 0;
+  uint32_t updates = 0;
+  uint32_t errors = 0;
+
+  OTAMirrorTable mirrors; // OTA_RECORD_STATS
+
+  // Where the last installed image lives, for serving it to peers
+  uint32_t imageSize = 0;
+  String imagePartition = "";
+
+  // Verified update waiting in the inactive slot, see OTA_STAGE_MANUAL
+  String stagedVersion = "";
+  String stagedFilename = "";
+  String stagedPartition = ""; // Empty when nothing is staged
+  uint32_t stagedSize = 0;
+  bool hasStagedHash = false;
+  uint8_t stagedHash[32] = {0};
+
+  OTAReportQueue reports;
+
+  /**
+   * @brief Storage key of a record
+   */
+  static const char *key(OTAStateRecord record) {
+    static const char *const keys[OTA_RECORD_COUNT] = {
+        OTA_STATE_KEY, OTA_RESUME_KEY, OTA_STATS_KEY, OTA_SCHEDULE_KEY};
+    return keys[record];
+  }
+
+  /**
+   * @brief Serialize one record into a buffer
+   * @return Record size, 0 if it did not fit
+   */
+  size_t encode(OTAStateRecord record, uint8_t *buf, size_t cap) const {
+    Writer w = {buf, cap, 0, true};
+    w.u8(OTA_STATE_VERSION);
+    if (record == OTA_RECORD_RESUME) {
+      w.u32(resumeUrl);
+      w.u32(resumeSource);
+      w.str(resumeTag);
+      w.str(resumePartition);
+      w.u32(resumeSize);
+      w.u32(resumeOffset);
+      w.u32(resumeHashSize);
+      w.bytes(resumeHash, resumeHashSize);
+    } else if (record == OTA_RECORD_SCHEDULE) {
+      w.u32(nextCheckAt);
+      w.u32(nextCheckWait);
+      w.u8(failures);
+    } else if (record == OTA_RECORD_STATS) {
+      w.u32(0); // Schedule, now in OTA_RECORD_SCHEDULE
+      w.u32(0);
+      w.u8(0);
+      w.u32(checks);
+      w.u32(updates);
+      w.u32(errors);
+      w.u8(mirrors.count);
+      for (uint8_t i = 0; i < mirrors.count; i++) {
+        const OTAMirrorScore &e = mirrors.entries[i];
+        w.u32(e.host);
+        w.u32(e.latencyMs);
+        w.u32(e.bytesPerSecond);
+        w.u8(e.failures);
+      }
+    } else {
+      w.str(filename);
+      w.u8(hasImageHash);
+      w.bytes(imageHash, sizeof(imageHash));
+      w.u32(manifestKey);
+      w.u32(manifestUrl);
+      w.str(manifestETag);
+      w.str(manifestModified);
+      w.u32(imageSize);
+      w.str(imagePartition);
+      w.str(stagedVersion);
+      w.str(stagedFilename);
+      w.str(stagedPartition);
+      w.u32(stagedSize);
+      w.u8(hasStagedHash);
+      w.bytes(stagedHash, sizeof(stagedHash));
+      w.u8(reports.count);
+      w.u32(reports.dropped);
+      for (uint8_t i = 0; i < reports.count; i++) {
+        const OTAReport &e = reports.at(i);
+        w.u8(e.type);
+        w.u8(e.result);
+        w.u32(e.time);
+        w.str(e.version.toString());
+        w.str(e.check.toString());
+        w.u32(e.downloadMs);
+        w.u32(e.downloaded);
+        w.u32(e.bytesPerSecond);
+        w.u8(e.retries);
+      }
+    }
+    return w.ok ? w.pos : 0;
+  }
+
+  /**
+   * @brief Restore one record from storage
+   * @return false if the record is malformed or from another version
+   */
+  bool decode(OTAStateRecord record, const uint8_t *buf, size_t len) {
+    Reader r = {buf, len, 0, true};
+    if (r.u8() != OTA_STATE_VERSION) {
+      return false;
+    }
+    if (record == OTA_RECORD_RESUME) {
+      resumeUrl = r.u32();
+      resumeSource = r.u32();
+      resumeTag = r.str();
+      resumePartition = r.str();
+      resumeSize = r.u32();
+      resumeOffset = r.u32();
+      uint32_t hashLen = r.u32();
+      resumeHashSize = hashLen <= sizeof(resumeHash) ? hashLen : 0;
+      if (resumeHashSize > 0) {
+        r.bytes(resumeHash, resumeHashSize);
+      } else {
+        r.skip(hashLen);
+      }
+    } else if (record == OTA_RECORD_SCHEDULE) {
+      nextCheckAt = r.u32();
+      nextCheckWait = r.u32();
+      failures = r.u8();
+    } else if (record == OTA_RECORD_STATS) {
+      r.skip(4 + 4 + 1); // Schedule, now in OTA_RECORD_SCHEDULE
+      checks = r.u32();
+      updates = r.u32();
+      errors = r.u32();
+      mirrors.count = min((int)r.u8(), OTA_MIRROR_SCORES);
+      for (uint8_t i = 0; i < mirrors.count; i++) {
+        OTAMirrorScore &e = mirrors.entries[i];
+        e.host = r.u32();
+        e.latencyMs = r.u32();
+        e.bytesPerSecond = r.u32();
+        e.failures = r.u8();
+      }
+    } else {
+      filename = r.str();
+      hasImageHash = r.u8();
+      r.bytes(imageHash, sizeof(imageHash));
+      manifestKey = r.u32();
+      manifestUrl = r.u32();
+      manifestETag = r.str();
+      manifestModified = r.str();
+      imageSize = r.u32();
+      imagePartition = r.str();
+      stagedVersion = r.str();
+      stagedFilename = r.str();
+      stagedPartition = r.str();
+      stagedSize = r.u32();
+      hasStagedHash = r.u8();
+      r.bytes(stagedHash, sizeof(stagedHash));
+      reports.head = 0;
+      reports.count = min((int)r.u8(), OTA_REPORT_QUEUE);
+      reports.dropped = r.u32();
+      for (uint8_t i = 0; i < reports.count; i++) {
+        OTAReport &e = reports.entries[i];
+        e.type = r.u8();
+        e.result = r.u8();
+        e.time = r.u32();
+        e.version = r.str();
+        e.check = r.str();
+        e.downloadMs = r.u32();
+        e.downloaded = r.u32();
+        e.bytesPerSecond = r.u32();
+        e.retries = r.u8();
+      }
+    }
+    return true; // Fields missing from an older, shorter record stay 0
+  }
+
+  /**
+   * @brief Give up the least useful part of a record that does not fit
+   *
+   * The main record drops its oldest report first (counted as dropped),
+   * then the manifest validators; the statistics lose the least recently
+   * used mirror score; the checkpoint is abandoned.
+   * @return false if nothing is left to drop
+   */
+  bool shed(OTAStateRecord record) {
+    if (record == OTA_RECORD_RESUME) {
+      if (resumeUrl == 0 && resumeTag.isEmpty()) {
+        return false;
+      }
+      resumeUrl = 0;
+      resumeOffset = 0;
+      resumeTag = "";
+      resumeHashSize = 0;
+      return true;
+    }
+    if (record == OTA_RECORD_SCHEDULE) {
+      return false; // Fixed size, always fits
+    }
+    if (record == OTA_RECORD_STATS) {
+      if (mirrors.count == 0) {
+        return false;
+      }
+      mirrors.count--;
+      return true;
+    }
+    if (reports.count > 0) {
+      uint32_t dropped = reports.dropped + 1;
+      reports.drop(1); // Resets the count once the queue is empty
+      reports.dropped = dropped;
+      return true;
+    }
+    if (!manifestETag.isEmpty() || !manifestModified.isEmpty()) {
+      manifestETag = "";
+      manifestModified = "";
+      return true;
+    }
+    return false;
+  }
+
+private:
+  struct Writer {
+    uint8_t *buf;
+    size_t cap;
+    size_t pos;
+    bool ok;
+
+    void bytes(const void *data, size_t len) {
+      if (pos + len > cap) {
+        ok = false;
+        return;
+      }
+      memcpy(buf + pos, data, len);
+      pos += len;
+    }
+    void u8(uint8_t v) { bytes(&v, 1); }
+    void u32(uint32_t v) { bytes(&v, 4); }
+    void str(const String &v) {
+      uint16_t len = v.length();
+      bytes(&len, 2);
+      bytes(v.c_str(), len);
+    }
+  };
+
+  struct Reader {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    bool ok; // false once a read ran past the end
+
+    void bytes(void *data, size_t n) {
+      if (pos + n > len) {
+        ok = false;
+        pos = len;
+        return;
+      }
+      memcpy(data, buf + pos, n);
+      pos += n;
+    }
+    void skip(size_t n) { pos = pos + n > len ? len : pos + n; }
+    uint8_t u8() {
+      uint8_t v = 0;
+      bytes(&v, 1);
+      return v;
+    }
+    uint32_t u32() {
+      uint32_t v = 0;
+      bytes(&v, 4);
+      return v;
+    }
+    String str() {
+      uint16_t n = 0;
+      bytes(&n, 2);
+      if (pos + n > len) {
+        ok = false;
+        pos = len;
+        return "";
+      }
+      String v;
+      v.reserve(n);
+      for (uint16_t i = 0; i < n; i++) {
+        v += (char)buf[pos + i];
+      }
+      pos += n;
+      return v;
+    }
+  };
+};
+/**
+ * @brief Destination of an update image
+ *
+ * Takes the image in pieces of any size and hashes it on the way.
+ * OTAFlashWriter is the ESP32 implementation; install another one with
+ * OTAClient::setFlashWriter(), e.g. one that keeps the image in memory for
+ * host tests. Partitions are named by label, so implementations need no
+ * ESP-IDF types.
+ */
+class OTAImageWriter {
+public:
+  virtual ~OTAImageWriter() {}
+
+  /**
+   * @brief Prepare a partition for writing
+   * @param label Partition label
+   * @param size Total image size in bytes, 0 if unknown (compressed streams)
+   * @param mode Erase strategy
+   * @param offset Resume offset; must be sector aligned and already written
+   * @return false if there is no such partition or the image does not fit
+   */
+  virtual bool begin(const char *label, size_t size,
+                     OTAEraseMode mode = OTA_ERASE_LOOKAHEAD,
+                     size_t offset = 0) = 0;
+
+  /**
+   * @brief SHA-256 the image as it is written, call right after begin()
+   * @param state Snapshot taken by hashState() at the resume offset, or
+   * nullptr when writing from byte 0
+   * @param size Bytes in state
+   * @return false if state was not taken by this implementation
+   */
+  virtual bool beginHash(const uint8_t *state = nullptr, size_t size = 0) = 0;
+
+  /**
+   * @brief Snapshot the hash covering exactly flushed() bytes
+   * @param state Receives an opaque, self-contained copy
+   * @param capacity Size of state
+   * @return Bytes stored, 0 if not hashing or state is too small
+   */
+  virtual size_t hashState(uint8_t *state, size_t capacity) = 0;
+
+  /**
+   * @brief Append image data
+   * @return false on write error or image overflow
+   */
+  virtual bool write(const uint8_t *data, size_t len) = 0;
+
+  /**
+   * @brief Flush buffered data and finish the hash
+   * @return true if the full image was written
+   */
+  virtual bool end() = 0;
+
+  /**
+   * @brief Check the written app image without making it bootable
+   * @return true if it is a valid app image
+   */
+  virtual bool verify() = 0;
+
+  /**
+   * @brief Make the written app image the boot partition
+   * @return false if the image is rejected
+   */
+  virtual bool activate() = 0;
+
+  /**
+   * @brief Stop writing; partition content is undefined
+   */
+  virtual void abort() = 0;
+
+  virtual size_t written() const = 0;    // Bytes accepted by write()
+  virtual size_t flushed() const = 0;    // Safe resume offset
+  virtual size_t skipped() const = 0;    // Sectors left untouched
+  virtual const char *label() const = 0; // Partition of the last begin()
+
+  /**
+   * @brief SHA-256 of the image, after a successful end()
+   * @return 32-byte digest, or nullptr if beginHash() was not called
+   */
+  virtual const uint8_t *digest() const = 0;
+};
+
+/**
+ * @brief Stream view of one HTTP response body
+ *
+ * Strips HTTP/1.1 chunked transfer encoding (HTTPClient only de-chunks
+ * inside getString()) and stops at Content-Length, so the manifest can be
+ * parsed straight from the socket. drain() consumes whatever the parser
+ * left behind, which keeps the connection usable for the next request.
+ */
+class OTABodyStream : public Stream {
+public:
+  /**
+   * @param in Socket stream positioned at the start of the body
+   * @param chunked true if Transfer-Encoding is chunked
+   * @param length Content-Length, -1 if unknown
+   */
+  OTABodyStream(Stream &in, bool chunked, int length)
+      : _in(in), _chunked(chunked), _length(length) {}
+
+  int available() override {
+    if (atEnd()) {
+      return 0;
+    }
+    int n = _in.available();
+    if (_chunked) {
+      return _remaining > 0 ? min(n, (int)_remaining) : (n > 0 ? 1 : 0);
+    }
+    return _length < 0 ? n : min(n, _length - _consumed);
+  }
+
+  int read() override {
+    if (_chunked ? !nextChunk() : atEnd()) {
+      return -1;
+    }
+    int c = _in.read();
+    if (c < 0) {
+      return c;
+    }
+    _consumed++;
+    if (_chunked && --_remaining == 0) {
+      readLine(); // CRLF after chunk data
+    }
+    return c;
+  }
+
+  int peek() override {
+    if (_chunked ? !nextChunk() : atEnd()) {
+      return -1;
+    }
+    return _in.peek();
+  }
+
+  /**
+   * @brief Read a block without splitting it into single-byte reads
+   *
+   * Only waits for the first byte range; after that it returns what has
+   * already arrived.
+   */
+  size_t readBytes(char *buffer, size_t length) override {
+    size_t total = 0;
+    while (total < length && (_chunked ? nextChunk() : !atEnd())) {
+      size_t want = length - total;
+      if (_chunked) {
+        want = min(want, _remaining);
+      } else if (_length >= 0) {
+        want = min(want, (size_t)(_length - _consumed));
+      }
+      if (total > 0) {
+        int ready = _in.available();
+        if (ready <= 0) {
+          break;
+        }
+        want = min(want, (size_t)ready);
+      }
+      size_t got = _in.readBytes(buffer + total, want);
+      if (got == 0) {
+        break;
+      }
+      total += got;
+      _consumed += got;
+      if (_chunked && (_remaining -= got) == 0) {
+        readLine(); // CRLF after chunk data
+      }
+    }
+    return total;
+  }
+  using Stream::readBytes;
+
+  size_t write(uint8_t) override { return 0; }
+
+  /**
+   * @brief Whether the whole body has been read
+   * @return false while more may follow (always for a body that is only
+   * delimited by connection close)
+   */
+  bool ended() const { return atEnd(); }
+
+  /**
+   * @brief Read and discard the rest of the body
+   * @return true if the body end was reached, false on timeout or if the
+   * body is only delimited by connection close
+   */
+  bool drain() {
+    if (!_chunked && _length < 0) {
+      return false;
+    }
+    while (!atEnd()) {
+      if (timedRead() < 0) {
+        return atEnd(); // Reading the last chunk header ends the body
+      }
+    }
+    return true;
+  }
+
+private:
+  Stream &_in;
+  bool _chunked;
+  bool _done = false;
+  int _length;
+  int _consumed = 0;
+  size_t _remaining = 0;
+
+  bool atEnd() const {
+    return _chunked ? _done : (_length >= 0 && _consumed >= _length);
+  }
+
+  /**
+   * @brief Consume one line without buffering it
+   * @return The hex number the line starts with (a chunk size), else 0
+   */
+  size_t readLine() {
+    size_t value = 0;
+    bool digits = true;
+    uint8_t c;
+    while (_in.readBytes(&c, 1) == 1 && c != '\n') {
+      char lower = c | 0x20;
+      int digit = (c >= '0' && c <= '9')           ? c - '0'
+                  : (lower >= 'a' && lower <= 'f') ? lower - 'a' + 10
+                                                   : -1;
+      if (digits && digit >= 0) {
+        value = value * 16 + digit;
+      } else {
+        digits = false; // Chunk extensions, CR
+      }
+    }
+    return value;
+  }
+
+  /**
+   * @brief Parse the next chunk header if the current chunk is used up
+   * @return true if data bytes are pending, false at end of body
+   */
+  bool nextChunk() {
+    if (_done) {
+      return false;
+    }
+    if (_remaining == 0) {
+      _remaining = readLine();
+      if (_remaining == 0) {
+        readLine(); // Empty line after last chunk
+        _done = true;
+        return false;
+      }
+    }
+    return true;
+  }
+};
+/**
+ * @brief HTTP connection the client sends its requests through
+ *
+ * The part of HTTPClient the client uses, plus connection reuse.
+ * OTATransport is the ESP32 implementation; install another one with
+ * OTAClient::setTransport(), e.g. one that replays recorded responses in
+ * host tests. One request at a time: begin(), headers, GET() or POST(),
+ * read the response, then release() to keep the connection for the next
+ * request, discard() if the body was not read to the end, or close().
+ * Redirects are never followed here; the client handles them.
+ */
+class OTAHttpTransport {
+public:
+  virtual ~OTAHttpTransport() {}
+
+  /**
+   * @brief Start a request, connecting unless a kept-alive one fits
+   * @param url Absolute http:// or https:// URL
+   * @return false if the URL is invalid or the server could not be
+   * connected or verified (see error())
+   */
+  virtual bool begin(const String &url) = 0;
+
+  /**
+   * @brief Reason the last begin() failed, or the last TLS error
+   */
+  virtual String error() = 0;
+
+  /**
+   * @brief Whether the current request went out on a kept-alive socket
+   */
+  virtual bool reused() const = 0;
+
+  /**
+   * @brief Whether HTTPS servers are verified at all
+   */
+  virtual bool verifying() const = 0;
+
+  virtual void setTimeout(uint16_t ms) = 0;
+  virtual void collectHeaders(const char *names[], size_t count) = 0;
+  virtual void addHeader(const String &name, const String &value) = 0;
+
+  /**
+   * @brief Send the request
+   * @return HTTP status code, negative if no response was received
+   */
+  virtual int GET() = 0;
+  virtual int POST(const String &body) = 0;
+
+  virtual int getSize() = 0; // Content-Length, -1 if unknown
+  virtual String header(const char *name) = 0; // "" unless collected
+  virtual String getLocation() = 0;
+  virtual Stream &getStream() = 0; // Positioned at the start of the body
+  virtual bool connected() = 0;
+
+  /**
+   * @brief Finish the current request, keeping the socket open if allowed
+   */
+  virtual void release() = 0;
+
+  /**
+   * @brief Drop the connection if a body could not be fully read
+   */
+  virtual void discard() = 0;
+
+  /**
+   * @brief Close the connection and release its resources
+   */
+  virtual void close() = 0;
+};
+
+#endif // OTA_CORE_H
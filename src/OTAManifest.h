@@ -0,0 +1,357 @@
+/*
+ * OTAManifest.h - platform-independent manifest handling of
+ * ESP32-OTA-Client
+ *
+ * The filter the manifest is parsed with, the capped allocator it is parsed
+ * into, and the per-entry decisions of a check: whether an updater entry
+ * targets this device (rollout, cohorts, minimum version) and how it is
+ * copied into UpdateInfo. Needs OTACore.h and ArduinoJson only, so it also
+ * builds on the host; see test/test_manifest and test/test_manifest_bench.
+ *
+ * License: MIT
+ */
+
+#ifndef OTA_MANIFEST_H
+#define OTA_MANIFEST_H
+
+#include "OTACore.h"
+#include <ArduinoJson.h>
+#include <stdlib.h>
+
+// Image verification
+#define OTA_SIGNATURE_MAX_SIZE 512 // RSA-4096
+
+// Mirrors
+#define OTA_MAX_SOURCES 4 // Manifest endpoints / firmware sources per entry
+
+// Multi-image updates
+#define OTA_MAX_IMAGES 2 // Data images per update, besides the app
+#define OTA_PARTITION_LABEL_MAX 17
+
+// UpdateInfo capacities (including the terminator); override with -D.
+// OTA_VERSION_MAX is in OTACore.h.
+#ifndef OTA_URL_MAX
+#define OTA_URL_MAX 256
+#endif
+#ifndef OTA_FILENAME_MAX
+#define OTA_FILENAME_MAX 64
+#endif
+#ifndef OTA_SIGNATURE_TEXT_MAX
+#define OTA_SIGNATURE_TEXT_MAX ((OTA_SIGNATURE_MAX_SIZE + 2) / 3 * 4 + 1)
+#endif
+#define OTA_SHA256_TEXT_MAX 65
+
+/**
+ * @brief Data partition image installed together with the app
+ */
+struct OTAImage {
+  OTAFixedString<OTA_PARTITION_LABEL_MAX> partition; // Partition label
+  OTAFixedString<OTA_URL_MAX> url;
+  OTAFixedString<OTA_SHA256_TEXT_MAX> sha256;       // Hex, empty if none
+  OTAFixedString<OTA_SIGNATURE_TEXT_MAX> signature; // Base64, of that hash
+};
+
+/**
+ * @brief Update information structure
+ *
+ * Fields are stored inline (see OTAFixedString), so a check never
+ * allocates for them. Sizes are set by OTA_VERSION_MAX, OTA_URL_MAX,
+ * OTA_FILENAME_MAX and OTA_SIGNATURE_TEXT_MAX; a longer field in the entry
+ * that would be installed fails the check (mirrors that do not fit are
+ * left out). This is about 4.3 KB with the defaults: bind it by reference.
+ */
+struct UpdateInfo {
+  bool available = false;
+  bool force = false;
+  OTAFixedString<OTA_VERSION_MAX> version;
+  OTAFixedString<OTA_URL_MAX> url;
+  OTAFixedString<OTA_FILENAME_MAX> filename;
+  OTAFixedString<OTA_URL_MAX> patchUrl; // Delta from the running version
+  bool compressed = false;              // url is served as gzip
+  OTAFixedString<OTA_SHA256_TEXT_MAX> sha256; // Hex SHA-256 of the image
+  OTAFixedString<OTA_SIGNATURE_TEXT_MAX> signature; // Base64, of that hash
+  OTAFixedString<OTA_URL_MAX> mirrors[OTA_MAX_SOURCES - 1]; // Same image
+  uint8_t mirrorCount = 0;
+  OTAImage images[OTA_MAX_IMAGES]; // Data partitions, written after the app
+  uint8_t imageCount = 0;
+};
+
+/**
+ * @brief ArduinoJson allocator with a hard memory cap
+ *
+ * Lets the manifest parser fail with NoMemory instead of exhausting the heap
+ * when a server lists more entries than the device can hold.
+ *
+ * Given an arena, blocks are carved from it instead of the heap: the block
+ * on top grows and shrinks in place, everything else is released at once
+ * when the last block is freed (i.e. when the document goes away).
+ */
+class OTAJsonAllocator : public ArduinoJson::Allocator {
+public:
+  /**
+   * @param limit Maximum bytes in use (and the arena size)
+   * @param arena Buffer of limit bytes, nullptr to use the heap
+   */
+  explicit OTAJsonAllocator(size_t limit, uint8_t *arena = nullptr)
+      : _limit(limit), _arena(arena) {}
+
+  void *allocate(size_t size) override {
+    if (_arena != nullptr) {
+      size_t need = kHeader + align(size);
+      if (_top + need > _limit) {
+        return nullptr;
+      }
+      uint8_t *block = _arena + _top;
+      *(size_t *)block = size;
+      _top += need;
+      _used += size;
+      _blocks++;
+      return block + kHeader;
+    }
+    if (_used + size > _limit) {
+      return nullptr;
+    }
+    uint8_t *block = (uint8_t *)malloc(size + kHeader);
+    if (block == nullptr) {
+      return nullptr;
+    }
+    *(size_t *)block = size;
+    _used += size;
+    return block + kHeader;
+  }
+
+  void deallocate(void *ptr) override {
+    if (ptr == nullptr) {
+      return;
+    }
+    uint8_t *block = (uint8_t *)ptr - kHeader;
+    _used -= *(size_t *)block;
+    if (_arena != nullptr) {
+      if (isTop(block)) {
+        _top = block - _arena;
+      }
+      if (--_blocks == 0) {
+        _top = 0;
+      }
+      return;
+    }
+    free(block);
+  }
+
+  void *reallocate(void *ptr, size_t size) override {
+    if (ptr == nullptr) {
+      return allocate(size);
+    }
+    uint8_t *block = (uint8_t *)ptr - kHeader;
+    size_t old = *(size_t *)block;
+    if (_arena != nullptr) {
+      if (isTop(block)) {
+        size_t top = block - _arena + kHeader + align(size);
+        if (top > _limit) {
+          return nullptr;
+        }
+        _top = top;
+        *(size_t *)block = size;
+        _used = _used - old + size;
+        return ptr;
+      }
+      void *moved = allocate(size);
+      if (moved != nullptr) {
+        memcpy(moved, ptr, min(old, size));
+        deallocate(ptr);
+      }
+      return moved;
+    }
+    if (size > old && _used + size - old > _limit) {
+      return nullptr;
+    }
+    block = (uint8_t *)realloc(block, size + kHeader);
+    if (block == nullptr) {
+      return nullptr;
+    }
+    *(size_t *)block = size;
+    _used = _used - old + size;
+    return block + kHeader;
+  }
+
+  size_t used() const { return _used; }
+
+private:
+  static const size_t kHeader = 8; // Keeps returned blocks 8-byte aligned
+  size_t _limit;
+  size_t _used = 0;
+  uint8_t *_arena;
+  size_t _top = 0;    // Arena bytes handed out
+  size_t _blocks = 0; // Live arena blocks
+
+  static size_t align(size_t size) { return (size + 7) & ~(size_t)7; }
+  bool isTop(const uint8_t *block) const {
+    return block + kHeader + align(*(const size_t *)block) == _arena + _top;
+  }
+};
+
+/**
+ * @brief Outcome of OTAManifest::targets()
+ */
+enum OTARolloutResult {
+  OTA_ROLLOUT_TARGETED = 0, // The entry is for this device
+  OTA_ROLLOUT_MIN_VERSION,  // Running version is below "minVersion"
+  OTA_ROLLOUT_COHORT,       // Lists cohorts, none of them ours
+  OTA_ROLLOUT_LATER         // "rollout" has not reached our bucket yet
+};
+
+/**
+ * @brief Manifest filter and updater entry decisions
+ *
+ * Stateless: everything about the device is passed in, so OTAClient and
+ * the host tests make the same decisions from the same JSON.
+ */
+class OTAManifest {
+public:
+  /**
+   * @brief Describe the manifest fields the client uses
+   *
+   * Everything else in the server response is skipped while parsing, so
+   * unknown fields cost no memory. Add new fields here.
+   * @param filter Document to fill with the ArduinoJson filter
+   */
+  static void buildFilter(JsonDocument &filter) {
+    filter["pollInterval"] = true;
+    filter["updater"][0]["device"] = true;
+    filter["updater"][0]["version"] = true;
+    filter["updater"][0]["force"] = true;
+    filter["updater"][0]["url"] = true;
+    filter["updater"][0]["patches"] = true;
+    filter["updater"][0]["compression"] = true;
+    filter["updater"][0]["sha256"] = true;
+    filter["updater"][0]["signature"] = true;
+    filter["updater"][0]["mirrors"] = true;
+    filter["updater"][0]["images"] = true;
+    filter["updater"][0]["rollout"] = true;
+    filter["updater"][0]["cohorts"] = true;
+    filter["updater"][0]["minVersion"] = true;
+  }
+
+  /**
+   * @brief Apply a manifest entry's rollout constraints to a device
+   * @param config Candidate updater entry
+   * @param running Running firmware version
+   * @param cohorts Cohort tags of the device
+   * @param cohortCount Number of cohorts
+   * @param bucket Rollout bucket of the device for this entry's version,
+   * 0 to 9999 (see OTAClient::getRolloutBucket())
+   * @return OTA_ROLLOUT_TARGETED, or why the entry is for other devices
+   */
+  static OTARolloutResult targets(JsonObject config, const OTAVersion &running,
+                                  const String *cohorts, uint8_t cohortCount,
+                                  uint16_t bucket) {
+    const char *minVersion = config["minVersion"] | "";
+    if (*minVersion && running < OTAVersion(minVersion)) {
+      return OTA_ROLLOUT_MIN_VERSION;
+    }
+
+    JsonArray tags = config["cohorts"].as<JsonArray>();
+    if (tags.size() > 0) {
+      bool member = false;
+      for (JsonVariant cohort : tags) {
+        const char *tag = cohort | "";
+        for (uint8_t i = 0; i < cohortCount && !member; i++) {
+          member = cohorts[i] == tag;
+        }
+      }
+      if (!member) {
+        return OTA_ROLLOUT_COHORT;
+      }
+    }
+
+    JsonVariant rollout = config["rollout"];
+    if (!rollout.isNull() && bucket >= rollout.as<float>() * 100) {
+      return OTA_ROLLOUT_LATER;
+    }
+    return OTA_ROLLOUT_TARGETED;
+  }
+
+  /**
+   * @brief Copy a manifest entry into an UpdateInfo
+   * @param config The chosen updater entry
+   * @param force Value for UpdateInfo::force
+   * @param name Filename view into the entry's url (see extractFilename())
+   * @param nameLength Filename length
+   * @param running Running firmware version, selects the entry's patch
+   * @param info Filled in; on failure it is left unavailable
+   * @return false if a field exceeds its UpdateInfo capacity, which fails
+   * the check
+   */
+  static bool select(JsonObject config, bool force, const char *name,
+                     size_t nameLength, const char *running,
+                     UpdateInfo &info) {
+    const char *compression = config["compression"] | "";
+    bool fits = info.version.assign(config["version"] | "") &&
+                info.url.assign(config["url"] | "") &&
+                info.filename.assign(name, nameLength) &&
+                info.patchUrl.assign(config["patches"][running] | "") &&
+                info.sha256.assign(config["sha256"] | "") &&
+                info.signature.assign(config["signature"] | "");
+
+    // Data images are all or nothing: a partial set is never installed
+    JsonArray images = config["images"].as<JsonArray>();
+    info.imageCount = 0;
+    fits = fits && images.size() <= OTA_MAX_IMAGES;
+    for (JsonObject entry : images) {
+      if (!fits) {
+        break;
+      }
+      OTAImage &image = info.images[info.imageCount++];
+      fits = image.partition.assign(entry["partition"] | "") &&
+             image.url.assign(entry["url"] | "") &&
+             image.sha256.assign(entry["sha256"] | "") &&
+             image.signature.assign(entry["signature"] | "") &&
+             !image.partition.isEmpty() && !image.url.isEmpty();
+    }
+
+    if (!fits) {
+      info.available = false;
+      info.imageCount = 0;
+      return false;
+    }
+    info.available = true;
+    info.force = force;
+    info.compressed = strcmp(compression, "gzip") == 0;
+
+    // Extra sources of the same image; ones that do not fit are left out
+    info.mirrorCount = 0;
+    for (JsonVariant mirror : config["mirrors"].as<JsonArray>()) {
+      if (info.mirrorCount == OTA_MAX_SOURCES - 1) {
+        break;
+      }
+      const char *source = mirror | "";
+      if (*source && info.mirrors[info.mirrorCount].assign(source)) {
+        info.mirrorCount++;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Extract filename from URL
+   *
+   * Works on a view of the URL, so nothing is copied.
+   * @param url The firmware URL
+   * @param length Receives the filename length (0 if there is none)
+   * @return Start of the filename inside url
+   */
+  static const char *extractFilename(const char *url, size_t &length) {
+    const char *end = strchr(url, '?'); // Remove query parameters if any
+    if (end == nullptr) {
+      end = url + strlen(url);
+    }
+    const char *start = end;
+    while (start > url && start[-1] != '/') {
+      start--;
+    }
+    length = start > url ? end - start : 0;
+    return start;
+  }
+};
+
+#endif // OTA_MANIFEST_H
@@ -0,0 +1,96 @@
+/*
+ * Arduino.h - host stand-in for the parts of the Arduino core OTACore.h
+ * uses: String, Stream and millis(). Only for the "native" test env.
+ */
+
+#ifndef OTA_MOCK_ARDUINO_H
+#define OTA_MOCK_ARDUINO_H
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+using std::max;
+using std::min;
+
+// Current time of millis(); tests move it forward by hand
+inline unsigned long mockMillis = 0;
+
+inline unsigned long millis() { return mockMillis; }
+
+inline bool isDigit(int c) { return c >= '0' && c <= '9'; }
+
+class String {
+public:
+  String(const char *s = "") : _s(s != nullptr ? s : "") {}
+  String(const std::string &s) : _s(s) {}
+
+  const char *c_str() const { return _s.c_str(); }
+  unsigned int length() const { return _s.length(); }
+  bool isEmpty() const { return _s.empty(); }
+  bool reserve(unsigned int size) {
+    _s.reserve(size);
+    return true;
+  }
+  bool startsWith(const char *prefix) const {
+    return _s.compare(0, strlen(prefix), prefix) == 0;
+  }
+  char operator[](unsigned int i) const { return i < _s.size() ? _s[i] : 0; }
+
+  String &operator+=(char c) {
+    _s += c;
+    return *this;
+  }
+  String &operator+=(const String &s) {
+    _s += s._s;
+    return *this;
+  }
+  friend String operator+(const String &a, const String &b) {
+    return String(a._s + b._s);
+  }
+
+  bool operator==(const String &s) const { return _s == s._s; }
+  bool operator==(const char *s) const { return s != nullptr && _s == s; }
+  bool operator!=(const String &s) const { return !(*this == s); }
+  bool operator!=(const char *s) const { return !(*this == s); }
+
+private:
+  std::string _s;
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  // No waiting on the host: a read that finds nothing ends the block
+  virtual size_t readBytes(char *buffer, size_t length) {
+    size_t n = 0;
+    while (n < length) {
+      int c = timedRead();
+      if (c < 0) {
+        break;
+      }
+      buffer[n++] = (char)c;
+    }
+    return n;
+  }
+  size_t readBytes(uint8_t *buffer, size_t length) {
+    return readBytes((char *)buffer, length);
+  }
+
+protected:
+  int timedRead() { return read(); }
+};
+
+#endif // OTA_MOCK_ARDUINO_H
@@ -0,0 +1,321 @@
+/*
+ * OTAMocks.h - in-memory implementations of the OTACore.h interfaces for
+ * the host tests: storage (OTAStorage), an image writer (OTAImageWriter)
+ * and a transport that replays scripted responses (OTAHttpTransport).
+ */
+
+#ifndef OTA_MOCKS_H
+#define OTA_MOCKS_H
+
+#include <OTACore.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Stream over a fixed byte string
+ */
+class MockStream : public Stream {
+public:
+  void load(const std::string &data) {
+    _data = data;
+    _pos = 0;
+  }
+
+  int available() override { return _data.size() - _pos; }
+  int read() override {
+    return _pos < _data.size() ? (uint8_t)_data[_pos++] : -1;
+  }
+  int peek() override {
+    return _pos < _data.size() ? (uint8_t)_data[_pos] : -1;
+  }
+  size_t write(uint8_t) override { return 0; }
+
+  size_t remaining() const { return _data.size() - _pos; }
+
+private:
+  std::string _data;
+  size_t _pos = 0;
+};
+
+/**
+ * @brief OTAStorage backed by a map, survives as long as the object
+ */
+class MockStorage : public OTAStorage {
+public:
+  std::map<std::string, std::string> values;
+  int opened = 0; // begin() calls without end()
+  int writes = 0;
+
+  bool begin(bool) override {
+    opened++;
+    return true;
+  }
+  void end() override { opened--; }
+
+  String getString(const char *key) override {
+    auto it = values.find(key);
+    return it != values.end() ? String(it->second) : String();
+  }
+  void putString(const char *key, const String &value) override {
+    values[key] = value.c_str();
+    writes++;
+  }
+  uint32_t getUInt(const char *key, uint32_t defaultValue) override {
+    auto it = values.find(key);
+    uint32_t value = defaultValue;
+    if (it != values.end() && it->second.size() == sizeof(value)) {
+      memcpy(&value, it->second.data(), sizeof(value));
+    }
+    return value;
+  }
+  void putUInt(const char *key, uint32_t value) override {
+    values[key] = std::string((const char *)&value, sizeof(value));
+    writes++;
+  }
+  size_t getBytes(const char *key, void *buf, size_t len) override {
+    auto it = values.find(key);
+    if (it == values.end() || it->second.size() > len) {
+      return 0;
+    }
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+  }
+  void putBytes(const char *key, const void *buf, size_t len) override {
+    values[key] = std::string((const char *)buf, len);
+    writes++;
+  }
+  void remove(const char *key) override { values.erase(key); }
+};
+
+/**
+ * @brief OTAImageWriter that keeps each partition's image in memory
+ *
+ * Every write is flushed at once, so flushed() == written(). The "hash"
+ * is 32-bit FNV-1a standing in for SHA-256: digest() holds it in its
+ * first four bytes and hashState() saves it as four bytes.
+ */
+class MockImageWriter : public OTAImageWriter {
+public:
+  std::map<std::string, std::string> partitions; // Label -> content
+  std::map<std::string, size_t> capacity;        // Label -> size
+  bool valid = true;                             // verify()/activate()
+  std::string active;                            // Last activated label
+  int aborts = 0;
+
+  bool begin(const char *name, size_t size,
+             OTAEraseMode mode = OTA_ERASE_LOOKAHEAD,
+             size_t offset = 0) override {
+    auto it = capacity.find(name);
+    if (it == capacity.end() || size > it->second ||
+        offset > partitions[name].size()) {
+      return false;
+    }
+    _label = name;
+    _size = size;
+    _mode = mode;
+    partitions[name].resize(offset);
+    _open = true;
+    _hashing = false;
+    _hashed = false;
+    return true;
+  }
+
+  bool beginHash(const uint8_t *state = nullptr, size_t size = 0) override {
+    if (state != nullptr && size != sizeof(_hash)) {
+      return false;
+    }
+    _hash = 2166136261u;
+    if (state != nullptr) {
+      memcpy(&_hash, state, sizeof(_hash));
+    }
+    _hashing = true;
+    return true;
+  }
+
+  size_t hashState(uint8_t *state, size_t capacity) override {
+    if (!_hashing || capacity < sizeof(_hash)) {
+      return 0;
+    }
+    memcpy(state, &_hash, sizeof(_hash));
+    return sizeof(_hash);
+  }
+
+  bool write(const uint8_t *data, size_t len) override {
+    std::string &image = partitions[_label];
+    if (!_open || (_size > 0 && image.size() + len > _size)) {
+      return false;
+    }
+    image.append((const char *)data, len);
+    for (size_t i = 0; i < len; i++) {
+      _hash = (_hash ^ data[i]) * 16777619u;
+    }
+    return true;
+  }
+
+  bool end() override {
+    bool ok = _open && (_size == 0 || written() == _size);
+    _open = false;
+    if (ok && _hashing) {
+      memset(_digest, 0, sizeof(_digest));
+      memcpy(_digest, &_hash, sizeof(_hash));
+      _hashed = true;
+    }
+    _hashing = false;
+    return ok;
+  }
+
+  bool verify() override { return valid && !_label.empty(); }
+  bool activate() override {
+    if (!verify()) {
+      return false;
+    }
+    active = _label;
+    return true;
+  }
+  void abort() override {
+    _open = false;
+    _hashing = false;
+    aborts++;
+  }
+
+  size_t written() const override {
+    auto it = partitions.find(_label);
+    return it != partitions.end() ? it->second.size() : 0;
+  }
+  size_t flushed() const override { return written(); }
+  size_t skipped() const override { return 0; }
+  const char *label() const override { return _label.c_str(); }
+  const uint8_t *digest() const override {
+    return _hashed ? _digest : nullptr;
+  }
+
+  OTAEraseMode mode() const { return _mode; }
+
+private:
+  std::string _label;
+  size_t _size = 0;
+  OTAEraseMode _mode = OTA_ERASE_LOOKAHEAD;
+  bool _open = false;
+  bool _hashing = false;
+  bool _hashed = false;
+  uint32_t _hash = 0;
+  uint8_t _digest[32];
+};
+
+/**
+ * @brief OTAHttpTransport that answers from a script of responses
+ *
+ * Each GET() or POST() takes the next response in order, so a recorded
+ * exchange (redirect hops, a 206 for a resumed download) replays exactly.
+ * Requests are logged for the test to inspect.
+ */
+class MockHttpTransport : public OTAHttpTransport {
+public:
+  struct Response {
+    int code = 200;
+    std::map<std::string, std::string> headers;
+    std::string body; // Sent as-is: include chunk framing if chunked
+    int size = -1;    // Content-Length, -1 if not sent
+  };
+
+  struct Request {
+    std::string url;
+    std::string method;
+    std::string body;
+    std::vector<std::pair<std::string, std::string>> headers;
+  };
+
+  std::deque<Response> script;
+  std::vector<Request> requests;
+  int releases = 0;
+  int discards = 0;
+  int closes = 0;
+
+  // Queue a plain response with a Content-Length
+  void respond(int code, const std::string &body) {
+    Response r;
+    r.code = code;
+    r.body = body;
+    r.size = body.size();
+    script.push_back(r);
+  }
+
+  bool begin(const String &url) override {
+    if (!url.startsWith("http://") && !url.startsWith("https://")) {
+      _error = "Invalid URL";
+      return false;
+    }
+    _error = "";
+    _reused = _open;
+    _open = true;
+    requests.push_back(Request());
+    requests.back().url = url.c_str();
+    return true;
+  }
+
+  String error() override { return _error; }
+  bool reused() const override { return _reused; }
+  bool verifying() const override { return false; }
+
+  void setTimeout(uint16_t) override {}
+  void collectHeaders(const char *[], size_t) override {}
+  void addHeader(const String &name, const String &value) override {
+    requests.back().headers.push_back({name.c_str(), value.c_str()});
+  }
+
+  int GET() override { return send("GET", ""); }
+  int POST(const String &body) override { return send("POST", body); }
+
+  int getSize() override { return _current.size; }
+  String header(const char *name) override {
+    auto it = _current.headers.find(name);
+    return it != _current.headers.end() ? String(it->second) : String();
+  }
+  String getLocation() override { return header("Location"); }
+  Stream &getStream() override { return _stream; }
+  bool connected() override { return _open && _stream.remaining() > 0; }
+
+  void release() override { releases++; }
+  void discard() override {
+    _open = false;
+    discards++;
+  }
+  void close() override {
+    _open = false;
+    closes++;
+  }
+
+  // Value of a request header, "" if it was not sent
+  static std::string sent(const Request &request, const char *name) {
+    for (const auto &h : request.headers) {
+      if (h.first == name) {
+        return h.second;
+      }
+    }
+    return "";
+  }
+
+private:
+  Response _current;
+  MockStream _stream;
+  String _error = "";
+  bool _open = false;
+  bool _reused = false;
+
+  int send(const char *method, const String &body) {
+    requests.back().method = method;
+    requests.back().body = body.c_str();
+    if (script.empty()) {
+      _open = false;
+      return -1; // Connection refused
+    }
+    _current = script.front();
+    script.pop_front();
+    _stream.load(_current.body);
+    return _current.code;
+  }
+};
+
+#endif // OTA_MOCKS_H
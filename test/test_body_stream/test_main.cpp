@@ -0,0 +1,81 @@
+#include <OTAMocks.h>
+#include <unity.h>
+
+static MockStream socket;
+
+void setUp() {}
+void tearDown() {}
+
+static std::string readAll(OTABodyStream &body) {
+  std::string out;
+  int c;
+  while ((c = body.read()) >= 0) {
+    out += (char)c;
+  }
+  return out;
+}
+
+void test_content_length_bounds_the_body() {
+  socket.load("hello" "HTTP/1.1 200 OK"); // Next response on the socket
+  OTABodyStream body(socket, false, 5);
+  TEST_ASSERT_EQUAL_STRING("hello", readAll(body).c_str());
+  TEST_ASSERT_TRUE(body.ended());
+  TEST_ASSERT_EQUAL(15, socket.remaining());
+}
+
+void test_strips_chunked_framing() {
+  socket.load("4;ext=1\r\nWiki\r\n5\r\npedia\r\n0\r\n\r\nNEXT");
+  OTABodyStream body(socket, true, -1);
+  TEST_ASSERT_EQUAL_STRING("Wikipedia", readAll(body).c_str());
+  TEST_ASSERT_TRUE(body.ended());
+  TEST_ASSERT_EQUAL(4, socket.remaining()); // Trailer consumed, not more
+}
+
+void test_read_bytes_crosses_chunks() {
+  socket.load("3\r\nabc\r\nA\r\n0123456789\r\n0\r\n\r\n");
+  OTABodyStream body(socket, true, -1);
+  char out[32];
+  size_t n = body.readBytes(out, sizeof(out));
+  TEST_ASSERT_EQUAL(13, n);
+  TEST_ASSERT_EQUAL_MEMORY("abc0123456789", out, 13);
+  TEST_ASSERT_TRUE(body.ended());
+}
+
+void test_read_bytes_stops_at_length() {
+  socket.load("0123456789");
+  OTABodyStream body(socket, false, 4);
+  char out[8];
+  TEST_ASSERT_EQUAL(4, body.readBytes(out, sizeof(out)));
+  TEST_ASSERT_EQUAL(0, body.available());
+  TEST_ASSERT_EQUAL(-1, body.read());
+}
+
+void test_drain_keeps_connection_usable() {
+  socket.load("2\r\n{}\r\n0\r\n\r\nNEXT");
+  OTABodyStream chunked(socket, true, -1);
+  TEST_ASSERT_TRUE(chunked.drain());
+  TEST_ASSERT_EQUAL(4, socket.remaining());
+
+  socket.load("until close");
+  OTABodyStream unbounded(socket, false, -1);
+  TEST_ASSERT_FALSE(unbounded.drain()); // Only ends with the connection
+  TEST_ASSERT_FALSE(unbounded.ended());
+}
+
+void test_truncated_body_is_not_ended() {
+  socket.load("3\r\nab");
+  OTABodyStream body(socket, true, -1);
+  TEST_ASSERT_EQUAL_STRING("ab", readAll(body).c_str());
+  TEST_ASSERT_FALSE(body.ended());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_content_length_bounds_the_body);
+  RUN_TEST(test_strips_chunked_framing);
+  RUN_TEST(test_read_bytes_crosses_chunks);
+  RUN_TEST(test_read_bytes_stops_at_length);
+  RUN_TEST(test_drain_keeps_connection_usable);
+  RUN_TEST(test_truncated_body_is_not_ended);
+  return UNITY_END();
+}
@@ -0,0 +1,176 @@
+#include <OTAManifest.h>
+#include <string>
+#include <unity.h>
+
+static JsonDocument filter;
+static UpdateInfo info;
+
+void setUp() { info = UpdateInfo(); }
+void tearDown() {}
+
+static const char *manifest = R"json({
+  "pollInterval": 600,
+  "notes": "Release notes the client never reads",
+  "updater": [{
+    "device": "esp32",
+    "version": "1.2.0",
+    "url": "https://ota.example/fw/fw-1.2.0.bin?token=abc",
+    "patches": {"1.1.0": "https://ota.example/fw/1.1.0-1.2.0.patch"},
+    "compression": "gzip",
+    "sha256": "ab12",
+    "mirrors": ["https://a.example/fw.bin", "", "https://b.example/fw.bin"],
+    "images": [{"partition": "spiffs", "url": "https://ota.example/fs.bin",
+                "sha256": "cd34"}],
+    "changelog": ["Fixed this", "Fixed that"]
+  }]
+})json";
+
+// Parse the way OTAClient::hasUpdate() does
+static JsonDocument parse(const std::string &json) {
+  JsonDocument doc;
+  DeserializationError error =
+      deserializeJson(doc, json, DeserializationOption::Filter(filter));
+  TEST_ASSERT_EQUAL_STRING("Ok", error.c_str());
+  return doc;
+}
+
+// Select the first updater entry, as OTAClient does once it matches
+static bool selectFirst(JsonDocument &doc, const char *running) {
+  JsonObject config = doc["updater"][0].as<JsonObject>();
+  const char *url = config["url"] | "";
+  size_t nameLength;
+  const char *name = OTAManifest::extractFilename(url, nameLength);
+  return OTAManifest::select(config, false, name, nameLength, running, info);
+}
+
+void test_filter_keeps_only_used_fields() {
+  JsonDocument doc = parse(manifest);
+  TEST_ASSERT_EQUAL(600, doc["pollInterval"] | 0);
+  TEST_ASSERT_TRUE(doc["notes"].isNull());
+  TEST_ASSERT_TRUE(doc["updater"][0]["changelog"].isNull());
+  TEST_ASSERT_EQUAL_STRING("1.2.0", doc["updater"][0]["version"] | "");
+  TEST_ASSERT_EQUAL_STRING("spiffs",
+                           doc["updater"][0]["images"][0]["partition"] | "");
+}
+
+void test_select_fills_update_info() {
+  JsonDocument doc = parse(manifest);
+  TEST_ASSERT_TRUE(selectFirst(doc, "1.1.0"));
+  TEST_ASSERT_TRUE(info.available);
+  TEST_ASSERT_FALSE(info.force);
+  TEST_ASSERT_TRUE(info.version == "1.2.0");
+  TEST_ASSERT_TRUE(info.filename == "fw-1.2.0.bin");
+  TEST_ASSERT_TRUE(info.patchUrl ==
+                   "https://ota.example/fw/1.1.0-1.2.0.patch");
+  TEST_ASSERT_TRUE(info.compressed);
+  TEST_ASSERT_TRUE(info.sha256 == "ab12");
+  TEST_ASSERT_EQUAL(2, info.mirrorCount); // The empty one is left out
+  TEST_ASSERT_TRUE(info.mirrors[1] == "https://b.example/fw.bin");
+  TEST_ASSERT_EQUAL(1, info.imageCount);
+  TEST_ASSERT_TRUE(info.images[0].partition == "spiffs");
+  TEST_ASSERT_TRUE(info.images[0].sha256 == "cd34");
+}
+
+void test_patch_only_for_running_version() {
+  JsonDocument doc = parse(manifest);
+  TEST_ASSERT_TRUE(selectFirst(doc, "1.0.0"));
+  TEST_ASSERT_TRUE(info.patchUrl.isEmpty());
+}
+
+void test_oversize_field_fails_the_entry() {
+  std::string url = "http://ota.example/" + std::string(OTA_URL_MAX, 'a');
+  JsonDocument doc =
+      parse("{\"updater\":[{\"version\":\"2.0.0\",\"url\":\"" + url + "\"}]}");
+  TEST_ASSERT_FALSE(selectFirst(doc, "1.0.0"));
+  TEST_ASSERT_FALSE(info.available);
+}
+
+void test_oversize_mirror_is_left_out() {
+  std::string mirror = "http://m.example/" + std::string(OTA_URL_MAX, 'a');
+  JsonDocument doc = parse("{\"updater\":[{\"version\":\"2.0.0\","
+                           "\"url\":\"http://ota.example/fw.bin\","
+                           "\"mirrors\":[\"" +
+                           mirror + "\",\"http://ok.example/fw.bin\"]}]}");
+  TEST_ASSERT_TRUE(selectFirst(doc, "1.0.0"));
+  TEST_ASSERT_EQUAL(1, info.mirrorCount);
+  TEST_ASSERT_TRUE(info.mirrors[0] == "http://ok.example/fw.bin");
+}
+
+void test_images_are_all_or_nothing() {
+  JsonDocument incomplete = parse(R"({"updater":[{"version":"2.0.0",
+      "url":"http://ota.example/fw.bin",
+      "images":[{"partition":"spiffs","url":"http://ota.example/fs.bin"},
+                {"partition":"assets"}]}]})");
+  TEST_ASSERT_FALSE(selectFirst(incomplete, "1"));
+  TEST_ASSERT_EQUAL(0, info.imageCount);
+
+  std::string images;
+  for (int i = 0; i <= OTA_MAX_IMAGES; i++) {
+    images += std::string(i ? "," : "") +
+              "{\"partition\":\"p\",\"url\":\"http://ota.example/p.bin\"}";
+  }
+  JsonDocument many = parse("{\"updater\":[{\"version\":\"2.0.0\","
+                            "\"url\":\"http://ota.example/fw.bin\","
+                            "\"images\":[" +
+                            images + "]}]}");
+  TEST_ASSERT_FALSE(selectFirst(many, "1"));
+}
+
+void test_rollout_constraints() {
+  JsonDocument doc = parse(R"({"updater":[
+      {"version":"2.0.0","minVersion":"1.5.0"},
+      {"version":"2.0.0","cohorts":["beta","lab"]},
+      {"version":"2.0.0","rollout":50},
+      {"version":"2.0.0"}]})");
+  JsonArray entries = doc["updater"].as<JsonArray>();
+  OTAVersion running("1.5.0");
+  String stable[] = {"stable"};
+  String lab[] = {"stable", "lab"};
+
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_MIN_VERSION,
+                    OTAManifest::targets(entries[0], OTAVersion("1.4.9"),
+                                         nullptr, 0, 0));
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_TARGETED,
+                    OTAManifest::targets(entries[0], running, nullptr, 0, 0));
+
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_COHORT,
+                    OTAManifest::targets(entries[1], running, stable, 1, 0));
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_COHORT,
+                    OTAManifest::targets(entries[1], running, nullptr, 0, 0));
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_TARGETED,
+                    OTAManifest::targets(entries[1], running, lab, 2, 0));
+
+  // "rollout": 50 reaches buckets 0 to 4999
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_TARGETED,
+                    OTAManifest::targets(entries[2], running, nullptr, 0,
+                                         4999));
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_LATER,
+                    OTAManifest::targets(entries[2], running, nullptr, 0,
+                                         5000));
+  TEST_ASSERT_EQUAL(OTA_ROLLOUT_TARGETED,
+                    OTAManifest::targets(entries[3], running, nullptr, 0,
+                                         9999));
+}
+
+void test_extract_filename() {
+  size_t length;
+  const char *name =
+      OTAManifest::extractFilename("http://h.example/a/fw.bin?x=1", length);
+  TEST_ASSERT_EQUAL_STRING("fw.bin", std::string(name, length).c_str());
+  OTAManifest::extractFilename("http://h.example/a/", length);
+  TEST_ASSERT_EQUAL(0, length);
+}
+
+int main() {
+  OTAManifest::buildFilter(filter);
+  UNITY_BEGIN();
+  RUN_TEST(test_filter_keeps_only_used_fields);
+  RUN_TEST(test_select_fills_update_info);
+  RUN_TEST(test_patch_only_for_running_version);
+  RUN_TEST(test_oversize_field_fails_the_entry);
+  RUN_TEST(test_oversize_mirror_is_left_out);
+  RUN_TEST(test_images_are_all_or_nothing);
+  RUN_TEST(test_rollout_constraints);
+  RUN_TEST(test_extract_filename);
+  return UNITY_END();
+}
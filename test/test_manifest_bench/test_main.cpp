@@ -0,0 +1,173 @@
+#include <OTAManifest.h>
+#include <OTAMocks.h>
+#include <chrono>
+#include <string>
+#include <unity.h>
+
+// Time and memory of OTAClient's manifest path: socket (MockStream) ->
+// OTABodyStream -> filtered deserializeJson() into a capped
+// OTAJsonAllocator. Allocations are compared against each other (the
+// counts depend on the ArduinoJson version); timings are only printed.
+
+#define BENCH_ENTRIES 16  // Updater entries in the generated manifest
+#define BENCH_RUNS 200    // Parses per timing
+#define BENCH_LIMIT 65536 // Allocator cap, well above any case here
+
+static JsonDocument filter;
+static MockStream wire;
+
+/**
+ * @brief Counts what ArduinoJson asks an OTAJsonAllocator for
+ */
+class CountingAllocator : public ArduinoJson::Allocator {
+public:
+  explicit CountingAllocator(OTAJsonAllocator &inner) : _inner(inner) {}
+
+  void *allocate(size_t size) override {
+    calls++;
+    return note(_inner.allocate(size));
+  }
+  void deallocate(void *ptr) override { _inner.deallocate(ptr); }
+  void *reallocate(void *ptr, size_t size) override {
+    calls++;
+    return note(_inner.reallocate(ptr, size));
+  }
+
+  size_t used() const { return _inner.used(); }
+
+  size_t calls = 0;
+  size_t peak = 0;
+
+private:
+  OTAJsonAllocator &_inner;
+
+  void *note(void *ptr) {
+    peak = max(peak, _inner.used());
+    return ptr;
+  }
+};
+
+struct ParseResult {
+  DeserializationError error = DeserializationError::Ok;
+  size_t entries = 0;
+  size_t calls = 0;
+  size_t peak = 0;
+  size_t leaked = 0; // Still allocated after the document is gone
+};
+
+void setUp() {}
+void tearDown() {}
+
+// A manifest with fields the client reads and ones it does not
+static std::string manifest(int entries) {
+  std::string json = "{\"pollInterval\":3600,\"updater\":[";
+  char entry[1024];
+  for (int i = 0; i < entries; i++) {
+    snprintf(entry, sizeof(entry),
+             "%s{\"device\":\"esp32\",\"version\":\"1.%d.0\","
+             "\"url\":\"https://ota.example/fw/fw-1.%d.0.bin\","
+             "\"sha256\":\"%064d\","
+             "\"mirrors\":[\"https://a.example/fw-1.%d.0.bin\","
+             "\"https://b.example/fw-1.%d.0.bin\"],"
+             "\"rollout\":25,\"cohorts\":[\"beta\"],"
+             "\"notes\":\"%0200d\",\"changelog\":[\"Fixed %d\",\"Added %d\"],"
+             "\"build\":{\"host\":\"ci-7\",\"id\":%d}}",
+             i ? "," : "", i, i, i, i, i, i, i, i, i);
+    json += entry;
+  }
+  return json + "]}";
+}
+
+static ParseResult parse(const std::string &json, bool filtered,
+                         size_t limit = BENCH_LIMIT,
+                         uint8_t *arena = nullptr) {
+  ParseResult result;
+  OTAJsonAllocator capped(limit, arena);
+  CountingAllocator allocator(capped);
+  {
+    JsonDocument doc(&allocator);
+    wire.load(json);
+    OTABodyStream body(wire, false, json.size());
+    result.error =
+        filtered
+            ? deserializeJson(doc, body, DeserializationOption::Filter(filter))
+            : deserializeJson(doc, body);
+    result.entries = doc["updater"].size();
+  }
+  result.calls = allocator.calls;
+  result.peak = allocator.peak;
+  result.leaked = allocator.used();
+  return result;
+}
+
+// Mean time of one parse in microseconds
+static double parseTime(const std::string &json, bool filtered,
+                        uint8_t *arena = nullptr) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    parse(json, filtered, BENCH_LIMIT, arena);
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / BENCH_RUNS;
+}
+
+void test_filter_reduces_peak_memory() {
+  std::string json = manifest(BENCH_ENTRIES);
+  ParseResult full = parse(json, false);
+  ParseResult filtered = parse(json, true);
+  TEST_ASSERT_EQUAL_STRING("Ok", full.error.c_str());
+  TEST_ASSERT_EQUAL_STRING("Ok", filtered.error.c_str());
+  TEST_ASSERT_EQUAL(BENCH_ENTRIES, filtered.entries);
+  TEST_ASSERT_TRUE(filtered.peak < full.peak);
+  TEST_ASSERT_EQUAL(0, full.leaked);
+  TEST_ASSERT_EQUAL(0, filtered.leaked);
+  printf("manifest: %zu bytes, %d entries\n", json.size(), BENCH_ENTRIES);
+  printf("  unfiltered: peak %zu B, %zu allocations\n", full.peak,
+         full.calls);
+  printf("  filtered:   peak %zu B, %zu allocations\n", filtered.peak,
+         filtered.calls);
+}
+
+void test_limit_fails_with_no_memory() {
+  std::string json = manifest(BENCH_ENTRIES);
+  ParseResult sized = parse(json, true);
+  TEST_ASSERT_EQUAL_STRING("Ok", parse(json, true, sized.peak).error.c_str());
+
+  ParseResult small = parse(json, true, sized.peak / 2);
+  TEST_ASSERT_EQUAL_STRING("NoMemory", small.error.c_str());
+  TEST_ASSERT_EQUAL(0, small.leaked);
+}
+
+void test_arena_matches_heap() {
+  static uint8_t arena[BENCH_LIMIT];
+  std::string json = manifest(BENCH_ENTRIES);
+  ParseResult heap = parse(json, true);
+  ParseResult carved = parse(json, true, sizeof(arena), arena);
+  TEST_ASSERT_EQUAL_STRING("Ok", carved.error.c_str());
+  TEST_ASSERT_EQUAL(heap.entries, carved.entries);
+  TEST_ASSERT_EQUAL(heap.calls, carved.calls);
+  TEST_ASSERT_EQUAL(0, carved.leaked);
+}
+
+void test_parse_time() {
+  static uint8_t arena[BENCH_LIMIT];
+  std::string json = manifest(BENCH_ENTRIES);
+  double full = parseTime(json, false);
+  double filtered = parseTime(json, true);
+  double carved = parseTime(json, true, arena);
+  printf("manifest: %.1f us unfiltered, %.1f us filtered, %.1f us arena "
+         "(mean of %d)\n",
+         full, filtered, carved, BENCH_RUNS);
+  TEST_ASSERT_TRUE(filtered > 0);
+}
+
+int main() {
+  OTAManifest::buildFilter(filter);
+  UNITY_BEGIN();
+  RUN_TEST(test_filter_reduces_peak_memory);
+  RUN_TEST(test_limit_fails_with_no_memory);
+  RUN_TEST(test_arena_matches_heap);
+  RUN_TEST(test_parse_time);
+  return UNITY_END();
+}
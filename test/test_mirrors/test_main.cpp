@@ -0,0 +1,112 @@
+#include <OTACore.h>
+#include <unity.h>
+
+void setUp() { mockMillis = 1000; }
+void tearDown() {}
+
+static const char *const urls[] = {"http://a.example/fw.bin",
+                                   "https://b.example:8443/fw.bin",
+                                   "http://c.example/fw.bin"};
+
+void test_host_key_ignores_path_and_case() {
+  TEST_ASSERT_EQUAL_UINT32(OTAMirrorTable::hostKey("http://A.example/x"),
+                           OTAMirrorTable::hostKey("http://a.example/y?z"));
+  TEST_ASSERT_TRUE(OTAMirrorTable::hostKey("http://a.example/") !=
+                   OTAMirrorTable::hostKey("https://a.example/"));
+}
+
+void test_ranks_by_throughput_for_downloads() {
+  OTAMirrorTable table;
+  table.recordLatency(urls[0], 50);
+  table.recordThroughput(urls[0], 100000);
+  table.recordLatency(urls[1], 200);
+  table.recordThroughput(urls[1], 900000);
+
+  uint8_t order[3];
+  table.rank(urls, 3, true, order);
+  TEST_ASSERT_EQUAL(1, order[0]);
+  TEST_ASSERT_EQUAL(0, order[1]);
+  TEST_ASSERT_EQUAL(2, order[2]); // Unmeasured after measured
+
+  table.rank(urls, 3, false, order); // Manifests: latency only
+  TEST_ASSERT_EQUAL(0, order[0]);
+  TEST_ASSERT_EQUAL(1, order[1]);
+}
+
+void test_failing_mirror_goes_last() {
+  OTAMirrorTable table;
+  table.recordLatency(urls[0], 10);
+  table.recordFailure(urls[0]);
+  uint8_t order[3];
+  table.rank(urls, 3, true, order);
+  TEST_ASSERT_EQUAL(0, order[2]);
+
+  table.recordLatency(urls[0], 10); // Success clears the failures
+  table.rank(urls, 3, true, order);
+  TEST_ASSERT_EQUAL(0, order[0]);
+}
+
+void test_drops_least_recently_used() {
+  OTAMirrorTable table;
+  char url[32];
+  for (int i = 0; i <= OTA_MIRROR_SCORES; i++) {
+    snprintf(url, sizeof(url), "http://m%d.example/", i);
+    table.recordLatency(url, 10 + i);
+  }
+  TEST_ASSERT_EQUAL(OTA_MIRROR_SCORES, table.count);
+  TEST_ASSERT_NULL(table.find("http://m0.example/"));
+  TEST_ASSERT_NOT_NULL(table.find(url));
+}
+
+void test_report_queue_overwrites_oldest() {
+  OTAReportQueue queue;
+  OTAReport report;
+  for (int i = 0; i < OTA_REPORT_QUEUE + 2; i++) {
+    report.result = i;
+    queue.push(report);
+  }
+  TEST_ASSERT_EQUAL(OTA_REPORT_QUEUE, queue.count);
+  TEST_ASSERT_EQUAL_UINT32(2, queue.dropped);
+  TEST_ASSERT_EQUAL(2, queue.at(0).result);
+
+  queue.drop(OTA_REPORT_QUEUE);
+  TEST_ASSERT_EQUAL(0, queue.count);
+  TEST_ASSERT_EQUAL_UINT32(0, queue.dropped); // Server has been told
+}
+
+void test_stall_monitor_timeout() {
+  OTAStallMonitor monitor;
+  monitor.begin(15000, 0, 10000);
+  mockMillis += 14999;
+  TEST_ASSERT_NULL(monitor.check());
+  monitor.received(512);
+  mockMillis += 15000;
+  TEST_ASSERT_NOT_NULL(monitor.check());
+}
+
+void test_stall_monitor_min_throughput() {
+  OTAStallMonitor monitor;
+  monitor.begin(0, 1000, 10000);
+  for (int i = 0; i < 10; i++) {
+    mockMillis += 1000;
+    monitor.received(2000);
+  }
+  TEST_ASSERT_NULL(monitor.check()); // 2000 B/s
+  for (int i = 0; i < 10; i++) {
+    mockMillis += 1000;
+    monitor.received(500);
+  }
+  TEST_ASSERT_NOT_NULL(monitor.check()); // 500 B/s
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_host_key_ignores_path_and_case);
+  RUN_TEST(test_ranks_by_throughput_for_downloads);
+  RUN_TEST(test_failing_mirror_goes_last);
+  RUN_TEST(test_drops_least_recently_used);
+  RUN_TEST(test_report_queue_overwrites_oldest);
+  RUN_TEST(test_stall_monitor_timeout);
+  RUN_TEST(test_stall_monitor_min_throughput);
+  return UNITY_END();
+}
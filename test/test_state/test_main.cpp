@@ -0,0 +1,154 @@
+#include <OTAMocks.h>
+#include <unity.h>
+
+static uint8_t buf[OTA_STATE_MAX_SIZE];
+
+void setUp() {}
+void tearDown() {}
+
+static OTAPersistentState roundTrip(const OTAPersistentState &in,
+                                    OTAStateRecord record) {
+  MockStorage storage;
+  size_t len = in.encode(record, buf, sizeof(buf));
+  TEST_ASSERT_TRUE(len > 0);
+  storage.putBytes(OTAPersistentState::key(record), buf, len);
+
+  OTAPersistentState out;
+  memset(buf, 0, sizeof(buf));
+  size_t got = storage.getBytes(OTAPersistentState::key(record), buf,
+                                sizeof(buf));
+  TEST_ASSERT_EQUAL(len, got);
+  TEST_ASSERT_TRUE(out.decode(record, buf, got));
+  return out;
+}
+
+void test_main_record_round_trip() {
+  OTAPersistentState in;
+  in.filename = "fw-1.2.0.bin";
+  in.hasImageHash = true;
+  in.imageHash[31] = 0xAB;
+  in.manifestKey = 0x1234;
+  in.manifestETag = "\"v42\"";
+  in.stagedPartition = "app1";
+  OTAReport report;
+  report.result = -3;
+  report.version = "1.2.0";
+  in.reports.push(report);
+
+  OTAPersistentState out = roundTrip(in, OTA_RECORD_MAIN);
+  TEST_ASSERT_TRUE(out.filename == "fw-1.2.0.bin");
+  TEST_ASSERT_TRUE(out.hasImageHash);
+  TEST_ASSERT_EQUAL_UINT8(0xAB, out.imageHash[31]);
+  TEST_ASSERT_EQUAL_UINT32(0x1234, out.manifestKey);
+  TEST_ASSERT_TRUE(out.manifestETag == "\"v42\"");
+  TEST_ASSERT_TRUE(out.stagedPartition == "app1");
+  TEST_ASSERT_EQUAL(1, out.reports.count);
+  TEST_ASSERT_EQUAL(-3, out.reports.at(0).result);
+  TEST_ASSERT_TRUE(out.reports.at(0).version == "1.2.0");
+}
+
+void test_records_are_independent() {
+  OTAPersistentState in;
+  in.filename = "fw.bin";
+  in.checks = 7;
+  in.resumeOffset = 65536;
+
+  // Each record only carries its own fields
+  OTAPersistentState stats = roundTrip(in, OTA_RECORD_STATS);
+  TEST_ASSERT_EQUAL_UINT32(7, stats.checks);
+  TEST_ASSERT_TRUE(stats.filename.isEmpty());
+  TEST_ASSERT_EQUAL_UINT32(0, stats.resumeOffset);
+
+  OTAPersistentState resume = roundTrip(in, OTA_RECORD_RESUME);
+  TEST_ASSERT_EQUAL_UINT32(65536, resume.resumeOffset);
+  TEST_ASSERT_EQUAL_UINT32(0, resume.checks);
+}
+
+void test_schedule_has_its_own_record() {
+  OTAPersistentState in;
+  in.nextCheckAt = 1700000000;
+  in.nextCheckWait = 300000;
+  in.failures = 2;
+  in.checks = 5;
+
+  OTAPersistentState schedule = roundTrip(in, OTA_RECORD_SCHEDULE);
+  TEST_ASSERT_EQUAL_UINT32(1700000000, schedule.nextCheckAt);
+  TEST_ASSERT_EQUAL_UINT32(300000, schedule.nextCheckWait);
+  TEST_ASSERT_EQUAL(2, schedule.failures);
+  TEST_ASSERT_EQUAL_UINT32(0, schedule.checks);
+
+  OTAPersistentState stats = roundTrip(in, OTA_RECORD_STATS);
+  TEST_ASSERT_EQUAL_UINT32(5, stats.checks);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.nextCheckAt);
+  TEST_ASSERT_FALSE(in.shed(OTA_RECORD_SCHEDULE));
+}
+
+void test_resume_hash_state() {
+  OTAPersistentState in;
+  in.resumeUrl = 99;
+  in.resumeHashSize = 4;
+  memcpy(in.resumeHash, "\x01\x02\x03\x04", 4);
+
+  OTAPersistentState out = roundTrip(in, OTA_RECORD_RESUME);
+  TEST_ASSERT_EQUAL_UINT32(99, out.resumeUrl);
+  TEST_ASSERT_EQUAL(4, out.resumeHashSize);
+  TEST_ASSERT_EQUAL_MEMORY("\x01\x02\x03\x04", out.resumeHash, 4);
+}
+
+void test_rejects_other_versions() {
+  OTAPersistentState in;
+  size_t len = in.encode(OTA_RECORD_MAIN, buf, sizeof(buf));
+  buf[0] = OTA_STATE_VERSION + 1;
+  OTAPersistentState out;
+  TEST_ASSERT_FALSE(out.decode(OTA_RECORD_MAIN, buf, len));
+}
+
+void test_short_record_keeps_defaults() {
+  // A record written before fields were appended decodes with defaults
+  OTAPersistentState in;
+  in.checks = 3;
+  size_t len = in.encode(OTA_RECORD_STATS, buf, sizeof(buf));
+  OTAPersistentState out;
+  TEST_ASSERT_TRUE(out.decode(OTA_RECORD_STATS, buf, 1 + 4 + 4 + 1 + 4));
+  TEST_ASSERT_EQUAL_UINT32(3, out.checks);
+  TEST_ASSERT_EQUAL(0, out.mirrors.count);
+  TEST_ASSERT_TRUE(len > 1 + 4 + 4 + 1 + 4);
+}
+
+void test_shed_drops_reports_then_validators() {
+  OTAPersistentState state;
+  state.manifestETag = "tag";
+  OTAReport report;
+  state.reports.push(report);
+  state.reports.push(report);
+
+  TEST_ASSERT_TRUE(state.shed(OTA_RECORD_MAIN));
+  TEST_ASSERT_EQUAL(1, state.reports.count);
+  TEST_ASSERT_EQUAL_UINT32(1, state.reports.dropped);
+  TEST_ASSERT_TRUE(state.shed(OTA_RECORD_MAIN));
+  TEST_ASSERT_EQUAL(0, state.reports.count);
+  TEST_ASSERT_EQUAL_UINT32(2, state.reports.dropped); // Still counted
+  TEST_ASSERT_TRUE(state.shed(OTA_RECORD_MAIN));
+  TEST_ASSERT_TRUE(state.manifestETag.isEmpty());
+  TEST_ASSERT_FALSE(state.shed(OTA_RECORD_MAIN));
+}
+
+void test_encode_fails_when_full() {
+  OTAPersistentState state;
+  state.filename = "a-rather-long-firmware-file-name.bin";
+  uint8_t small[16];
+  TEST_ASSERT_EQUAL(0, state.encode(OTA_RECORD_MAIN, small, sizeof(small)));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_main_record_round_trip);
+  RUN_TEST(test_records_are_independent);
+  RUN_TEST(test_schedule_has_its_own_record);
+  RUN_TEST(test_resume_hash_state);
+  RUN_TEST(test_rejects_other_versions);
+  RUN_TEST(test_short_record_keeps_defaults);
+  RUN_TEST(test_shed_drops_reports_then_validators);
+  RUN_TEST(test_encode_fails_when_full);
+  return UNITY_END();
+}
@@ -0,0 +1,180 @@
+#include <OTAMocks.h>
+#include <unity.h>
+
+// Replays recorded exchanges through the same interface calls OTAClient
+// makes: response stream -> OTABodyStream -> OTAImageWriter, with the
+// checkpoint going through OTAPersistentState and OTAStorage.
+
+static MockHttpTransport http;
+static MockImageWriter writer;
+static MockStorage storage;
+
+void setUp() {
+  http = MockHttpTransport();
+  writer = MockImageWriter();
+  writer.capacity["app1"] = 64 * 1024;
+  storage = MockStorage();
+}
+void tearDown() {}
+
+static std::string image(size_t size) {
+  std::string data;
+  for (size_t i = 0; i < size; i++) {
+    data += (char)(i * 7 + 1);
+  }
+  return data;
+}
+
+// Copy a response body into the writer
+static size_t pump(OTABodyStream &body, size_t limit = SIZE_MAX) {
+  uint8_t buffer[512];
+  size_t total = 0;
+  while (total < limit && !body.ended()) {
+    size_t n = body.readBytes((char *)buffer,
+                              min(sizeof(buffer), limit - total));
+    if (n == 0 || !writer.write(buffer, n)) {
+      break;
+    }
+    total += n;
+  }
+  return total;
+}
+
+static std::string chunked(const std::string &data, size_t chunk) {
+  std::string out;
+  char header[16];
+  for (size_t pos = 0; pos < data.size(); pos += chunk) {
+    size_t n = min(chunk, data.size() - pos);
+    snprintf(header, sizeof(header), "%zx\r\n", n);
+    out += header + data.substr(pos, n) + "\r\n";
+  }
+  return out + "0\r\n\r\n";
+}
+
+void test_replays_redirect_then_chunked_image() {
+  std::string fw = image(3000);
+  MockHttpTransport::Response redirect;
+  redirect.code = 302;
+  redirect.headers["Location"] = "http://cdn.example/fw.bin";
+  redirect.size = 0;
+  http.script.push_back(redirect);
+  MockHttpTransport::Response body;
+  body.headers["Transfer-Encoding"] = "chunked";
+  body.body = chunked(fw, 700);
+  http.script.push_back(body);
+
+  TEST_ASSERT_TRUE(http.begin("http://ota.example/fw.bin"));
+  TEST_ASSERT_EQUAL(302, http.GET());
+  String location = http.getLocation();
+  http.release();
+  TEST_ASSERT_TRUE(http.begin(location));
+  TEST_ASSERT_TRUE(http.reused());
+  TEST_ASSERT_EQUAL(200, http.GET());
+
+  OTABodyStream stream(http.getStream(),
+                       http.header("Transfer-Encoding") == "chunked",
+                       http.getSize());
+  TEST_ASSERT_TRUE(writer.begin("app1", 0));
+  TEST_ASSERT_TRUE(writer.beginHash());
+  TEST_ASSERT_EQUAL(fw.size(), pump(stream));
+  TEST_ASSERT_TRUE(stream.ended());
+  TEST_ASSERT_TRUE(writer.end());
+  TEST_ASSERT_TRUE(writer.partitions["app1"] == fw);
+  TEST_ASSERT_NOT_NULL(writer.digest());
+  TEST_ASSERT_EQUAL(2, http.requests.size());
+  TEST_ASSERT_EQUAL_STRING("http://cdn.example/fw.bin",
+                           http.requests[1].url.c_str());
+}
+
+void test_resumed_download_matches_full_hash() {
+  std::string fw = image(10000);
+
+  // Uninterrupted reference
+  writer.begin("app1", fw.size());
+  writer.beginHash();
+  writer.write((const uint8_t *)fw.data(), fw.size());
+  TEST_ASSERT_TRUE(writer.end());
+  uint8_t expected[32];
+  memcpy(expected, writer.digest(), sizeof(expected));
+
+  // First attempt: the connection drops after 4096 bytes
+  http.respond(200, fw.substr(0, 4096));
+  http.begin("http://ota.example/fw.bin");
+  http.GET();
+  OTABodyStream first(http.getStream(), false, fw.size());
+  writer.begin("app1", fw.size());
+  writer.beginHash();
+  pump(first);
+  TEST_ASSERT_FALSE(first.ended());
+  http.discard();
+
+  OTAPersistentState saved;
+  saved.resumeOffset = writer.flushed();
+  saved.resumeHashSize =
+      writer.hashState(saved.resumeHash, sizeof(saved.resumeHash));
+  TEST_ASSERT_TRUE(saved.resumeHashSize > 0);
+  uint8_t record[OTA_STATE_MAX_SIZE];
+  size_t len = saved.encode(OTA_RECORD_RESUME, record, sizeof(record));
+  storage.putBytes(OTA_RESUME_KEY, record, len);
+  writer.abort();
+
+  // After the reboot: restore the checkpoint, ask for the rest
+  OTAPersistentState restored;
+  len = storage.getBytes(OTA_RESUME_KEY, record, sizeof(record));
+  TEST_ASSERT_TRUE(restored.decode(OTA_RECORD_RESUME, record, len));
+  TEST_ASSERT_EQUAL(4096, restored.resumeOffset);
+
+  MockHttpTransport::Response rest;
+  rest.code = 206;
+  rest.body = fw.substr(4096);
+  rest.size = rest.body.size();
+  rest.headers["Content-Range"] = "bytes 4096-9999/10000";
+  http.script.push_back(rest);
+  http.begin("http://ota.example/fw.bin");
+  http.addHeader("Range", "bytes=4096-");
+  TEST_ASSERT_EQUAL(206, http.GET());
+  TEST_ASSERT_EQUAL_STRING(
+      "bytes=4096-", MockHttpTransport::sent(http.requests.back(), "Range")
+                         .c_str());
+
+  OTABodyStream second(http.getStream(), false, http.getSize());
+  TEST_ASSERT_TRUE(writer.begin("app1", fw.size(), OTA_ERASE_LOOKAHEAD,
+                                restored.resumeOffset));
+  TEST_ASSERT_TRUE(
+      writer.beginHash(restored.resumeHash, restored.resumeHashSize));
+  pump(second);
+  TEST_ASSERT_TRUE(writer.end());
+  TEST_ASSERT_TRUE(writer.partitions["app1"] == fw);
+  TEST_ASSERT_EQUAL_MEMORY(expected, writer.digest(), sizeof(expected));
+}
+
+void test_foreign_hash_state_is_rejected() {
+  uint8_t state[OTA_HASH_STATE_MAX] = {0};
+  writer.begin("app1", 100);
+  TEST_ASSERT_FALSE(writer.beginHash(state, sizeof(state)));
+  TEST_ASSERT_TRUE(writer.beginHash());
+}
+
+void test_writer_rejects_unknown_partition_and_overflow() {
+  TEST_ASSERT_FALSE(writer.begin("nvs", 100));
+  TEST_ASSERT_FALSE(writer.begin("app1", 128 * 1024));
+  TEST_ASSERT_TRUE(writer.begin("app1", 4));
+  TEST_ASSERT_FALSE(writer.write((const uint8_t *)"12345", 5));
+}
+
+void test_unscripted_request_fails() {
+  TEST_ASSERT_FALSE(http.begin("ftp://ota.example/"));
+  TEST_ASSERT_TRUE(http.begin("http://ota.example/"));
+  TEST_ASSERT_TRUE(http.GET() < 0);
+  TEST_ASSERT_FALSE(http.connected());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_replays_redirect_then_chunked_image);
+  RUN_TEST(test_resumed_download_matches_full_hash);
+  RUN_TEST(test_foreign_hash_state_is_rejected);
+  RUN_TEST(test_writer_rejects_unknown_partition_and_overflow);
+  RUN_TEST(test_unscripted_request_fails);
+  return UNITY_END();
+}
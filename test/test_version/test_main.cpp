@@ -0,0 +1,58 @@
+#include <OTACore.h>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+void test_orders_numerically() {
+  TEST_ASSERT_TRUE(OTAVersion("1.10.0") > OTAVersion("1.9.0"));
+  TEST_ASSERT_TRUE(OTAVersion("2.0.0") > OTAVersion("1.99.99"));
+  TEST_ASSERT_TRUE(OTAVersion("1.0.1") > OTAVersion("1.0"));
+  TEST_ASSERT_TRUE(OTAVersion("v1.2.3") == OTAVersion("1.2.3+build.7"));
+}
+
+void test_ranks_pre_releases() {
+  TEST_ASSERT_TRUE(OTAVersion("1.0.0-rc.1") < OTAVersion("1.0.0"));
+  TEST_ASSERT_TRUE(OTAVersion("1.0.0-alpha") < OTAVersion("1.0.0-beta"));
+  TEST_ASSERT_TRUE(OTAVersion("1.0.0-beta") < OTAVersion("1.0.0-rc"));
+  TEST_ASSERT_TRUE(OTAVersion("1.0.0-rc.2") < OTAVersion("1.0.0-rc.10"));
+  TEST_ASSERT_TRUE(OTAVersion("1.0.0-rc.1").isPrerelease());
+  TEST_ASSERT_FALSE(OTAVersion("1.0.0").isPrerelease());
+}
+
+void test_rejects_garbage() {
+  TEST_ASSERT_FALSE(OTAVersion("latest").isValid());
+  TEST_ASSERT_FALSE(OTAVersion((const char *)nullptr).isValid());
+  TEST_ASSERT_TRUE(OTAVersion("latest") < OTAVersion("0.0.1"));
+  TEST_ASSERT_EQUAL_STRING("invalid", OTAVersion("x").toString().c_str());
+}
+
+void test_clamps_and_formats() {
+  OTAVersion v("1.2.999999");
+  TEST_ASSERT_EQUAL_UINT16(1, v.major());
+  TEST_ASSERT_EQUAL_UINT16(2, v.minor());
+  TEST_ASSERT_EQUAL_UINT16(65535, v.patch());
+  TEST_ASSERT_EQUAL_STRING("3.4.5-pre",
+                           OTAVersion("3.4.5-rc.1").toString().c_str());
+}
+
+void test_fixed_string_capacity() {
+  OTAFixedString<4> s;
+  TEST_ASSERT_TRUE(s.assign("abc"));
+  TEST_ASSERT_TRUE(s == "abc");
+  TEST_ASSERT_EQUAL(3, s.length());
+  TEST_ASSERT_FALSE(s.assign("abcd")); // No room for the terminator
+  TEST_ASSERT_TRUE(s.isEmpty());
+  s = String("xy");
+  TEST_ASSERT_TRUE(String("xy") == s);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_orders_numerically);
+  RUN_TEST(test_ranks_pre_releases);
+  RUN_TEST(test_rejects_garbage);
+  RUN_TEST(test_clamps_and_formats);
+  RUN_TEST(test_fixed_string_capacity);
+  return UNITY_END();
+}